@@ -0,0 +1,58 @@
+
+/*
+ * Copyright (C) xunen <leixunen@gmail.com> and others.
+ * Copyright (C) Leevid Inc.
+ */
+
+
+#ifndef _NGX_HTTP_EFLV_INDEX_FILE_H_INCLUDED_
+#define _NGX_HTTP_EFLV_INDEX_FILE_H_INCLUDED_
+
+
+/*
+ * The sidecar keyframe index, "movie.flv.eidx" for "movie.flv".
+ *
+ * The file is mapped as is, so all fields are in the host byte order
+ * of the generating machine; a file written with another byte order
+ * fails the version check and is ignored.  The header is followed by
+ *
+ *     double    times[keyframes];
+ *     int64_t   filepositions[keyframes];
+ *     u_char    metadata[metadata_len];     onMetaData tag
+ *     u_char    video[video_len];           video sequence header tag
+ *     u_char    audio[audio_len];           audio sequence header tag
+ *
+ * where each tag includes its header and the trailing PreviousTagSize.
+ */
+
+
+#define NGX_HTTP_EFLV_INDEX_FILE_EXT      ".eidx"
+#define NGX_HTTP_EFLV_INDEX_FILE_MAGIC    "EIDX"
+#define NGX_HTTP_EFLV_INDEX_FILE_VERSION  2
+
+
+typedef struct {
+    u_char                magic[4];
+    uint32_t              version;
+
+    /* the source file the index was built from */
+    uint64_t              size;
+    int64_t               mtime;
+
+    double                duration;
+    uint64_t              keyframes;
+
+    /* offset of the duration value within the metadata tag, or 0 */
+    uint64_t              duration_offset;
+
+    uint64_t              metadata_len;
+    uint64_t              video_len;
+    uint64_t              audio_len;
+
+    /* offsets of the sequence header tags in the source file, or 0 */
+    uint64_t              video_pos;
+    uint64_t              audio_pos;
+} ngx_http_eflv_index_file_t;
+
+
+#endif /* _NGX_HTTP_EFLV_INDEX_FILE_H_INCLUDED_ */
@@ -8,6 +8,11 @@
 #include <ngx_config.h>
 #include <ngx_core.h>
 #include <ngx_http.h>
+#include <nginx.h>
+
+#include "ngx_http_eflv_index_file.h"
+#include "ngx_http_eflv_parse.h"
+#include "ngx_http_eflv_ts.h"
 
 
 typedef struct {
@@ -16,90 +21,379 @@ typedef struct {
 } ngx_flv_h264_tag_t;
 
 
+#if 0
+typedef struct {
+    u_char                flags
+} ngx_flv_audio_data_t;
+#endif
+
+
 typedef struct {
-    u_char                signature[3];
-    u_char                version;
     u_char                flags;
-    u_char                headersize[4];
-} ngx_flv_header_t;
+} ngx_flv_video_data_t;
 
 
 typedef struct {
-    ngx_int_t             haskeyframes;
-    ngx_int_t             hasvideo;
-    ngx_int_t             hasaudio;
-    ngx_int_t             hasmetadata;
-    ngx_int_t             hascuePoints;
-    ngx_int_t             canseekToEnd;
-
-    double                audiocodecid;
-    double                audiosamplerate;
-    double                audiodatarate;
-    double                audiosamplesize;
-    double                audiodelay;
-
-    ngx_int_t             stereo;
-
-    double                videocodecid;
-    double                framerate;
-    double                videodatarate;
-    double                height;
-    double                width;
-
-    double                datasize;
-    double                audiosize;
-    double                videosize;
-    double                filesize;
-
-    double                lasttimestamp;
-    double                lastvideoframetimestamp;
-    double                lastkeyframetimestamp;
-    double                lastkeyframelocation;
-
-    ngx_int_t             keyframes;
-
-    double               *filepositions;
+    double                duration;
+
+    ngx_uint_t            keyframes;
     double               *times;
+    off_t                *filepositions;
+
+    ngx_str_t             metadata;
+    size_t                duration_offset;
+    ngx_str_t             video;
+    ngx_str_t             audio;
+
+    /* offsets of the sequence header tags in the file, or 0 */
+    off_t                 video_pos;
+    off_t                 audio_pos;
+} ngx_http_eflv_index_t;
+
+
+typedef struct {
+    ngx_uint_t            start_index;
+    /* the first keyframe past the clip, or the number of keyframes */
+    ngx_uint_t            end_index;
+
+    double                start_time;
     double                duration;
+} ngx_http_eflv_clip_t;
 
-    char                  metadatacreator[256];
-    char                  creator[256];
 
-    ngx_int_t             onmetadatalength;
-    ngx_int_t             metadatasize;
-    size_t                onlastsecondlength;
-    size_t                lastsecondsize;
-    ngx_int_t             hasLastsecond;
-    ngx_int_t             lastsecondtagCount;
-    size_t                onlastkeyframelength;
-    size_t                lastkeyframesize;
-    ngx_int_t             hasLastKeyframe;
-} ngx_flv_meta_data_t;
+typedef struct {
+    off_t                 start;
+    off_t                 end;
+} ngx_http_eflv_range_t;
 
 
 typedef struct {
-    u_char                type;
-    u_char                datasize[3];
-    u_char                timestamp[3];
-    u_char                timestamp_ex;
-    u_char                streamid[3];
-} ngx_flv_tag_t;
+    ngx_str_node_t        sn;
+    ngx_queue_t           queue;
+
+    ngx_file_uniq_t       uniq;
+    time_t                mtime;
+    off_t                 size;
+
+    ngx_uint_t            count;
+    ngx_uint_t            deleting;
+
+    /* a build lock without an index, see ngx_http_eflv_cache_lookup() */
+    ngx_uint_t            lock;
+    ngx_msec_t            lock_time;
+
+    double                duration;
+    ngx_uint_t            keyframes;
+    size_t                metadata_len;
+    size_t                duration_offset;
+    size_t                video_len;
+    size_t                audio_len;
+    off_t                 video_pos;
+    off_t                 audio_pos;
+
+    u_char                data[1];
+} ngx_http_eflv_cache_node_t;
 
 
-#if 0
 typedef struct {
-    u_char                flags
-} ngx_flv_audio_data_t;
-#endif
+    ngx_rbtree_t          rbtree;
+    ngx_rbtree_node_t     sentinel;
+    ngx_queue_t           queue;
+    ngx_uint_t            lock;
+} ngx_http_eflv_cache_sh_t;
 
 
 typedef struct {
-    u_char                flags;
-} ngx_flv_video_data_t;
+    ngx_http_eflv_cache_sh_t     *sh;
+    ngx_slab_pool_t              *shpool;
+} ngx_http_eflv_cache_t;
+
+
+typedef struct {
+    ngx_http_eflv_cache_t        *cache;
+    ngx_http_eflv_cache_node_t   *node;
+} ngx_http_eflv_cache_cleanup_t;
+
+
+typedef struct {
+    ngx_http_eflv_cache_t        *cache;
+    ngx_str_t                     path;
+    /* the lock held by the request, or 0 */
+    ngx_uint_t                    id;
+    ngx_msec_t                    start;
+    ngx_event_t                   wait;
+    unsigned                      waited:1;
+} ngx_http_eflv_cache_lock_t;
+
+
+/* the interval of lookups while waiting for a build lock */
+
+#define NGX_HTTP_EFLV_LOCK_WAIT  100
+
+
+typedef struct {
+    ngx_shm_zone_t       *cache_zone;
+    ngx_flag_t            cache_lock;
+    ngx_msec_t            cache_lock_timeout;
+    ngx_flag_t            index_generate;
+    ngx_flag_t            index_file;
+    ngx_flag_t            rebase_timestamps;
+    ngx_bufs_t            rebase_bufs;
+    ngx_flag_t            canonical_redirect;
+    ngx_uint_t            snap;
+    ngx_flag_t            follow;
+    ngx_msec_t            follow_interval;
+    ngx_msec_t            follow_timeout;
+    ngx_flag_t            hls;
+    ngx_msec_t            hls_fragment;
+    /* the multiple of the bitrate, in hundredths */
+    ngx_uint_t            limit_rate;
+    time_t                limit_rate_after;
+    ngx_uint_t            status_format;
+} ngx_http_eflv_loc_conf_t;
+
+
+#define NGX_HTTP_EFLV_STATUS_JSON        0
+#define NGX_HTTP_EFLV_STATUS_PROMETHEUS  1
+
+#define NGX_HTTP_EFLV_SNAP_OFF           0
+#define NGX_HTTP_EFLV_SNAP_TAG           1
+#define NGX_HTTP_EFLV_SNAP_KEYFRAME      2
+
+#define NGX_HTTP_EFLV_HIST_BUCKETS       14
+
+
+/* a latency histogram, in microseconds */
+
+typedef struct {
+    ngx_atomic_t          count[NGX_HTTP_EFLV_HIST_BUCKETS];
+    ngx_atomic_t          sum;
+} ngx_http_eflv_hist_t;
+
+
+typedef struct {
+    ngx_atomic_t          tflv_requests;
+    ngx_atomic_t          sflv_requests;
+    ngx_atomic_t          seek_failures;
+
+    ngx_atomic_t          cache_hits;
+    ngx_atomic_t          cache_misses;
+    ngx_atomic_t          cache_evictions;
+    ngx_atomic_t          cache_lock_waits;
+    ngx_atomic_t          cache_lock_timeouts;
+    ngx_atomic_t          index_files;
+    ngx_atomic_t          index_generated;
+
+    ngx_atomic_t          memory_bytes;
+    ngx_atomic_t          file_bytes;
+
+    ngx_http_eflv_hist_t  index_time;
+    ngx_http_eflv_hist_t  seek_time;
+} ngx_http_eflv_stats_t;
+
+
+typedef struct {
+    void                 *addr;
+    size_t                size;
+    ngx_log_t            *log;
+} ngx_http_eflv_mmap_t;
+
+
+typedef struct {
+    ngx_file_t            file;
+    off_t                 offset;
+    off_t                 size;
+
+    u_char               *buf;
+    size_t                buf_size;
+
+    ngx_uint_t            keyframes;
+    ngx_uint_t            nalloc;
+    double               *times;
+    off_t                *filepositions;
+    double                duration;
+
+    ngx_int_t             rc;
+    unsigned              posted:1;
+} ngx_http_eflv_scan_t;
+
+
+typedef struct {
+    off_t                 pos;
+    off_t                 end;
+    /* the offset of the next tag header */
+    off_t                 next;
+    uint32_t              base;
 
+    ngx_buf_t            *buf;
+    ngx_uint_t            allocated;
+    ngx_chain_t          *free;
+    ngx_chain_t          *busy;
 
+    unsigned              started:1;
+    unsigned              done:1;
+    /* the end moves as the file grows */
+    unsigned              follow:1;
+} ngx_http_eflv_rebase_t;
+
+
+typedef struct {
+    /* the end of the data sent from the file */
+    off_t                 pos;
+    /* the last time the file was seen growing */
+    ngx_msec_t            updated;
+    ngx_event_t           timer;
+
+    ngx_chain_t          *free;
+    ngx_chain_t          *busy;
+} ngx_http_eflv_follow_t;
+
+
+typedef struct {
+    ngx_http_eflv_ts_t       ts;
+    ngx_http_eflv_ts_pes_t   pes;
+
+    /* the file data read, which ends at "offset" */
+    ngx_buf_t               *in;
+    off_t                    offset;
+    off_t                    end;
+
+    u_char                  *payload;
+    size_t                   payload_size;
+
+    ngx_buf_t               *buf;
+    ngx_uint_t               allocated;
+    ngx_chain_t             *free;
+    ngx_chain_t             *busy;
+
+    unsigned                 tables:1;
+} ngx_http_eflv_hls_t;
+
+
+#define NGX_HTTP_EFLV_INDEX_CACHE      1
+#define NGX_HTTP_EFLV_INDEX_FILE       2
+#define NGX_HTTP_EFLV_INDEX_PARSED     3
+#define NGX_HTTP_EFLV_INDEX_GENERATED  4
+
+
+typedef struct ngx_http_eflv_ctx_s  ngx_http_eflv_ctx_t;
+
+typedef ngx_int_t (*ngx_http_eflv_send_pt)(ngx_http_request_t *r,
+    ngx_http_eflv_ctx_t *ctx);
+
+
+struct ngx_http_eflv_ctx_s {
+    ngx_str_t                     path;
+    ngx_open_file_info_t          of;
+    ngx_file_t                    file;
+
+    double                        start;
+    double                        end;
+    ngx_int_t                     have_end;
+
+    /* the "kf" argument: keyframe indices, the end one is exclusive */
+    ngx_uint_t                    kf_start;
+    ngx_uint_t                    kf_end;
+
+    ngx_http_eflv_clip_t          clip;
+
+    u_char                       *buf;
+    size_t                        size;
+    size_t                        last;
+    size_t                        want;
+
+    size_t                        pos;
+    ngx_flv_h264_tag_t            metadata;
+    ngx_flv_h264_tag_t            video;
+    ngx_flv_h264_tag_t            audio;
+
+    ngx_http_eflv_index_t         index;
+    ngx_uint_t                    index_source;
+    ngx_http_eflv_scan_t         *scan;
+    ngx_http_eflv_cache_lock_t   *lock;
+    size_t                        first;
+
+    /* the slice of the file sent */
+    off_t                         slice_start;
+    off_t                         slice_end;
+
+    ngx_http_eflv_rebase_t        rebase;
+    ngx_http_eflv_follow_t       *follow;
+    ngx_http_eflv_hls_t          *hls;
+
+    /* the window read to snap the offsets of sflv to tags */
+    u_char                       *snap;
+
+    ngx_http_eflv_send_pt         send;
+
+    uint64_t                      index_start;
+    uint64_t                      index_usec;
+    uint64_t                      resolve_usec;
+
+    unsigned                      need_index:1;
+    unsigned                      have_time:1;
+    unsigned                      have_kf:1;
+    unsigned                      have_kf_end:1;
+    unsigned                      resolved:1;
+    unsigned                      sliced:1;
+    unsigned                      snapped_start:1;
+    unsigned                      snapped:1;
+    /* no more sequence header of the stream is looked for */
+    unsigned                      video_done:1;
+    unsigned                      audio_done:1;
+};
+
+
+static ngx_int_t ngx_http_eflv_process(ngx_http_request_t *r);
+static void ngx_http_eflv_cache_lock_wait_handler(ngx_event_t *ev);
+static ngx_int_t ngx_http_eflv_follow_send(ngx_http_request_t *r,
+    ngx_http_eflv_ctx_t *ctx);
+static void ngx_http_eflv_follow_handler(ngx_event_t *ev);
+static void ngx_http_eflv_write_handler(ngx_http_request_t *r);
+static ngx_int_t ngx_http_eflv_hls_playlist(ngx_http_request_t *r,
+    ngx_http_eflv_ctx_t *ctx);
+static ngx_int_t ngx_http_eflv_hls_segment(ngx_http_request_t *r,
+    ngx_http_eflv_ctx_t *ctx);
+#if (NGX_HAVE_FILE_AIO)
+static void ngx_http_eflv_aio_event_handler(ngx_event_t *ev);
+#endif
+#if (NGX_THREADS)
+static ngx_thread_pool_t *ngx_http_eflv_thread_pool(ngx_http_request_t *r);
+static ngx_int_t ngx_http_eflv_thread_handler(ngx_thread_task_t *task,
+    ngx_file_t *file);
+static void ngx_http_eflv_thread_event_handler(ngx_event_t *ev);
+#endif
+
+
+static void *ngx_http_eflv_create_loc_conf(ngx_conf_t *cf);
+static char *ngx_http_eflv_merge_loc_conf(ngx_conf_t *cf, void *parent,
+    void *child);
 static char *ngx_http_tflv(ngx_conf_t *cf, ngx_command_t *cmd, void *conf);
 static char *ngx_http_sflv(ngx_conf_t *cf, ngx_command_t *cmd, void *conf);
+static char *ngx_http_eflv_index_cache_zone(ngx_conf_t *cf,
+    ngx_command_t *cmd, void *conf);
+static char *ngx_http_eflv_index_cache(ngx_conf_t *cf, ngx_command_t *cmd,
+    void *conf);
+static char *ngx_http_eflv_limit_rate(ngx_conf_t *cf, ngx_command_t *cmd,
+    void *conf);
+static char *ngx_http_eflv_status(ngx_conf_t *cf, ngx_command_t *cmd,
+    void *conf);
+static ngx_int_t ngx_http_eflv_add_variables(ngx_conf_t *cf);
+static ngx_int_t ngx_http_eflv_init(ngx_conf_t *cf);
+static ngx_int_t ngx_http_eflv_init_status_zone(ngx_shm_zone_t *shm_zone,
+    void *data);
+static ngx_int_t ngx_http_eflv_keyframes_variable(ngx_http_request_t *r,
+    ngx_http_variable_value_t *v, uintptr_t data);
+static ngx_int_t ngx_http_eflv_variable(ngx_http_request_t *r,
+    ngx_http_variable_value_t *v, uintptr_t data);
+
+
+static ngx_conf_enum_t  ngx_http_eflv_snap_modes[] = {
+    { ngx_string("off"), NGX_HTTP_EFLV_SNAP_OFF },
+    { ngx_string("tag"), NGX_HTTP_EFLV_SNAP_TAG },
+    { ngx_string("keyframe"), NGX_HTTP_EFLV_SNAP_KEYFRAME },
+    { ngx_null_string, 0 }
+};
 
 
 static ngx_command_t  ngx_http_eflv_commands[] = {
@@ -118,39 +412,225 @@ static ngx_command_t  ngx_http_eflv_commands[] = {
       0,
       NULL },
 
+    { ngx_string("eflv_index_cache_zone"),
+      NGX_HTTP_MAIN_CONF|NGX_CONF_TAKE1,
+      ngx_http_eflv_index_cache_zone,
+      0,
+      0,
+      NULL },
+
+    { ngx_string("eflv_index_cache"),
+      NGX_HTTP_MAIN_CONF|NGX_HTTP_SRV_CONF|NGX_HTTP_LOC_CONF|NGX_CONF_TAKE1,
+      ngx_http_eflv_index_cache,
+      NGX_HTTP_LOC_CONF_OFFSET,
+      0,
+      NULL },
+
+    { ngx_string("eflv_index_cache_lock"),
+      NGX_HTTP_MAIN_CONF|NGX_HTTP_SRV_CONF|NGX_HTTP_LOC_CONF|NGX_CONF_FLAG,
+      ngx_conf_set_flag_slot,
+      NGX_HTTP_LOC_CONF_OFFSET,
+      offsetof(ngx_http_eflv_loc_conf_t, cache_lock),
+      NULL },
+
+    { ngx_string("eflv_index_cache_lock_timeout"),
+      NGX_HTTP_MAIN_CONF|NGX_HTTP_SRV_CONF|NGX_HTTP_LOC_CONF|NGX_CONF_TAKE1,
+      ngx_conf_set_msec_slot,
+      NGX_HTTP_LOC_CONF_OFFSET,
+      offsetof(ngx_http_eflv_loc_conf_t, cache_lock_timeout),
+      NULL },
+
+    { ngx_string("eflv_index_generate"),
+      NGX_HTTP_MAIN_CONF|NGX_HTTP_SRV_CONF|NGX_HTTP_LOC_CONF|NGX_CONF_FLAG,
+      ngx_conf_set_flag_slot,
+      NGX_HTTP_LOC_CONF_OFFSET,
+      offsetof(ngx_http_eflv_loc_conf_t, index_generate),
+      NULL },
+
+    { ngx_string("eflv_index_file"),
+      NGX_HTTP_MAIN_CONF|NGX_HTTP_SRV_CONF|NGX_HTTP_LOC_CONF|NGX_CONF_FLAG,
+      ngx_conf_set_flag_slot,
+      NGX_HTTP_LOC_CONF_OFFSET,
+      offsetof(ngx_http_eflv_loc_conf_t, index_file),
+      NULL },
+
+    { ngx_string("eflv_rebase_timestamps"),
+      NGX_HTTP_MAIN_CONF|NGX_HTTP_SRV_CONF|NGX_HTTP_LOC_CONF|NGX_CONF_FLAG,
+      ngx_conf_set_flag_slot,
+      NGX_HTTP_LOC_CONF_OFFSET,
+      offsetof(ngx_http_eflv_loc_conf_t, rebase_timestamps),
+      NULL },
+
+    { ngx_string("eflv_rebase_buffers"),
+      NGX_HTTP_MAIN_CONF|NGX_HTTP_SRV_CONF|NGX_HTTP_LOC_CONF|NGX_CONF_TAKE2,
+      ngx_conf_set_bufs_slot,
+      NGX_HTTP_LOC_CONF_OFFSET,
+      offsetof(ngx_http_eflv_loc_conf_t, rebase_bufs),
+      NULL },
+
+    { ngx_string("eflv_canonical_redirect"),
+      NGX_HTTP_MAIN_CONF|NGX_HTTP_SRV_CONF|NGX_HTTP_LOC_CONF|NGX_CONF_FLAG,
+      ngx_conf_set_flag_slot,
+      NGX_HTTP_LOC_CONF_OFFSET,
+      offsetof(ngx_http_eflv_loc_conf_t, canonical_redirect),
+      NULL },
+
+    { ngx_string("eflv_snap"),
+      NGX_HTTP_MAIN_CONF|NGX_HTTP_SRV_CONF|NGX_HTTP_LOC_CONF|NGX_CONF_TAKE1,
+      ngx_conf_set_enum_slot,
+      NGX_HTTP_LOC_CONF_OFFSET,
+      offsetof(ngx_http_eflv_loc_conf_t, snap),
+      &ngx_http_eflv_snap_modes },
+
+    { ngx_string("eflv_follow"),
+      NGX_HTTP_MAIN_CONF|NGX_HTTP_SRV_CONF|NGX_HTTP_LOC_CONF|NGX_CONF_FLAG,
+      ngx_conf_set_flag_slot,
+      NGX_HTTP_LOC_CONF_OFFSET,
+      offsetof(ngx_http_eflv_loc_conf_t, follow),
+      NULL },
+
+    { ngx_string("eflv_follow_interval"),
+      NGX_HTTP_MAIN_CONF|NGX_HTTP_SRV_CONF|NGX_HTTP_LOC_CONF|NGX_CONF_TAKE1,
+      ngx_conf_set_msec_slot,
+      NGX_HTTP_LOC_CONF_OFFSET,
+      offsetof(ngx_http_eflv_loc_conf_t, follow_interval),
+      NULL },
+
+    { ngx_string("eflv_follow_timeout"),
+      NGX_HTTP_MAIN_CONF|NGX_HTTP_SRV_CONF|NGX_HTTP_LOC_CONF|NGX_CONF_TAKE1,
+      ngx_conf_set_msec_slot,
+      NGX_HTTP_LOC_CONF_OFFSET,
+      offsetof(ngx_http_eflv_loc_conf_t, follow_timeout),
+      NULL },
+
+    { ngx_string("eflv_hls"),
+      NGX_HTTP_MAIN_CONF|NGX_HTTP_SRV_CONF|NGX_HTTP_LOC_CONF|NGX_CONF_FLAG,
+      ngx_conf_set_flag_slot,
+      NGX_HTTP_LOC_CONF_OFFSET,
+      offsetof(ngx_http_eflv_loc_conf_t, hls),
+      NULL },
+
+    { ngx_string("eflv_hls_fragment"),
+      NGX_HTTP_MAIN_CONF|NGX_HTTP_SRV_CONF|NGX_HTTP_LOC_CONF|NGX_CONF_TAKE1,
+      ngx_conf_set_msec_slot,
+      NGX_HTTP_LOC_CONF_OFFSET,
+      offsetof(ngx_http_eflv_loc_conf_t, hls_fragment),
+      NULL },
+
+    { ngx_string("eflv_limit_rate"),
+      NGX_HTTP_MAIN_CONF|NGX_HTTP_SRV_CONF|NGX_HTTP_LOC_CONF|NGX_CONF_TAKE1,
+      ngx_http_eflv_limit_rate,
+      NGX_HTTP_LOC_CONF_OFFSET,
+      0,
+      NULL },
+
+    { ngx_string("eflv_limit_rate_after"),
+      NGX_HTTP_MAIN_CONF|NGX_HTTP_SRV_CONF|NGX_HTTP_LOC_CONF|NGX_CONF_TAKE1,
+      ngx_conf_set_sec_slot,
+      NGX_HTTP_LOC_CONF_OFFSET,
+      offsetof(ngx_http_eflv_loc_conf_t, limit_rate_after),
+      NULL },
+
+    { ngx_string("eflv_status"),
+      NGX_HTTP_LOC_CONF|NGX_CONF_NOARGS|NGX_CONF_TAKE1,
+      ngx_http_eflv_status,
+      NGX_HTTP_LOC_CONF_OFFSET,
+      0,
+      NULL },
+
     ngx_null_command
 };
 
 
-#define NGX_FLV_METADATALEN 327680
+#define NGX_HTTP_EFLV_VAR_START_OFFSET    0
+#define NGX_HTTP_EFLV_VAR_END_OFFSET      1
+#define NGX_HTTP_EFLV_VAR_KEYFRAME_INDEX  2
+#define NGX_HTTP_EFLV_VAR_CLIP_DURATION   3
+#define NGX_HTTP_EFLV_VAR_INDEX_SOURCE    4
+#define NGX_HTTP_EFLV_VAR_INDEX_USEC      5
+#define NGX_HTTP_EFLV_VAR_RESOLVE_USEC    6
+
+
+static ngx_http_variable_t  ngx_http_eflv_vars[] = {
 
+    { ngx_string("eflv_keyframes"), NULL,
+      ngx_http_eflv_keyframes_variable, 0, NGX_HTTP_VAR_NOCACHEABLE, 0 },
 
-#define ngx_flv_get_32value(p)                                                \
-    ( ((uint32_t) ((u_char *) (p))[0] << 24)                                  \
-    + (           ((u_char *) (p))[1] << 16)                                  \
-    + (           ((u_char *) (p))[2] << 8)                                   \
-    + (           ((u_char *) (p))[3]) )
+    { ngx_string("eflv_start_offset"), NULL, ngx_http_eflv_variable,
+      NGX_HTTP_EFLV_VAR_START_OFFSET, NGX_HTTP_VAR_NOCACHEABLE, 0 },
 
-#define ngx_flv_get_24value(p)                                                \
-    ( ((uint32_t) ((u_char *) (p))[0] << 16)                                  \
-    + (           ((u_char *) (p))[1] << 8)                                   \
-    + (           ((u_char *) (p))[2]) )
+    { ngx_string("eflv_end_offset"), NULL, ngx_http_eflv_variable,
+      NGX_HTTP_EFLV_VAR_END_OFFSET, NGX_HTTP_VAR_NOCACHEABLE, 0 },
 
+    { ngx_string("eflv_keyframe_index"), NULL, ngx_http_eflv_variable,
+      NGX_HTTP_EFLV_VAR_KEYFRAME_INDEX, NGX_HTTP_VAR_NOCACHEABLE, 0 },
 
-#define NGX_FLV_AUDIODATA           8
-#define NGX_FLV_VIDEODATA           9
-#define NGX_FLV_SCRIPTDATAOBJECT    18
-#define NGX_FLV_H263VIDEOPACKET     2
-#define NGX_FLV_SCREENVIDEOPACKET   3
-#define NGX_FLV_VP6VIDEOPACKET      4
-#define NGX_FLV_VP6ALPHAVIDEOPACKET 5
-#define NGX_FLV_SCREENV2VIDEOPACKET 6
-#define NGX_FLV_AVCVIDEOPACKET      7
+    { ngx_string("eflv_clip_duration"), NULL, ngx_http_eflv_variable,
+      NGX_HTTP_EFLV_VAR_CLIP_DURATION, NGX_HTTP_VAR_NOCACHEABLE, 0 },
+
+    { ngx_string("eflv_index_source"), NULL, ngx_http_eflv_variable,
+      NGX_HTTP_EFLV_VAR_INDEX_SOURCE, NGX_HTTP_VAR_NOCACHEABLE, 0 },
+
+    { ngx_string("eflv_index_usec"), NULL, ngx_http_eflv_variable,
+      NGX_HTTP_EFLV_VAR_INDEX_USEC, NGX_HTTP_VAR_NOCACHEABLE, 0 },
+
+    { ngx_string("eflv_resolve_usec"), NULL, ngx_http_eflv_variable,
+      NGX_HTTP_EFLV_VAR_RESOLVE_USEC, NGX_HTTP_VAR_NOCACHEABLE, 0 },
+
+    { ngx_null_string, NULL, NULL, 0, 0, 0 }
+};
+
+
+static ngx_str_t  ngx_http_eflv_index_sources[] = {
+    ngx_null_string,
+    ngx_string("cache"),
+    ngx_string("sidecar"),
+    ngx_string("parsed"),
+    ngx_string("generated")
+};
+
+
+#define NGX_FLV_METADATALEN 327680
+#define NGX_FLV_HEAD_STEP   4096
+#define NGX_FLV_SCAN_STEP   65536
 
 
 static u_char  ngx_flv_header[] = "FLV\x1\x1\0\0\0\x9\0\0\0\x9";
 
 
+/* set by the "eflv_status" zone, and counted in all locations then */
+
+static ngx_http_eflv_stats_t  *ngx_http_eflv_stats;
+
+static uint64_t  ngx_http_eflv_hist_bounds[NGX_HTTP_EFLV_HIST_BUCKETS - 1] = {
+    100, 250, 500, 1000, 2500, 5000, 10000, 25000, 50000, 100000, 250000,
+    500000, 1000000
+};
+
+static ngx_str_t  ngx_http_eflv_hist_labels[NGX_HTTP_EFLV_HIST_BUCKETS] = {
+    ngx_string("0.0001"), ngx_string("0.00025"), ngx_string("0.0005"),
+    ngx_string("0.001"), ngx_string("0.0025"), ngx_string("0.005"),
+    ngx_string("0.01"), ngx_string("0.025"), ngx_string("0.05"),
+    ngx_string("0.1"), ngx_string("0.25"), ngx_string("0.5"),
+    ngx_string("1"), ngx_string("+Inf")
+};
+
+
+#define ngx_http_eflv_stat(name, n)                                           \
+    do {                                                                      \
+        if (ngx_http_eflv_stats) {                                            \
+            (void) ngx_atomic_fetch_add(&ngx_http_eflv_stats->name, n);       \
+        }                                                                     \
+    } while (0)
+
+#define ngx_http_eflv_stat_time(name, usec)                                   \
+    do {                                                                      \
+        if (ngx_http_eflv_stats) {                                            \
+            ngx_http_eflv_hist_add(&ngx_http_eflv_stats->name, usec);         \
+        }                                                                     \
+    } while (0)
+
+
 static off_t
 ngx_atoint(u_char *line, size_t n)
 {
@@ -178,8 +658,8 @@ ngx_atoint(u_char *line, size_t n)
 
 
 static ngx_http_module_t  ngx_http_eflv_module_ctx = {
-    NULL,                          /* preconfiguration */
-    NULL,                          /* postconfiguration */
+    ngx_http_eflv_add_variables,   /* preconfiguration */
+    ngx_http_eflv_init,            /* postconfiguration */
 
     NULL,                          /* create main configuration */
     NULL,                          /* init main configuration */
@@ -187,8 +667,8 @@ static ngx_http_module_t  ngx_http_eflv_module_ctx = {
     NULL,                          /* create server configuration */
     NULL,                          /* merge server configuration */
 
-    NULL,                          /* create location configuration */
-    NULL                           /* merge location configuration */
+    ngx_http_eflv_create_loc_conf, /* create location configuration */
+    ngx_http_eflv_merge_loc_conf   /* merge location configuration */
 };
 
 
@@ -208,1029 +688,5499 @@ ngx_module_t  ngx_http_eflv_module = {
 };
 
 
+static uint64_t
+ngx_http_eflv_usec(void)
+{
+    struct timeval  tv;
+
+    ngx_gettimeofday(&tv);
+
+    return (uint64_t) tv.tv_sec * 1000000 + tv.tv_usec;
+}
+
+
 static void
-ngx_flv_revert_int(char *s, const char *d, ngx_int_t len)
+ngx_http_eflv_hist_add(ngx_http_eflv_hist_t *hist, uint64_t usec)
 {
-    ngx_int_t     i;
-    for (i = len -1; i >= 0; i--) {
-        *(s+i) = *d;
-        d++;
+    ngx_uint_t  i;
+
+    for (i = 0; i < NGX_HTTP_EFLV_HIST_BUCKETS - 1; i++) {
+        if (usec <= ngx_http_eflv_hist_bounds[i]) {
+            break;
+        }
     }
+
+    (void) ngx_atomic_fetch_add(&hist->count[i], 1);
+    (void) ngx_atomic_fetch_add(&hist->sum, (ngx_atomic_int_t) usec);
 }
 
 
 static void
-ngx_flv_swap_duration(char *p, double value)
+ngx_http_eflv_stat_chain(ngx_chain_t *cl)
 {
-      union {
-            u_char dc[8];
-            double dd;
-      } d;
-      u_char b[8];
+    off_t  memory, file;
+
+    if (ngx_http_eflv_stats == NULL) {
+        return;
+    }
+
+    memory = 0;
+    file = 0;
 
-      d.dd = value;
+    for ( /* void */ ; cl; cl = cl->next) {
+        if (cl->buf->in_file) {
+            file += cl->buf->file_last - cl->buf->file_pos;
 
-      b[0] = d.dc[7];
-      b[1] = d.dc[6];
-      b[2] = d.dc[5];
-      b[3] = d.dc[4];
-      b[4] = d.dc[3];
-      b[5] = d.dc[2];
-      b[6] = d.dc[1];
-      b[7] = d.dc[0];
+        } else {
+            memory += cl->buf->last - cl->buf->pos;
+        }
+    }
 
-      ngx_memcpy(p, b, 8);
+    (void) ngx_atomic_fetch_add(&ngx_http_eflv_stats->memory_bytes,
+                                (ngx_atomic_int_t) memory);
+    (void) ngx_atomic_fetch_add(&ngx_http_eflv_stats->file_bytes,
+                                (ngx_atomic_int_t) file);
 }
 
 
 static ngx_int_t
-ngx_http_eflv_read_secondpass(char *flv, size_t streampos, double filesize, ngx_flv_h264_tag_t *tag)
+ngx_http_eflv_read_numbers(ngx_pool_t *pool, u_char *p, u_char *last,
+    double **values, ngx_uint_t *nvalues)
 {
-    size_t datasize,  audiosize = 0;
-    size_t  audiotags = 0;
-    ngx_flv_tag_t *flvtag;
+    double  *v;
+    size_t   n;
+
+    p = ngx_http_eflv_amf_array(p, last, &n);
+    if (p == NULL) {
+        return NGX_DECLINED;
+    }
 
-    tag->start = 0;
+    v = ngx_palloc(pool, (n ? n : 1) * sizeof(double));
+    if (v == NULL) {
+        return NGX_ERROR;
+    }
 
-    for(;;) {
+    *values = v;
+    *nvalues = ngx_http_eflv_amf_numbers(p, n, v);
 
-        if(streampos + sizeof(ngx_flv_tag_t) > filesize)
-            break;
+    return NGX_OK;
+}
+
+
+static ngx_int_t
+ngx_http_eflv_parse_keyframes(ngx_http_request_t *r, u_char *p, u_char *last,
+    ngx_http_eflv_index_t *index)
+{
+    u_char      *v;
+    double      *times, *positions;
+    ngx_int_t    rc;
+    ngx_str_t    name;
+    ngx_uint_t   i, n, ntimes, npositions;
 
-        flvtag = (ngx_flv_tag_t *)&flv[streampos];
+    if (*p == NGX_FLV_AMF_ECMA_ARRAY) {
+        p += 4;
 
-        datasize = sizeof(ngx_flv_tag_t) + ngx_flv_get_24value(flvtag->datasize) + 4;
+    } else if (*p != NGX_FLV_AMF_OBJECT) {
+        return NGX_DECLINED;
+    }
+
+    p++;
+
+    times = NULL;
+    positions = NULL;
+    ntimes = 0;
+    npositions = 0;
 
-        if(streampos + datasize > filesize)
+    for ( ;; ) {
+        v = ngx_http_eflv_amf_next_prop(p, last, &name.data, &name.len);
+
+        if (v == NULL) {
             break;
+        }
 
-        if(flvtag->type == NGX_FLV_SCRIPTDATAOBJECT) {
+        rc = NGX_DECLINED;
 
-            audiosize += ngx_flv_get_24value(flvtag->datasize);
-            audiotags++;
-            if (tag->start == 0) {
-                tag->start = streampos;
-                tag->datasize=datasize;
-            }
+        if (name.len == 5 && ngx_strncmp(name.data, "times", 5) == 0) {
+            rc = ngx_http_eflv_read_numbers(r->pool, v, last, &times, &ntimes);
 
-            if (tag->start > 0) {
-                return 1;
-            }
+        } else if (name.len == 13
+                   && ngx_strncmp(name.data, "filepositions", 13) == 0)
+        {
+            rc = ngx_http_eflv_read_numbers(r->pool, v, last, &positions,
+                                            &npositions);
         }
-        streampos += datasize;
 
+        if (rc == NGX_ERROR) {
+            return NGX_ERROR;
+        }
+
+        p = ngx_http_eflv_amf_skip(v, last, 1);
+        if (p == NULL) {
+            break;
+        }
     }
 
-    return 0;
-}
+    n = ngx_min(ntimes, npositions);
 
+    if (n == 0) {
+        return NGX_DECLINED;
+    }
 
-static int
-ngx_http_eflv_read_firstpass(char *flv,size_t streampos,size_t filesize, ngx_flv_h264_tag_t *tag, ngx_flv_h264_tag_t *audio)
-{
-    size_t datasize, videosize = 0, audiosize = 0;
-    size_t videotags = 0, audiotags = 0;
-    ngx_flv_tag_t *flvtag;
-    //ngx_flv_audio_data_t    *flvaudio;
-    ngx_flv_video_data_t    *flvvideo;
-
-    tag->start = 0;
-    audio->start = 0;
-    for(;;) {
-        if (streampos + sizeof(ngx_flv_tag_t) > filesize)
-            break;
+    index->filepositions = ngx_palloc(r->pool, n * sizeof(off_t));
+    if (index->filepositions == NULL) {
+        return NGX_ERROR;
+    }
 
-        flvtag = (ngx_flv_tag_t *)&flv[streampos];
+    for (i = 0; i < n; i++) {
 
-        // TagHeader + TagData + PreviousTagSize
-        datasize = sizeof(ngx_flv_tag_t) + ngx_flv_get_24value(flvtag->datasize) + 4;
+        /* lookups need a sorted index */
 
-        if(streampos + datasize > filesize)
+        if (i > 0 && times[i] < times[i - 1]) {
             break;
+        }
 
-        if(flvtag->type == NGX_FLV_AUDIODATA) {
+        index->filepositions[i] = (off_t) positions[i];
+    }
 
-            audiosize += ngx_flv_get_24value(flvtag->datasize);
-            audiotags++;
-            if (audio->start == 0) {
-                audio->start = streampos;
-                audio->datasize=datasize;
-            }
+    index->times = times;
+    index->keyframes = i;
 
-            if (tag->start > 0) {
-                return 1;
-            }
-        } else if (flvtag->type == NGX_FLV_VIDEODATA) {
-            //flvmetadata.datasize += (double)datasize;
-            //// datasize - PreviousTagSize
-            //flvmetadata.videosize += (double)(datasize - 4);
+    return NGX_OK;
+}
 
-            videosize += ngx_flv_get_24value(flvtag->datasize);
-            videotags++;
 
-            flvvideo = (ngx_flv_video_data_t *)&flv[streampos + sizeof(ngx_flv_tag_t)];
+static ngx_int_t
+ngx_http_eflv_parse_metadata(ngx_http_request_t *r, u_char *tag, size_t len,
+    ngx_http_eflv_index_t *index)
+{
+    u_char     *p, *v, *last;
+    ngx_str_t   name;
 
+    p = ngx_http_eflv_amf_metadata(tag, len, &last);
+    if (p == NULL) {
+        return NGX_DECLINED;
+    }
 
-            switch(flvvideo->flags & 0xf) {
-                case NGX_FLV_AVCVIDEOPACKET:
-                    if (tag->start == 0) {
-                        tag->start = streampos;
-                        tag->datasize = datasize;
-                    }
+    p += (*p == NGX_FLV_AMF_ECMA_ARRAY) ? 5 : 1;
 
-                    if (audio->start > 0) {
-                        return 1;
-                    }
+    for ( ;; ) {
+        v = ngx_http_eflv_amf_next_prop(p, last, &name.data, &name.len);
 
-                    break;
-                default:
-                    return 0;
+        if (v == NULL) {
+            break;
+        }
+
+        if (name.len == 8 && ngx_strncmp(name.data, "duration", 8) == 0
+            && *v == NGX_FLV_AMF_NUMBER && last - v >= 9)
+        {
+            index->duration_offset = v + 1 - tag;
+            index->duration = ngx_flv_get_double(v + 1);
+
+        } else if (name.len == 9
+                   && ngx_strncmp(name.data, "keyframes", 9) == 0)
+        {
+            if (ngx_http_eflv_parse_keyframes(r, v, last, index)
+                == NGX_ERROR)
+            {
+                return NGX_ERROR;
             }
+        }
 
+        p = ngx_http_eflv_amf_skip(v, last, 1);
+        if (p == NULL) {
+            break;
         }
-        streampos += datasize;
     }
 
-    return 0;
-}
+    if (index->duration_offset == 0 && index->keyframes) {
+        index->duration = index->times[index->keyframes - 1];
+    }
 
+    return index->keyframes ? NGX_OK : NGX_DECLINED;
+}
 
-static void 
-ntx_htt_sflv_metadata(ngx_int_t fd, double len, char *send_header_buf, char *send_metadata_buf, char *send_tH264VideoTag_buf, char *send_tH264AudioTag_buf, ngx_int_t *metadata_size, ngx_int_t *video_size, ngx_int_t *audio_size, size_t *metaend_pos, ngx_http_request_t *r)
-{
-    size_t  streampos;
-    ngx_flv_h264_tag_t  tMetaDataTag, tH264VideoTag, tH264AudioTag; 
-    bzero(&tMetaDataTag,sizeof(tMetaDataTag));
-    bzero(&tH264VideoTag,sizeof(tH264VideoTag));
-    bzero(&tH264AudioTag,sizeof(tH264AudioTag)); 
-    ngx_flv_header_t *flvfileheader;
-    char flv[NGX_FLV_METADATALEN] ={0}; 
-    ngx_int_t n; 
-    ngx_int_t i_read; 
-    ngx_log_t    *log; 
-    log = r->connection->log; 
 
-    i_read = NGX_FLV_METADATALEN; 
-    if (len< NGX_FLV_METADATALEN){
-        i_read = len;	
-    }
-    lseek(fd, 0, SEEK_SET); 
-    n = read((int)fd,flv,i_read); 
+/* the keyframe at or before the value */
 
-    if ( -1 == n){
-        ngx_log_error(NGX_LOG_ALERT, log, ngx_errno,
-                "ngx_sflv_read"  " \"%d\" failed", (int)fd);
-    }
+static ngx_uint_t
+ngx_http_eflv_find_keyframe(ngx_http_eflv_index_t *index, double value)
+{
+    ngx_uint_t  n;
 
-    flvfileheader = (ngx_flv_header_t *)flv;
-    streampos = ngx_flv_get_32value(flvfileheader->headersize) + 4;
-    ngx_memcpy(send_header_buf,flv,13);
+    n = ngx_http_eflv_lower_bound(index->times, index->keyframes, 0, value);
 
-    ngx_http_eflv_read_secondpass(flv, streampos, NGX_FLV_METADATALEN,&tMetaDataTag);
-    *metadata_size = (ngx_int_t) tMetaDataTag.datasize;
-    *metaend_pos = tMetaDataTag.start + tMetaDataTag.datasize;
-    if (tMetaDataTag.start > 0) {
-        if (tMetaDataTag.datasize <= NGX_FLV_METADATALEN){
-            ngx_memcpy(send_metadata_buf,flv+tMetaDataTag.start,tMetaDataTag.datasize);
-        }
+    if (n == index->keyframes
+        || (n > 0 && index->times[n] != value))
+    {
+        n--;
     }
 
-    ngx_http_eflv_read_firstpass(flv, streampos, NGX_FLV_METADATALEN,&tH264VideoTag,&tH264AudioTag);
-    *video_size = (ngx_int_t)tH264VideoTag.datasize;
-    *audio_size = (ngx_int_t)tH264AudioTag.datasize; 
-    if (tH264VideoTag.start > 0) {
-        ngx_memcpy(send_tH264VideoTag_buf, flv+tH264VideoTag.start,tH264VideoTag.datasize);
-    }
-    if (tH264AudioTag.start > 0) {
-        ngx_memcpy(send_tH264AudioTag_buf, flv+tH264AudioTag.start,tH264AudioTag.datasize);
-    } 
+    return n;
 }
 
 
-static double
-ngx_http_flv_get_real_value(const char *times, const char *filepos, int num, const double value, int start_index, int *ret_index, double *ret_time)
+/*
+ * resolves the start and end times to byte offsets in a single pass:
+ * the clip starts at the keyframe at or before the start and ends right
+ * before the first keyframe at or after the end, which is searched for
+ * past the start keyframe only; keyframe positions are tag boundaries,
+ * so the clip always ends with a complete tag
+ */
+
+static int
+ngx_http_eflv_time_drag_position(ngx_http_eflv_index_t *index, double *start,
+    double *end, double filesize, ngx_int_t have_end,
+    ngx_http_eflv_clip_t *clip)
 {
+    off_t       pos, start_pos;
+    double      temp;
+    ngx_uint_t  end_index;
 
-        if ((times ==NULL) || (filepos == NULL) ||
-        (ret_index == NULL) || (ret_time == NULL))
+    if (index == NULL || start == NULL || end == NULL
+        || clip == NULL || index->keyframes == 0)
     {
-                return -1;
-        }
+        return -1;
+    }
 
-        int i  = 0,min_index=0, max_index=0, j=0;
-        double temp = 0,min_value = 0;
-        char rbuf[32] = {0};
-        double file_pos = 0;
+    temp = index->duration;
 
-        for(i=0; ;i++)  {
-                if(times[10+i*9] == 0)
-                        break;
-                if(i > num){
-                        return -1;
-                }
-        }
+    if (*start > temp) {
+        *start = 0;
+    }
 
-        min_index = 0;
-        max_index = num-1;
-        j = 0;
-        double timepos = 0;
-	for(i=1;;i++) {
+    clip->start_index = ngx_http_eflv_find_keyframe(index, *start);
+    clip->end_index = index->keyframes;
+    clip->start_time = index->times[clip->start_index];
+    clip->duration = temp - clip->start_time;
 
-                if (((max_index - min_index) < 2) || (timepos == value) )
-                        break;
+    start_pos = index->filepositions[clip->start_index];
 
-                if(times[10+((min_index+max_index)/2+j)*9] != 0){
+    if (have_end == 1 && *start <= *end && *end <= temp) {
 
-                        if(((min_index+max_index)/2+j) >= max_index){
-                                break;
-                        } else {
-                                j += 1;
-                                continue;
-                        }
-                }
+        /* the first keyframe at or after the end, past the start one */
 
-                timepos = 0;
-                ngx_flv_revert_int(rbuf, &times[10+((min_index+max_index)/2+j)*9+1], 8);
-                ngx_memcpy(&timepos, &rbuf, 8);
+        end_index = ngx_http_eflv_lower_bound(index->times, index->keyframes,
+                                              clip->start_index + 1, *end);
 
-                if(timepos < value){
-                        min_index = (min_index+max_index)/2+j;
+        *end = filesize;
 
-                } else if (timepos >=value){
-                        max_index = (min_index+max_index)/2+j;
-                }
-
-                j = 0;
-    }
-
-        ngx_flv_revert_int(rbuf, &times[10+min_index*9+1],8);
-        ngx_memcpy(&min_value, &rbuf, 8);
-        ngx_flv_revert_int(rbuf, &times[10+max_index*9+1],8);
-        ngx_memcpy(&temp, &rbuf, 8);
-	
-        if (value > temp){
-                min_index = num - 1;
-        }
-
-        if ((start_index != -1) && start_index == min_index){
-                min_index = min_index + 1;
-                if (min_index>=num){
-                        return -2;
-                }
-        }
+        if (end_index < index->keyframes) {
+            pos = index->filepositions[end_index];
 
-        ngx_flv_revert_int(rbuf, &times[10+min_index*9+1],8);
-        ngx_memcpy(&min_value, &rbuf, 8);
-
-        *ret_time = min_value;
-
-        double timepos2 = 0;
-        ngx_flv_revert_int(rbuf, &filepos[18+min_index*9+1],8);
-        ngx_memcpy(&timepos2, &rbuf, 8);
-        file_pos = timepos2;
-
-        if (start_index != -1 ){
-                file_pos = file_pos - 1;
+            if (pos > start_pos && pos <= filesize) {
+                *end = pos;
+                clip->end_index = end_index;
+                clip->duration = index->times[end_index] - clip->start_time;
+            }
         }
 
-        (*ret_index) = min_index ;
-        return file_pos;
-}
-
-
-static char *
-ngx_http_eflv_get_position(char *str_src, size_t str_len, size_t filesize, const char *str_dest)
-{
-    if (str_src == NULL || str_dest == NULL){
-        return NULL;
+    } else if (have_end == 1) {
+        *end = filesize;
     }
 
-    char buf[NGX_FLV_METADATALEN] = {0};
-    size_t  i = 0, size = 0;
-    int iLen = 0;
-    char *p = NULL;
-    //int i_copy_len = 0;
-    char *buf_tmp = buf;
-
-    i = 0;
-    size = 0;
-    bzero(buf,sizeof(buf));
-    if (filesize <=str_len){
-        ngx_memcpy(buf,str_src,filesize);
-    }
-    else{
-        ngx_memcpy(buf,str_src,str_len);
+    if (start_pos > 0 && start_pos <= filesize) {
+        *start = start_pos;
     }
-    buf_tmp = buf;
-
-    //澶..4K?..?..瀛..缁..绗?
-      while(1){
-
-        p =strstr(buf_tmp,str_dest);
 
-        if (p == NULL){
-
-            i = strlen(buf_tmp);
-            buf_tmp = buf_tmp + i;
-            size+=(i+1);
-            iLen+=(i+1);
-
-            //澶.. buf =  瀛..涓? + 0x0 + 瀛..涓?
-            if(size >= str_len){
-                return NULL;
-            }
-
-            //?..??0x0 
-            buf_tmp = buf_tmp+1;
-            //size++;
-            //iLen ++;
-        } else {
-            //?惧.?.Щ?
-            iLen = iLen + (p -buf_tmp)*sizeof(char);
+    return 0;
+}
 
-            p = str_src+iLen;
-            return p;
-        }
-    }
-    return NULL;
-}    
 
+/*
+ * resolves a clip given by keyframe indices, as in the canonical "kf"
+ * argument; the end index is exclusive and the clip extends to the end
+ * of the file without it
+ */
 
 static int
-ngx_http_eflv_time_drag_position(char *flv ,double *start,double *end,double filesize,ngx_int_t have_end, ngx_flv_meta_data_t *drag_FLVMetaData,double **key_times, double **key_filepos,ngx_http_request_t *r)
+ngx_http_eflv_keyframe_position(ngx_http_eflv_index_t *index,
+    ngx_uint_t start_index, ngx_uint_t end_index, ngx_int_t have_end,
+    double *start, double *end, double filesize, ngx_http_eflv_clip_t *clip)
 {
-    double temp =0;
-    double file_pos = 0;
-
-    if ((flv == NULL) || (start == NULL) || (end == NULL) || (drag_FLVMetaData == NULL) ){
-        return -1;
-    }
+    off_t  start_pos, end_pos;
 
-    char *keyframes = ngx_http_eflv_get_position(flv, NGX_FLV_METADATALEN, filesize, "keyframes");
-    if (keyframes == NULL){
+    if (index->keyframes == 0 || start_index >= index->keyframes) {
         return -1;
     }
 
-    char *times = ngx_http_eflv_get_position(keyframes, NGX_FLV_METADATALEN, filesize, "times");
-    if ( times == NULL){
-        return -1;
+    if (!have_end || end_index > index->keyframes) {
+        end_index = index->keyframes;
     }
 
-    if (times[5] != 10){
+    if (end_index <= start_index) {
         return -1;
     }
 
-    char rbuf[32] = {0};
-    unsigned int keyframes_num = 0;
-    ngx_flv_revert_int(rbuf, &times[6],4);
-    ngx_memcpy(&keyframes_num, &rbuf,4);
+    start_pos = index->filepositions[start_index];
+    end_pos = (end_index < index->keyframes)
+              ? index->filepositions[end_index] : (off_t) filesize;
 
-    char *filepositions = ngx_http_eflv_get_position(keyframes, NGX_FLV_METADATALEN,filesize,"filepositions");
-    if(filepositions == NULL){
-        return -1;
-    }
-    if (filepositions[13] != 10){
+    if (start_pos < 0 || end_pos <= start_pos || end_pos > filesize) {
         return -1;
     }
 
-    char *p_duration = ngx_http_eflv_get_position(flv, NGX_FLV_METADATALEN,filesize,"duration");
-    if (p_duration == NULL){
-        ngx_flv_revert_int(rbuf, &times[10+(keyframes_num-1)*9+1],8);
-        ngx_memcpy(&temp, &rbuf, 8);
-    } else {
-        ngx_flv_revert_int(rbuf, &p_duration[9],8);
-        ngx_memcpy(&temp, &rbuf, 8);
-    }
-
-    int index = 0;
-    double start_time = 0, end_time = 0;
-    int start_key_index = 0;
-    double start_tmp = 0;
+    clip->start_index = start_index;
+    clip->end_index = end_index;
+    clip->start_time = index->times[start_index];
+    clip->duration = ((end_index < index->keyframes)
+                      ? index->times[end_index] : index->duration)
+                     - clip->start_time;
 
-    if (*start > temp){
-        *start = 0;
-    }
-    start_tmp = *start;
+    *start = start_pos;
+    *end = end_pos;
 
-    file_pos = ngx_http_flv_get_real_value(times, filepositions,keyframes_num,*start,-1,&index,&start_time);
-    if (file_pos == -1){
-        return -1;
-    }
-    if (file_pos >0 && file_pos <=filesize){
-        *start = file_pos;
-    }
-    if (index >=0){
-        start_key_index = index;
-    } else {
-        start_key_index = 0;
-    }
+    return 0;
+}
 
-    if (have_end == 1){
 
-        if (((start_tmp) > (*end)) || ((*end) > temp)){
-            *end = filesize;
-            drag_FLVMetaData->duration = temp - start_time ;
+static u_char *
+ngx_http_eflv_amf_put_name(u_char *p, char *name, size_t len)
+{
+    *p++ = (u_char) (len >> 8);
+    *p++ = (u_char) len;
 
-        } else {
-            file_pos = ngx_http_flv_get_real_value(times, filepositions,keyframes_num,*end,start_key_index,&index,&end_time);
-            if (file_pos == -1){
-                return -1;
-            } else if (file_pos == -2) {
-                *end = filesize;
-                drag_FLVMetaData->duration = temp - start_time ;
-            } else if (file_pos >0 && file_pos <=filesize) {
-                *end = file_pos;
-                drag_FLVMetaData->duration = end_time - start_time ;
-            } else {
-                ;
-            }
-        }
+    return ngx_cpymem(p, name, len);
+}
 
-    } else {
-        drag_FLVMetaData->duration = temp - start_time ;
-    }
 
-    return 0;
-}
+static u_char *
+ngx_http_eflv_amf_put_number(u_char *p, double value)
+{
+    *p++ = NGX_FLV_AMF_NUMBER;
 
+    ngx_flv_put_double(p, value);
 
-static ngx_int_t
-ntx_http_eflv_metadata(ngx_int_t fd,double *start , double *end,ngx_int_t have_end,double len,char *send_metadata_buf, char * send_tH264VideoTag_buf, char * send_tH264AudioTag_buf,ngx_int_t *video_size, ngx_int_t *audio_size,ngx_http_request_t *r)
-{
-    size_t  streampos;
-    ngx_flv_h264_tag_t tH264VideoTag, tH264AudioTag;
-    bzero(&tH264VideoTag,sizeof(tH264VideoTag));
-    bzero(&tH264AudioTag,sizeof(tH264AudioTag));
-
-    ngx_flv_meta_data_t drag_FLVMetaData;
-    bzero(&drag_FLVMetaData, sizeof(ngx_flv_meta_data_t));
-    ngx_flv_header_t *flvfileheader;
-    ngx_flv_h264_tag_t tMetaDataTag;
-    double *key_times = NULL;
-    double *key_filepos =NULL;
-    char flv[NGX_FLV_METADATALEN] = { 0 };
-    ngx_int_t n;
-    ngx_int_t i_read;
-    ngx_log_t    *log;
-    log = r->connection->log;
-    //flv = mmap(NULL, len, PROT_READ, MAP_PRIVATE, (int)fd, 0);
-    i_read = NGX_FLV_METADATALEN;
-    if (len< NGX_FLV_METADATALEN){
-        i_read = len;
-    }
-    n = read((int)fd,flv,i_read);
-    if ( -1 == n){
-        ngx_log_error(NGX_LOG_ALERT, log, ngx_errno,
-                           "ngx_flv_read"  " \"%d\" failed", (int)fd);
-    }
-
-    flvfileheader = (ngx_flv_header_t *)flv;
-    streampos = ngx_flv_get_32value(flvfileheader->headersize) + 4;
-
-    ngx_http_eflv_time_drag_position(flv,start,end,len,have_end,&drag_FLVMetaData,&key_times,&key_filepos,r);
-    ngx_http_eflv_read_secondpass(flv, streampos, len,&tMetaDataTag);
-
-    if (tMetaDataTag.start > 0) {
-            char *p_duration = NULL;
-            if (tMetaDataTag.datasize <= NGX_FLV_METADATALEN){
-                    ngx_memcpy(send_metadata_buf,flv+tMetaDataTag.start,tMetaDataTag.datasize);
-                    p_duration= ngx_http_eflv_get_position(send_metadata_buf, NGX_FLV_METADATALEN, len, "duration");
-                    if (p_duration != NULL){
-                            p_duration = p_duration+9;
-                            ngx_flv_swap_duration(p_duration,drag_FLVMetaData.duration);
-                    }
-            }
-    }
+    return p + 8;
+}
 
-    ngx_http_eflv_read_firstpass(flv, streampos, NGX_FLV_METADATALEN, &tH264VideoTag,&tH264AudioTag);
-    *video_size = (ngx_int_t)tH264VideoTag.datasize;
-    *audio_size = (ngx_int_t)tH264AudioTag.datasize;
 
-    if (tH264VideoTag.start > 0) {
-        ngx_memcpy(send_tH264VideoTag_buf, flv+tH264VideoTag.start,tH264VideoTag.datasize);
-    }
-    if (tH264AudioTag.start > 0) {
-        ngx_memcpy(send_tH264AudioTag_buf, flv+tH264AudioTag.start,tH264AudioTag.datasize);
-    }
+#define ngx_http_eflv_amf_is(name, s)                                         \
+    ((name)->len == sizeof(s) - 1                                             \
+     && ngx_strncmp((name)->data, s, sizeof(s) - 1) == 0)
 
-    return (ngx_int_t)tMetaDataTag.datasize;
-}
 
+/*
+ * builds the onMetaData tag of a clip: "duration", "filesize" and
+ * "datasize" get the values of the response, the "keyframes" object is
+ * replaced with the keyframes of the clip, with times relative to its
+ * start and positions within the response, and the other properties
+ * are copied as is; the "last*" properties of the whole file are left
+ * out
+ *
+ * "head" is the size of the FLV header and the sequence header tags
+ * that precede the slice of the file from "start" to "end"
+ */
 
 static ngx_int_t
-ngx_http_sflv_handler(ngx_http_request_t *r)
+ngx_http_eflv_rewrite_metadata(ngx_http_request_t *r,
+    ngx_http_eflv_index_t *index, ngx_http_eflv_clip_t *clip, off_t start,
+    off_t end, size_t head, ngx_str_t *metadata)
 {
-    u_char                    *last;
-    double                     start = 0, end = 0, len;
-    size_t                     root, metaend_pos;
-    ngx_int_t                  rc;
-    ngx_uint_t                 level, i,j;
-    ngx_str_t                  path, value;
-    ngx_log_t                 *log;
-    ngx_buf_t                 *b;
-    ngx_chain_t                out[4];
-    ngx_open_file_info_t       of;
-    ngx_http_core_loc_conf_t  *clcf;
-    char send_header_buf[16] = {0};
-    char send_metadata_buf[NGX_FLV_METADATALEN] = {0};
-    char send_tH264VideoTag_buf[NGX_FLV_METADATALEN] = {0};
-    char send_tH264AudioTag_buf[NGX_FLV_METADATALEN] = {0};
-    ngx_int_t  metadata_size =0;
-    ngx_int_t  video_size =0;
-    ngx_int_t  audio_size =0; 
-
-    i= 0; 
-    j= 0; 
-    if (!(r->method & (NGX_HTTP_GET|NGX_HTTP_HEAD))) {
-        return NGX_HTTP_NOT_ALLOWED;
-    }
-
-    if (r->uri.data[r->uri.len - 1] == '/') {
+    u_char      *p, *v, *next, *last, *props, *buf, *count, *filesize,
+                *datasize;
+    off_t        base, size;
+    size_t       len, keyframes_len;
+    uint32_t     n;
+    ngx_str_t    name;
+    ngx_uint_t   i, k, duration;
+
+    v = ngx_http_eflv_amf_metadata(index->metadata.data, index->metadata.len,
+                                   &last);
+    if (v == NULL) {
         return NGX_DECLINED;
     }
 
-    rc = ngx_http_discard_request_body(r);
+    p = index->metadata.data + sizeof(ngx_flv_tag_t);
+    props = v + ((*v == NGX_FLV_AMF_ECMA_ARRAY) ? 5 : 1);
 
-    if (rc != NGX_OK) {
-        return rc;
-    }
+    k = clip->end_index - clip->start_index;
 
-    last = ngx_http_map_uri_to_path(r, &path, &root, 0);
-    if (last == NULL) {
-        return NGX_HTTP_INTERNAL_SERVER_ERROR;
-    }
+    /* "keyframes" object with the "filepositions" and "times" arrays */
 
-    log = r->connection->log;
+    keyframes_len = 2 + sizeof("keyframes") - 1 + 1
+                    + 2 + sizeof("filepositions") - 1 + 5 + 9 * k
+                    + 2 + sizeof("times") - 1 + 5 + 9 * k
+                    + 3;
 
-    path.len = last - path.data;
+    /*
+     * a rewritten property grows by at most 8 bytes, two of them may be
+     * appended, an object marker may become an ECMA array one, and the
+     * end marker of a truncated object is added
+     */
 
-    ngx_log_debug1(NGX_LOG_DEBUG_HTTP, log, 0,
-            "http flv filename: \"%V\"", &path);
+    len = index->metadata.len + keyframes_len + 3 * 8
+          + 2 * (2 + sizeof("duration") - 1 + 9) + 4 + 3;
 
-    clcf = ngx_http_get_module_loc_conf(r, ngx_http_core_module);
+    buf = ngx_pnalloc(r->pool, len);
+    if (buf == NULL) {
+        return NGX_ERROR;
+    }
 
-    ngx_memzero(&of, sizeof(ngx_open_file_info_t));
+    /* the tag header, the name and the ECMA array marker */
 
-    of.read_ahead = clcf->read_ahead;
-    of.directio = clcf->directio;
-    of.valid = clcf->open_file_cache_valid;
-    of.min_uses = clcf->open_file_cache_min_uses;
-    of.errors = clcf->open_file_cache_errors;
-    of.events = clcf->open_file_cache_events;
+    ngx_memzero(buf, sizeof(ngx_flv_tag_t));
+    buf[0] = NGX_FLV_SCRIPTDATAOBJECT;
 
-    if (ngx_open_cached_file(clcf->open_file_cache, &path, &of, r->pool)
-            != NGX_OK)
-    {
-        switch (of.err) {
+    p = ngx_cpymem(buf + sizeof(ngx_flv_tag_t), p, v - p);
 
-            case 0:
-                return NGX_HTTP_INTERNAL_SERVER_ERROR;
+    *p++ = NGX_FLV_AMF_ECMA_ARRAY;
+    count = p;
+    p += 4;
 
-            case NGX_ENOENT:
-            case NGX_ENOTDIR:
-            case NGX_ENAMETOOLONG:
+    n = 0;
+    duration = 0;
+    filesize = NULL;
+    datasize = NULL;
 
-                level = NGX_LOG_ERR;
-                rc = NGX_HTTP_NOT_FOUND;
-                break;
+    for (v = props; /* void */; v = next) {
+        next = ngx_http_eflv_amf_next_prop(v, last, &name.data,
+                                           &name.len);
+        if (next == NULL) {
+            break;
+        }
 
-            case NGX_EACCES:
+        next = ngx_http_eflv_amf_skip(next, last, 1);
+        if (next == NULL) {
+            break;
+        }
 
-                level = NGX_LOG_ERR;
-                rc = NGX_HTTP_FORBIDDEN;
-                break;
+        if (ngx_http_eflv_amf_is(&name, "keyframes")
+            || ngx_http_eflv_amf_is(&name, "lasttimestamp")
+            || ngx_http_eflv_amf_is(&name, "lastkeyframetimestamp")
+            || ngx_http_eflv_amf_is(&name, "lastkeyframelocation"))
+        {
+            continue;
+        }
 
-            default:
+        /*
+         * only the first of repeated rewritten properties is kept, the
+         * buffer has room for one of each
+         */
 
-                level = NGX_LOG_CRIT;
-                rc = NGX_HTTP_INTERNAL_SERVER_ERROR;
-                break;
+        if ((duration && ngx_http_eflv_amf_is(&name, "duration"))
+            || (filesize && ngx_http_eflv_amf_is(&name, "filesize"))
+            || (datasize && ngx_http_eflv_amf_is(&name, "datasize")))
+        {
+            continue;
         }
 
-        if (rc != NGX_HTTP_NOT_FOUND || clcf->log_not_found) {
-            ngx_log_error(level, log, of.err,
-                    "%s \"%s\" failed", of.failed, path.data);
-        }
+        n++;
 
-        return rc;
-    }
+        if (ngx_http_eflv_amf_is(&name, "duration")) {
+            p = ngx_cpymem(p, v, 2 + name.len);
+            p = ngx_http_eflv_amf_put_number(p, clip->duration);
+            duration = 1;
+            continue;
+        }
 
-    if (!of.is_file) {
+        if (ngx_http_eflv_amf_is(&name, "filesize")) {
+            p = ngx_cpymem(p, v, 2 + name.len);
+            filesize = p;
+            p += 9;
+            continue;
+        }
 
-        if (ngx_close_file(of.fd) == NGX_FILE_ERROR) {
-            ngx_log_error(NGX_LOG_ALERT, log, ngx_errno,
-                    ngx_close_file_n " \"%s\" failed", path.data);
+        if (ngx_http_eflv_amf_is(&name, "datasize")) {
+            p = ngx_cpymem(p, v, 2 + name.len);
+            datasize = p;
+            p += 9;
+            continue;
         }
 
-        return NGX_DECLINED;
+        p = ngx_cpymem(p, v, next - v);
     }
 
-    r->root_tested = !r->error_page;
+    if (!duration) {
+        n++;
+        p = ngx_http_eflv_amf_put_name(p, "duration", sizeof("duration") - 1);
+        p = ngx_http_eflv_amf_put_number(p, clip->duration);
+    }
 
-    start = 0;
-    len = of.size;
+    if (filesize == NULL) {
+        n++;
+        p = ngx_http_eflv_amf_put_name(p, "filesize", sizeof("filesize") - 1);
+        filesize = p;
+        p += 9;
+    }
 
+    /* the tag ends with the keyframes, the object end and PreviousTagSize */
 
-    if (ngx_http_arg(r, (u_char *) "start", 5, &value) == NGX_OK) {
+    len = p - buf + keyframes_len + 3 + 4;
 
-        start = ngx_atoof(value.data, value.len);
+    size = head + len + (end - start);
+    base = head + len - start;
 
-        if (start > len){
-            return NGX_DECLINED; 
-        }
+    n++;
+    p = ngx_http_eflv_amf_put_name(p, "keyframes", sizeof("keyframes") - 1);
+    *p++ = NGX_FLV_AMF_OBJECT;
 
-        if (start == NGX_ERROR) {
-            start = 0;
-        }
+    p = ngx_http_eflv_amf_put_name(p, "filepositions",
+                                   sizeof("filepositions") - 1);
+    *p++ = NGX_FLV_AMF_STRICT_ARRAY;
+    ngx_flv_put_32value(p, k);
+    p += 4;
 
+    for (i = clip->start_index; i < clip->end_index; i++) {
+        p = ngx_http_eflv_amf_put_number(p, (double)
+                                         (base + index->filepositions[i]));
     }
 
-    end = len;
-    if (ngx_http_arg(r, (u_char *) "end", 3, &value) == NGX_OK) {
+    p = ngx_http_eflv_amf_put_name(p, "times", sizeof("times") - 1);
+    *p++ = NGX_FLV_AMF_STRICT_ARRAY;
+    ngx_flv_put_32value(p, k);
+    p += 4;
 
-        end = ngx_atoof(value.data, value.len) + 1;
-        if (end == NGX_ERROR || (end > len)) {
-            end = len;
-        }
+    for (i = clip->start_index; i < clip->end_index; i++) {
+        p = ngx_http_eflv_amf_put_number(p, index->times[i]
+                                            - clip->start_time);
     }
 
+    *p++ = 0;
+    *p++ = 0;
+    *p++ = NGX_FLV_AMF_OBJECT_END;
 
-    log->action = "sending sflv to client";
-    r->headers_out.status = NGX_HTTP_OK;
-    r->headers_out.last_modified_time = of.mtime;
+    /* the ECMA array end */
 
-    if (ngx_http_set_content_type(r) != NGX_OK) {
-        return NGX_HTTP_INTERNAL_SERVER_ERROR;
-    }
+    *p++ = 0;
+    *p++ = 0;
+    *p++ = NGX_FLV_AMF_OBJECT_END;
 
-    if (start != 0) { 
-        b = ngx_pcalloc(r->pool, sizeof(ngx_buf_t));
-        if (b == NULL) {
-            return NGX_HTTP_INTERNAL_SERVER_ERROR;
-        }
+    ngx_flv_put_32value(p, len - 4);
 
-        b->pos = ngx_flv_header;
-        b->last = ngx_flv_header + sizeof(ngx_flv_header) - 1;
-        b->memory = 1;
+    ngx_flv_put_24value(buf + 1, len - 4 - sizeof(ngx_flv_tag_t));
+    ngx_flv_put_32value(count, n);
 
-        out[j].buf = b;
-        out[j].next = &out[j+1];
-        j++;
+    ngx_http_eflv_amf_put_number(filesize, (double) size);
 
-        ntx_htt_sflv_metadata(of.fd,len,send_header_buf,send_metadata_buf,send_tH264VideoTag_buf,send_tH264AudioTag_buf,&metadata_size,&video_size,&audio_size,&metaend_pos, r); 
+    if (datasize) {
+        /* the tags, without the FLV header */
+        size -= sizeof(ngx_flv_header) - 1;
+        ngx_http_eflv_amf_put_number(datasize, (double) size);
+    }
 
-        if (video_size != 0) { 
-            b = ngx_pcalloc(r->pool, sizeof(ngx_buf_t));  
-            b->pos = (u_char*)send_tH264VideoTag_buf;  
-            b->last = (u_char*)(send_tH264VideoTag_buf + video_size);  
-            b->memory = 1;  
-            out[j].buf = b;
-            out[j].next = &out[j+1];
-            j++;
-        }	
+    metadata->data = buf;
+    metadata->len = len;
 
-        if (audio_size != 0) {
-            b = ngx_pcalloc(r->pool, sizeof(ngx_buf_t));  
-            b->pos = (u_char*)send_tH264AudioTag_buf;  
-            b->last = (u_char*)(send_tH264AudioTag_buf + audio_size);  
-            b->memory = 1;  
-            out[j].buf = b;
-            out[j].next = &out[j+1];
-            j++;
-        }
+    return NGX_OK;
+}
 
-        if (start > end) {
-            end = len;	
-        }
 
-        r->headers_out.content_length_n =sizeof(ngx_flv_header) - 1 + end -start + video_size + audio_size;
+static void
+ngx_http_eflv_cache_node_index(ngx_http_eflv_cache_node_t *node,
+    ngx_http_eflv_index_t *index)
+{
+    u_char  *p;
 
-        r->allow_ranges = 1;
-        rc = ngx_http_send_header(r);
-        if (rc == NGX_ERROR || rc > NGX_OK || r->header_only) {
-            return rc;
-        }
+    p = node->data + ngx_align(node->sn.str.len, sizeof(double));
 
-        if ((start != len) && (start != end)) {	
-            b = ngx_pcalloc(r->pool, sizeof(ngx_buf_t));
-            if (b == NULL) {
-                return NGX_HTTP_INTERNAL_SERVER_ERROR;
-            }
+    index->duration = node->duration;
+    index->keyframes = node->keyframes;
 
-            b->file = ngx_pcalloc(r->pool, sizeof(ngx_file_t));
-            if (b->file == NULL) {
-                return NGX_HTTP_INTERNAL_SERVER_ERROR;
-            }
+    index->times = (double *) p;
+    p += node->keyframes * sizeof(double);
 
-            b->file_pos = (off_t)start;
-            b->file_last = (off_t)end;
+    index->filepositions = (off_t *) p;
+    p += node->keyframes * sizeof(off_t);
 
-            b->in_file = b->file_last ? 1: 0;
-            b->last_buf = 1;
-            b->last_in_chain = 1;
+    index->metadata.data = p;
+    index->metadata.len = node->metadata_len;
+    index->duration_offset = node->duration_offset;
+    p += node->metadata_len;
 
-            b->file->fd = of.fd;
-            b->file->name = path;
-            b->file->log = log;
-            b->file->directio = of.is_directio;
+    index->video.data = p;
+    index->video.len = node->video_len;
+    p += node->video_len;
 
-            out[j].buf = b;
-            out[j].next = NULL;
-        } else {
-            b->last_buf = 1;
-            b->last_in_chain = 1;	
-            out[--j].next = NULL;
-        }	
-    } else {
-        r->headers_out.content_length_n = end -start;
+    index->audio.data = p;
+    index->audio.len = node->audio_len;
 
-        b = ngx_pcalloc(r->pool, sizeof(ngx_buf_t));
-        if (b == NULL) {
-            return NGX_HTTP_INTERNAL_SERVER_ERROR;
-        }
+    index->video_pos = node->video_pos;
+    index->audio_pos = node->audio_pos;
+}
 
-        b->file = ngx_pcalloc(r->pool, sizeof(ngx_file_t));
-        if (b->file == NULL) {
-            return NGX_HTTP_INTERNAL_SERVER_ERROR;
-        }
 
-        r->allow_ranges = 1;
-        rc = ngx_http_send_header(r);
-        if (rc == NGX_ERROR || rc > NGX_OK || r->header_only) {
-            return rc;
-        }
+static void
+ngx_http_eflv_cache_delete_locked(ngx_http_eflv_cache_t *cache,
+    ngx_http_eflv_cache_node_t *node)
+{
+    ngx_queue_remove(&node->queue);
+    ngx_rbtree_delete(&cache->sh->rbtree, &node->sn.node);
 
-        b->file_pos = (off_t)start;
-        b->file_last = (off_t)end;
+    if (node->count) {
+        /* still referenced by requests in flight, freed on release */
+        node->deleting = 1;
+        return;
+    }
 
-        b->in_file = b->file_last ? 1: 0;
-        b->last_buf = 1;
-        b->last_in_chain = 1;
+    ngx_slab_free_locked(cache->shpool, node);
+}
 
-        b->file->fd = of.fd;
-        b->file->name = path;
-        b->file->log = log;
-        b->file->directio = of.is_directio;
 
-        out[0].buf = b;
-        out[0].next = NULL;
-    } 
+static ngx_uint_t
+ngx_http_eflv_cache_expire_locked(ngx_http_eflv_cache_t *cache)
+{
+    ngx_queue_t                 *q;
+    ngx_http_eflv_cache_node_t  *node;
+
+    for (q = ngx_queue_last(&cache->sh->queue);
+         q != ngx_queue_sentinel(&cache->sh->queue);
+         q = ngx_queue_prev(q))
+    {
+        node = ngx_queue_data(q, ngx_http_eflv_cache_node_t, queue);
 
-    return ngx_http_output_filter(r, &out[i]);
+        if (node->count == 0) {
+            ngx_http_eflv_cache_delete_locked(cache, node);
+            ngx_http_eflv_stat(cache_evictions, 1);
+            return 1;
+        }
+    }
+
+    return 0;
 }
 
 
-static ngx_int_t
-ngx_http_tflv_handler(ngx_http_request_t *r)
+static void
+ngx_http_eflv_cache_cleanup(void *data)
 {
-    u_char                    *last;
-    double                     start =0,end =0, len;
-    size_t                     root;
-    ngx_int_t                  rc;
-    ngx_uint_t                 level,  i,j;
-    ngx_str_t                  path, value;
-    ngx_log_t                 *log;
-    ngx_buf_t                 *b;
-    ngx_chain_t                out[5];
-    ngx_open_file_info_t       of;
-    ngx_http_core_loc_conf_t  *clcf;
-    char send_metadata_buf[NGX_FLV_METADATALEN] = {0};
-    char send_tH264VideoTag_buf[NGX_FLV_METADATALEN] = {0};
-    char send_tH264AudioTag_buf[NGX_FLV_METADATALEN] = {0};
-    ngx_int_t  video_size =0;
-    ngx_int_t  audio_size =0;
+    ngx_http_eflv_cache_cleanup_t  *ecln = data;
 
-    ngx_int_t i_have_start = 0;
-    ngx_int_t i_have_end = 0;
+    ngx_http_eflv_cache_t       *cache;
+    ngx_http_eflv_cache_node_t  *node;
 
-    if (!(r->method & (NGX_HTTP_GET|NGX_HTTP_HEAD))) {
-        return NGX_HTTP_NOT_ALLOWED;
-    }
+    cache = ecln->cache;
+    node = ecln->node;
 
-    if (r->uri.data[r->uri.len - 1] == '/') {
-        return NGX_DECLINED;
-    }
-    rc = ngx_http_discard_request_body(r);
+    ngx_shmtx_lock(&cache->shpool->mutex);
 
-    if (rc != NGX_OK) {
-        return rc;
-    }
+    node->count--;
 
-    last = ngx_http_map_uri_to_path(r, &path, &root, 0);
-    if (last == NULL) {
-        return NGX_HTTP_INTERNAL_SERVER_ERROR;
+    if (node->count == 0 && node->deleting) {
+        ngx_slab_free_locked(cache->shpool, node);
     }
 
-    log = r->connection->log;
+    ngx_shmtx_unlock(&cache->shpool->mutex);
+}
 
-    path.len = last - path.data;
 
-    ngx_log_debug1(NGX_LOG_DEBUG_HTTP, log, 0,
-                   "http flv filename: \"%V\"", &path);
+static ngx_uint_t
+ngx_http_eflv_cache_lock_locked(ngx_http_eflv_cache_t *cache,
+    ngx_http_eflv_cache_node_t *node)
+{
+    /* lock ids are never 0, which marks a node with an index */
+
+    if (++cache->sh->lock == 0) {
+        cache->sh->lock = 1;
+    }
+
+    node->lock = cache->sh->lock;
+    node->lock_time = ngx_current_msec;
+
+    return node->lock;
+}
+
+
+static void
+ngx_http_eflv_cache_unlock(ngx_http_eflv_cache_lock_t *lock)
+{
+    uint32_t                     hash;
+    ngx_http_eflv_cache_t       *cache;
+    ngx_http_eflv_cache_node_t  *node;
+
+    if (lock->id == 0) {
+        return;
+    }
+
+    cache = lock->cache;
+
+    hash = ngx_crc32_long(lock->path.data, lock->path.len);
+
+    ngx_shmtx_lock(&cache->shpool->mutex);
+
+    node = (ngx_http_eflv_cache_node_t *)
+               ngx_str_rbtree_lookup(&cache->sh->rbtree, &lock->path, hash);
+
+    /* the lock may have been replaced by the index or taken over */
+
+    if (node && node->lock == lock->id) {
+        ngx_http_eflv_cache_delete_locked(cache, node);
+    }
+
+    ngx_shmtx_unlock(&cache->shpool->mutex);
+
+    lock->id = 0;
+}
+
+
+static void
+ngx_http_eflv_cache_lock_cleanup(void *data)
+{
+    ngx_http_eflv_cache_lock_t  *lock = data;
+
+    if (lock->wait.timer_set) {
+        ngx_del_timer(&lock->wait);
+    }
+
+    ngx_http_eflv_cache_unlock(lock);
+}
+
+
+/*
+ * on a miss with "lock" set, the request takes the build lock of the
+ * file: a node without an index which makes other requests for the file
+ * wait with NGX_BUSY until the index is inserted, the lock is released,
+ * or it grows older than "timeout"
+ */
+
+static ngx_int_t
+ngx_http_eflv_cache_lookup(ngx_http_request_t *r, ngx_shm_zone_t *shm_zone,
+    ngx_str_t *path, ngx_open_file_info_t *of, ngx_http_eflv_index_t *index,
+    ngx_http_eflv_cache_lock_t *lock, ngx_msec_t timeout)
+{
+    size_t                          size;
+    uint32_t                        hash;
+    ngx_pool_cleanup_t             *cln;
+    ngx_http_eflv_cache_t          *cache;
+    ngx_http_eflv_cache_node_t     *node;
+    ngx_http_eflv_cache_cleanup_t  *ecln, ref;
+
+    cache = shm_zone->data;
+
+    hash = ngx_crc32_long(path->data, path->len);
+
+    ngx_shmtx_lock(&cache->shpool->mutex);
+
+    node = (ngx_http_eflv_cache_node_t *)
+               ngx_str_rbtree_lookup(&cache->sh->rbtree, path, hash);
+
+    if (node && node->lock) {
+
+        if (lock == NULL) {
+            ngx_shmtx_unlock(&cache->shpool->mutex);
+            return NGX_DECLINED;
+        }
+
+        if ((ngx_msec_int_t) (ngx_current_msec - node->lock_time)
+            < (ngx_msec_int_t) timeout)
+        {
+            ngx_shmtx_unlock(&cache->shpool->mutex);
+            return NGX_BUSY;
+        }
+
+        /* a stale lock, e.g. of a worker that exited */
+
+        lock->id = ngx_http_eflv_cache_lock_locked(cache, node);
+
+        ngx_shmtx_unlock(&cache->shpool->mutex);
+        return NGX_DECLINED;
+    }
+
+    if (node
+        && (node->uniq != of->uniq || node->mtime != of->mtime
+            || node->size != of->size))
+    {
+        ngx_http_eflv_cache_delete_locked(cache, node);
+        node = NULL;
+    }
+
+    if (node == NULL) {
+
+        if (lock) {
+            size = offsetof(ngx_http_eflv_cache_node_t, data) + path->len;
+
+            for ( ;; ) {
+                node = ngx_slab_alloc_locked(cache->shpool, size);
+
+                if (node != NULL
+                    || !ngx_http_eflv_cache_expire_locked(cache))
+                {
+                    break;
+                }
+            }
+
+            if (node) {
+                ngx_memzero(node, offsetof(ngx_http_eflv_cache_node_t, data));
+
+                node->sn.node.key = hash;
+                node->sn.str.len = path->len;
+                node->sn.str.data = node->data;
+                ngx_memcpy(node->data, path->data, path->len);
+
+                ngx_rbtree_insert(&cache->sh->rbtree, &node->sn.node);
+                ngx_queue_insert_head(&cache->sh->queue, &node->queue);
+
+                lock->id = ngx_http_eflv_cache_lock_locked(cache, node);
+            }
+        }
+
+        ngx_shmtx_unlock(&cache->shpool->mutex);
+        return NGX_DECLINED;
+    }
+
+    node->count++;
+
+    ngx_queue_remove(&node->queue);
+    ngx_queue_insert_head(&cache->sh->queue, &node->queue);
+
+    ngx_shmtx_unlock(&cache->shpool->mutex);
+
+    /* the cleanup is only added for a taken reference, not for each poll */
+
+    cln = ngx_pool_cleanup_add(r->pool, sizeof(ngx_http_eflv_cache_cleanup_t));
+    if (cln == NULL) {
+        ref.cache = cache;
+        ref.node = node;
+
+        ngx_http_eflv_cache_cleanup(&ref);
+
+        return NGX_ERROR;
+    }
+
+    ngx_http_eflv_cache_node_index(node, index);
+
+    ecln = cln->data;
+    ecln->cache = cache;
+    ecln->node = node;
+
+    cln->handler = ngx_http_eflv_cache_cleanup;
+
+    ngx_log_debug1(NGX_LOG_DEBUG_HTTP, r->connection->log, 0,
+                   "eflv index cache hit: \"%V\"", path);
+
+    return NGX_OK;
+}
+
+
+static void
+ngx_http_eflv_cache_insert(ngx_http_request_t *r, ngx_shm_zone_t *shm_zone,
+    ngx_str_t *path, ngx_open_file_info_t *of, ngx_http_eflv_index_t *index)
+{
+    u_char                      *p;
+    size_t                       size;
+    uint32_t                     hash;
+    ngx_http_eflv_cache_t       *cache;
+    ngx_http_eflv_cache_node_t  *node;
+
+    cache = shm_zone->data;
+
+    size = offsetof(ngx_http_eflv_cache_node_t, data)
+           + ngx_align(path->len, sizeof(double))
+           + index->keyframes * (sizeof(double) + sizeof(off_t))
+           + index->metadata.len + index->video.len + index->audio.len;
+
+    hash = ngx_crc32_long(path->data, path->len);
+
+    ngx_shmtx_lock(&cache->shpool->mutex);
+
+    node = (ngx_http_eflv_cache_node_t *)
+               ngx_str_rbtree_lookup(&cache->sh->rbtree, path, hash);
+
+    if (node) {
+
+        if (!node->lock) {
+            ngx_shmtx_unlock(&cache->shpool->mutex);
+            return;
+        }
+
+        /* the index replaces the build lock, whoever holds it */
+
+        ngx_http_eflv_cache_delete_locked(cache, node);
+    }
+
+    for ( ;; ) {
+        node = ngx_slab_alloc_locked(cache->shpool, size);
+
+        if (node != NULL || !ngx_http_eflv_cache_expire_locked(cache)) {
+            break;
+        }
+    }
+
+    if (node == NULL) {
+        ngx_shmtx_unlock(&cache->shpool->mutex);
+
+        ngx_log_error(NGX_LOG_WARN, r->connection->log, 0,
+                      "could not allocate %uz bytes in eflv index cache "
+                      "zone \"%V\" for \"%V\"",
+                      size, &shm_zone->shm.name, path);
+        return;
+    }
+
+    node->sn.node.key = hash;
+    node->sn.str.len = path->len;
+    node->sn.str.data = node->data;
+
+    node->uniq = of->uniq;
+    node->mtime = of->mtime;
+    node->size = of->size;
+
+    node->count = 0;
+    node->deleting = 0;
+    node->lock = 0;
+    node->lock_time = 0;
+
+    node->duration = index->duration;
+    node->keyframes = index->keyframes;
+    node->metadata_len = index->metadata.len;
+    node->duration_offset = index->duration_offset;
+    node->video_len = index->video.len;
+    node->audio_len = index->audio.len;
+    node->video_pos = index->video_pos;
+    node->audio_pos = index->audio_pos;
+
+    ngx_memcpy(node->data, path->data, path->len);
+
+    p = node->data + ngx_align(path->len, sizeof(double));
+    p = ngx_cpymem(p, index->times, index->keyframes * sizeof(double));
+    p = ngx_cpymem(p, index->filepositions,
+                   index->keyframes * sizeof(off_t));
+    p = ngx_cpymem(p, index->metadata.data, index->metadata.len);
+    p = ngx_cpymem(p, index->video.data, index->video.len);
+    ngx_memcpy(p, index->audio.data, index->audio.len);
+
+    ngx_rbtree_insert(&cache->sh->rbtree, &node->sn.node);
+    ngx_queue_insert_head(&cache->sh->queue, &node->queue);
+
+    ngx_shmtx_unlock(&cache->shpool->mutex);
+}
+
+
+static ssize_t
+ngx_http_eflv_read(ngx_http_request_t *r, ngx_file_t *file, u_char *buf,
+    size_t size, off_t offset)
+{
+#if (NGX_THREADS || NGX_HAVE_FILE_AIO)
+    ssize_t                    n;
+    ngx_http_core_loc_conf_t  *clcf;
+
+    clcf = ngx_http_get_module_loc_conf(r, ngx_http_core_module);
+#endif
+
+#if (NGX_THREADS)
+
+    if (clcf->aio == NGX_HTTP_AIO_THREADS) {
+        file->thread_handler = ngx_http_eflv_thread_handler;
+        file->thread_ctx = r;
+
+        return ngx_thread_read(file, buf, size, offset, r->pool);
+    }
+
+#endif
+
+#if (NGX_HAVE_FILE_AIO)
+
+    if (clcf->aio == NGX_HTTP_AIO_ON && ngx_file_aio) {
+        n = ngx_file_aio_read(file, buf, size, offset, r->pool);
+
+        if (n != NGX_AGAIN) {
+            return n;
+        }
+
+        file->aio->data = r;
+        file->aio->handler = ngx_http_eflv_aio_event_handler;
+
+        r->main->blocked++;
+        r->aio = 1;
+
+        return NGX_AGAIN;
+    }
+
+#endif
+
+    return ngx_read_file(file, buf, size, offset);
+}
+
+
+#if (NGX_HAVE_FILE_AIO)
+
+static void
+ngx_http_eflv_aio_event_handler(ngx_event_t *ev)
+{
+    ngx_event_aio_t     *aio;
+    ngx_connection_t    *c;
+    ngx_http_request_t  *r;
+
+    aio = ev->data;
+    r = aio->data;
+    c = r->connection;
+
+    ngx_http_set_log_request(c->log, r);
+
+    ngx_log_debug2(NGX_LOG_DEBUG_HTTP, c->log, 0,
+                   "eflv aio: \"%V?%V\"", &r->uri, &r->args);
+
+    r->main->blocked--;
+    r->aio = 0;
+
+    ngx_http_finalize_request(r, ngx_http_eflv_process(r));
+
+    ngx_http_run_posted_requests(c);
+}
+
+#endif
+
+
+#if (NGX_THREADS)
+
+static ngx_thread_pool_t *
+ngx_http_eflv_thread_pool(ngx_http_request_t *r)
+{
+    ngx_str_t                  name;
+    ngx_thread_pool_t         *tp;
+    ngx_http_core_loc_conf_t  *clcf;
+
+    clcf = ngx_http_get_module_loc_conf(r, ngx_http_core_module);
+    tp = clcf->thread_pool;
+
+    if (tp == NULL) {
+        if (ngx_http_complex_value(r, clcf->thread_pool_value, &name)
+            != NGX_OK)
+        {
+            return NULL;
+        }
+
+        tp = ngx_thread_pool_get((ngx_cycle_t *) ngx_cycle, &name);
+
+        if (tp == NULL) {
+            ngx_log_error(NGX_LOG_ERR, r->connection->log, 0,
+                          "thread pool \"%V\" not found", &name);
+            return NULL;
+        }
+    }
+
+    return tp;
+}
+
+
+static ngx_int_t
+ngx_http_eflv_thread_handler(ngx_thread_task_t *task, ngx_file_t *file)
+{
+    ngx_thread_pool_t         *tp;
+    ngx_http_request_t        *r;
+
+    r = file->thread_ctx;
+
+    tp = ngx_http_eflv_thread_pool(r);
+    if (tp == NULL) {
+        return NGX_ERROR;
+    }
+
+    task->event.data = r;
+    task->event.handler = ngx_http_eflv_thread_event_handler;
+
+    if (ngx_thread_task_post(tp, task) != NGX_OK) {
+        return NGX_ERROR;
+    }
+
+    r->main->blocked++;
+    r->aio = 1;
+
+    return NGX_OK;
+}
+
+
+static void
+ngx_http_eflv_thread_event_handler(ngx_event_t *ev)
+{
+    ngx_connection_t    *c;
+    ngx_http_request_t  *r;
+
+    r = ev->data;
+    c = r->connection;
+
+    ngx_http_set_log_request(c->log, r);
+
+    ngx_log_debug2(NGX_LOG_DEBUG_HTTP, c->log, 0,
+                   "eflv thread: \"%V?%V\"", &r->uri, &r->args);
+
+    r->main->blocked--;
+    r->aio = 0;
+
+    ngx_http_finalize_request(r, ngx_http_eflv_process(r));
+
+    ngx_http_run_posted_requests(c);
+}
+
+#endif
+
+
+static ngx_int_t
+ngx_http_eflv_read_head(ngx_http_request_t *r, ngx_http_eflv_ctx_t *ctx,
+    size_t size)
+{
+    u_char   *buf;
+    size_t    want;
+    ssize_t   n;
+
+    if ((off_t) size > ctx->of.size) {
+        return NGX_DECLINED;
+    }
+
+    while (ctx->last < size) {
+
+        if (ctx->want <= ctx->last) {
+
+            /* read ahead a little, the next tags are usually close */
+
+            want = ngx_max(size, ctx->last + NGX_FLV_HEAD_STEP);
+
+            if ((off_t) want > ctx->of.size) {
+                want = (size_t) ctx->of.size;
+            }
+
+            if (want > ctx->size) {
+                ctx->size = ngx_max(want, 2 * ctx->size);
+
+                buf = ngx_pnalloc(r->pool, ctx->size);
+                if (buf == NULL) {
+                    return NGX_ERROR;
+                }
+
+                if (ctx->buf) {
+                    ngx_memcpy(buf, ctx->buf, ctx->last);
+                    ngx_pfree(r->pool, ctx->buf);
+                }
+
+                ctx->buf = buf;
+            }
+
+            ctx->want = want;
+        }
+
+        n = ngx_http_eflv_read(r, &ctx->file, ctx->buf + ctx->last,
+                               ctx->want - ctx->last, ctx->last);
+
+        if (n == NGX_AGAIN || n == NGX_ERROR) {
+            return n;
+        }
+
+        if (n == 0) {
+            ngx_log_error(NGX_LOG_ERR, r->connection->log, 0,
+                          "file \"%V\" was truncated", &ctx->path);
+            return NGX_ERROR;
+        }
+
+        ngx_log_debug3(NGX_LOG_DEBUG_HTTP, r->connection->log, 0,
+                       "eflv head read: %z bytes at %uz of %uz",
+                       n, ctx->last, size);
+
+        ctx->last += n;
+    }
+
+    return NGX_OK;
+}
+
+
+static ngx_int_t
+ngx_http_eflv_copy_tag(ngx_http_request_t *r, ngx_http_eflv_ctx_t *ctx,
+    ngx_flv_h264_tag_t *tag, ngx_str_t *dst)
+{
+    if (tag->datasize == 0) {
+        return NGX_OK;
+    }
+
+    dst->data = ngx_pnalloc(r->pool, tag->datasize);
+    if (dst->data == NULL) {
+        return NGX_ERROR;
+    }
+
+    ngx_memcpy(dst->data, ctx->buf + tag->start, tag->datasize);
+    dst->len = tag->datasize;
+
+    return NGX_OK;
+}
+
+
+static ngx_int_t
+ntx_http_eflv_metadata(ngx_http_request_t *r, ngx_http_eflv_ctx_t *ctx)
+{
+    u_char                *p;
+    size_t                 datasize, limit;
+    ngx_int_t              rc;
+    ngx_uint_t             audio, config, sequence;
+    ngx_flv_tag_t         *flvtag;
+    ngx_flv_header_t      *flvfileheader;
+    ngx_flv_h264_tag_t    *header;
+    ngx_http_eflv_index_t *index;
+
+    index = &ctx->index;
+
+    if (ctx->pos == 0) {
+        rc = ngx_http_eflv_read_head(r, ctx, sizeof(ngx_flv_header_t));
+
+        if (rc != NGX_OK) {
+            return (rc == NGX_DECLINED) ? NGX_OK : rc;
+        }
+
+        flvfileheader = (ngx_flv_header_t *) ctx->buf;
+
+        if (ngx_strncmp(flvfileheader->signature, "FLV", 3) != 0) {
+            ngx_log_error(NGX_LOG_ERR, r->connection->log, 0,
+                          "\"%V\" is not an flv file", &ctx->path);
+            return NGX_OK;
+        }
+
+        ctx->pos = ngx_flv_get_32value(flvfileheader->headersize) + 4;
+        ctx->first = ctx->pos;
+
+        /* the streams the header announces, either one may be absent */
+
+        ctx->video_done = !(flvfileheader->flags & 0x01);
+        ctx->audio_done = !(flvfileheader->flags & 0x04);
+    }
+
+    /*
+     * walk the tags of the file head: the first script tag is onMetaData,
+     * followed by the AVC or enhanced FLV video and the AAC sequence header
+     * tags, which other codecs do not have; the walk stops when all of them
+     * are found or after NGX_FLV_METADATALEN bytes past the metadata
+     */
+
+    for ( ;; ) {
+
+        limit = ctx->metadata.start ? ctx->metadata.start
+                                      + ctx->metadata.datasize
+                                    : 0;
+
+        if (ctx->pos > limit + NGX_FLV_METADATALEN) {
+            break;
+        }
+
+        rc = ngx_http_eflv_read_head(r, ctx, ctx->pos + sizeof(ngx_flv_tag_t));
+
+        if (rc == NGX_DECLINED) {
+            break;
+        }
+
+        if (rc != NGX_OK) {
+            return rc;
+        }
+
+        flvtag = (ngx_flv_tag_t *) (ctx->buf + ctx->pos);
+
+        datasize = ngx_flv_tag_size(flvtag);
+
+        if (flvtag->type == NGX_FLV_SCRIPTDATAOBJECT) {
+
+            if (ctx->metadata.start == 0) {
+                rc = ngx_http_eflv_read_head(r, ctx, ctx->pos + datasize);
+
+                if (rc == NGX_DECLINED) {
+                    break;
+                }
+
+                if (rc != NGX_OK) {
+                    return rc;
+                }
+
+                ctx->metadata.start = ctx->pos;
+                ctx->metadata.datasize = datasize;
+            }
+
+        } else if (flvtag->type == NGX_FLV_AUDIODATA
+                   || flvtag->type == NGX_FLV_VIDEODATA)
+        {
+            /* shorter tag data has no packet type to check */
+
+            if ((!ctx->video_done || !ctx->audio_done)
+                && ngx_flv_get_24value(flvtag->datasize) >= 2)
+            {
+                /* the sound or video flags and the packet type */
+
+                rc = ngx_http_eflv_read_head(r, ctx, ctx->pos
+                                                     + sizeof(ngx_flv_tag_t)
+                                                     + 2);
+                if (rc == NGX_DECLINED) {
+                    break;
+                }
+
+                if (rc != NGX_OK) {
+                    return rc;
+                }
+
+                /* the buffer may have been moved */
+
+                flvtag = (ngx_flv_tag_t *) (ctx->buf + ctx->pos);
+                p = ctx->buf + ctx->pos + sizeof(ngx_flv_tag_t);
+
+                audio = (flvtag->type == NGX_FLV_AUDIODATA);
+
+                if (audio) {
+                    header = &ctx->audio;
+                    config = ((p[0] >> 4) == NGX_FLV_AAC);
+                    sequence = (config && p[1] == 0);
+
+                } else {
+                    header = &ctx->video;
+                    config = ((p[0] & NGX_FLV_VIDEO_EX_HEADER)
+                              || (p[0] & 0xf) == NGX_FLV_AVCVIDEOPACKET);
+                    sequence = ngx_http_eflv_tag_video_config(flvtag);
+                }
+
+                if (sequence && header->start == 0) {
+                    rc = ngx_http_eflv_read_head(r, ctx, ctx->pos + datasize);
+
+                    if (rc == NGX_DECLINED) {
+                        break;
+                    }
+
+                    if (rc != NGX_OK) {
+                        return rc;
+                    }
+
+                    header->start = ctx->pos;
+                    header->datasize = datasize;
+                }
+
+                if (!config || header->start) {
+
+                    if (audio) {
+                        ctx->audio_done = 1;
+
+                    } else {
+                        ctx->video_done = 1;
+                    }
+                }
+            }
+
+        } else {
+            break;
+        }
+
+        if (ctx->metadata.start && ctx->video_done && ctx->audio_done) {
+            break;
+        }
+
+        ctx->pos += datasize;
+    }
+
+    ngx_memzero(index, sizeof(ngx_http_eflv_index_t));
+
+    if (ngx_http_eflv_copy_tag(r, ctx, &ctx->metadata, &index->metadata)
+        != NGX_OK
+        || ngx_http_eflv_copy_tag(r, ctx, &ctx->video, &index->video)
+           != NGX_OK
+        || ngx_http_eflv_copy_tag(r, ctx, &ctx->audio, &index->audio)
+           != NGX_OK)
+    {
+        return NGX_ERROR;
+    }
+
+    index->video_pos = ctx->video.start;
+    index->audio_pos = ctx->audio.start;
+
+    ngx_pfree(r->pool, ctx->buf);
+
+    if (index->metadata.len
+        && ngx_http_eflv_parse_metadata(r, index->metadata.data,
+                                        index->metadata.len, index)
+           == NGX_ERROR)
+    {
+        return NGX_ERROR;
+    }
+
+    return NGX_OK;
+}
+
+
+#if (NGX_THREADS)
+
+/*
+ * builds a keyframe index by walking the tag headers of a file whose
+ * onMetaData carries none, of audio frames at least NGX_FLV_AUDIO_SEEK_STEP
+ * apart until a video tag is met; this may run in a thread pool, so it
+ * must not touch the request, its pool or its log
+ */
+
+static void
+ngx_http_eflv_scan_handler(void *data, ngx_log_t *log)
+{
+    ngx_http_eflv_scan_t *scan = data;
+
+    off_t                  pos, base, *filepositions;
+    size_t                 len;
+    ssize_t                n;
+    double                 time, *times;
+    uint32_t               timestamp, last;
+    ngx_uint_t             nalloc, video;
+    ngx_flv_tag_t         *flvtag;
+
+    scan->file.log = log;
+
+    pos = scan->offset;
+    base = 0;
+    n = 0;
+    last = 0;
+    video = 0;
+
+    while (pos + (off_t) sizeof(ngx_flv_tag_t) <= scan->size) {
+
+        /* the tag header, the media flags and the packet type */
+
+        if (pos + (off_t) sizeof(ngx_flv_tag_t) + 2 > base + n) {
+            len = (size_t) ngx_min((off_t) scan->buf_size, scan->size - pos);
+
+            n = ngx_read_file(&scan->file, scan->buf, len, pos);
+
+            if (n == NGX_ERROR) {
+                goto failed;
+            }
+
+            if ((size_t) n < sizeof(ngx_flv_tag_t)) {
+                break;
+            }
+
+            base = pos;
+        }
+
+        flvtag = (ngx_flv_tag_t *) (scan->buf + (pos - base));
+
+        if (flvtag->type != NGX_FLV_AUDIODATA
+            && flvtag->type != NGX_FLV_VIDEODATA
+            && flvtag->type != NGX_FLV_SCRIPTDATAOBJECT)
+        {
+            ngx_log_error(NGX_LOG_WARN, log, 0,
+                          "unexpected tag type %d at offset %O in \"%V\"",
+                          (int) flvtag->type, pos, &scan->file.name);
+            break;
+        }
+
+        timestamp = ngx_flv_tag_timestamp(flvtag);
+
+        if (flvtag->type == NGX_FLV_VIDEODATA && !video) {
+            /* the audio seek points are dropped */
+            video = 1;
+            scan->keyframes = 0;
+        }
+
+        if (pos + (off_t) sizeof(ngx_flv_tag_t) + 2 <= base + n
+            && (ngx_http_eflv_tag_keyframe(flvtag)
+                || (!video && ngx_http_eflv_tag_audio_frame(flvtag))))
+        {
+            time = timestamp / 1000.0;
+
+            if (scan->keyframes == 0
+                || (video ? time > scan->times[scan->keyframes - 1]
+                          : time >= scan->times[scan->keyframes - 1]
+                                    + NGX_FLV_AUDIO_SEEK_STEP))
+            {
+                if (scan->keyframes == scan->nalloc) {
+                    nalloc = scan->nalloc ? 2 * scan->nalloc : 256;
+
+                    times = ngx_alloc(nalloc * (sizeof(double) + sizeof(off_t)),
+                                      log);
+                    if (times == NULL) {
+                        goto failed;
+                    }
+
+                    filepositions = (off_t *) (times + nalloc);
+
+                    if (scan->keyframes) {
+                        ngx_memcpy(times, scan->times,
+                                   scan->keyframes * sizeof(double));
+                        ngx_memcpy(filepositions, scan->filepositions,
+                                   scan->keyframes * sizeof(off_t));
+                        ngx_free(scan->times);
+                    }
+
+                    scan->times = times;
+                    scan->filepositions = filepositions;
+                    scan->nalloc = nalloc;
+                }
+
+                scan->times[scan->keyframes] = time;
+                scan->filepositions[scan->keyframes] = pos;
+                scan->keyframes++;
+            }
+        }
+
+        if (timestamp > last) {
+            last = timestamp;
+        }
+
+        pos += ngx_flv_tag_size(flvtag);
+    }
+
+    scan->duration = last / 1000.0;
+    scan->rc = NGX_OK;
+
+    return;
+
+failed:
+
+    if (scan->times) {
+        ngx_free(scan->times);
+        scan->times = NULL;
+    }
+
+    scan->keyframes = 0;
+    scan->rc = NGX_ERROR;
+}
+
+
+/*
+ * the walk reads the whole file, so it only runs in a thread pool and
+ * NGX_DECLINED is returned without "aio threads"
+ */
+
+static ngx_int_t
+ngx_http_eflv_generate_index(ngx_http_request_t *r, ngx_http_eflv_ctx_t *ctx)
+{
+    ngx_thread_task_t         *task;
+    ngx_thread_pool_t         *tp;
+    ngx_http_eflv_scan_t      *scan;
+    ngx_http_eflv_index_t     *index;
+    ngx_http_core_loc_conf_t  *clcf;
+
+    scan = ctx->scan;
+
+    if (scan == NULL) {
+
+        clcf = ngx_http_get_module_loc_conf(r, ngx_http_core_module);
+
+        if (clcf->aio != NGX_HTTP_AIO_THREADS) {
+            ngx_log_debug1(NGX_LOG_DEBUG_HTTP, r->connection->log, 0,
+                           "eflv generate index: no thread pool for \"%V\"",
+                           &ctx->path);
+            return NGX_DECLINED;
+        }
+
+        task = ngx_thread_task_alloc(r->pool, sizeof(ngx_http_eflv_scan_t));
+        if (task == NULL) {
+            return NGX_ERROR;
+        }
+
+        scan = task->ctx;
+
+        scan->file.fd = ctx->of.fd;
+        scan->file.name = ctx->path;
+        scan->offset = ctx->first;
+        scan->size = ctx->of.size;
+        scan->buf_size = NGX_FLV_SCAN_STEP;
+
+        scan->buf = ngx_palloc(r->pool, scan->buf_size);
+        if (scan->buf == NULL) {
+            return NGX_ERROR;
+        }
+
+        ctx->scan = scan;
+
+        ngx_log_debug2(NGX_LOG_DEBUG_HTTP, r->connection->log, 0,
+                       "eflv generate index: \"%V\" from %O",
+                       &ctx->path, scan->offset);
+
+        tp = ngx_http_eflv_thread_pool(r);
+        if (tp == NULL) {
+            return NGX_ERROR;
+        }
+
+        task->handler = ngx_http_eflv_scan_handler;
+        task->event.data = r;
+        task->event.handler = ngx_http_eflv_thread_event_handler;
+
+        if (ngx_thread_task_post(tp, task) != NGX_OK) {
+            return NGX_ERROR;
+        }
+
+        r->main->blocked++;
+        r->aio = 1;
+
+        return NGX_AGAIN;
+    }
+
+    ngx_pfree(r->pool, scan->buf);
+
+    if (scan->rc != NGX_OK) {
+        return NGX_ERROR;
+    }
+
+    ngx_log_debug1(NGX_LOG_DEBUG_HTTP, r->connection->log, 0,
+                   "eflv generated index: %ui keyframes", scan->keyframes);
+
+    if (scan->keyframes == 0) {
+        return NGX_OK;
+    }
+
+    index = &ctx->index;
+
+    index->times = ngx_palloc(r->pool, scan->keyframes * sizeof(double));
+    index->filepositions = ngx_palloc(r->pool,
+                                      scan->keyframes * sizeof(off_t));
+
+    if (index->times == NULL || index->filepositions == NULL) {
+        ngx_free(scan->times);
+        return NGX_ERROR;
+    }
+
+    ngx_memcpy(index->times, scan->times, scan->keyframes * sizeof(double));
+    ngx_memcpy(index->filepositions, scan->filepositions,
+               scan->keyframes * sizeof(off_t));
+
+    index->keyframes = scan->keyframes;
+
+    if (index->duration_offset == 0) {
+        index->duration = scan->duration;
+    }
+
+    ngx_free(scan->times);
+
+    return NGX_OK;
+}
+
+#endif
+
+
+static void
+ngx_http_eflv_munmap(void *data)
+{
+    ngx_http_eflv_mmap_t *m = data;
+
+    if (munmap(m->addr, m->size) == -1) {
+        ngx_log_error(NGX_LOG_ALERT, m->log, ngx_errno,
+                      "munmap(%uz) failed", m->size);
+    }
+}
+
+
+/*
+ * maps the sidecar index file "<file>.eidx" read-only; the index then
+ * points into the mapping, which lives until the request pool is freed
+ */
+
+static ngx_int_t
+ngx_http_eflv_read_index_file(ngx_http_request_t *r, ngx_http_eflv_ctx_t *ctx)
+{
+    u_char                      *p;
+    size_t                       size;
+    ngx_str_t                    path;
+    ngx_log_t                   *log;
+    ngx_pool_cleanup_t          *cln;
+    ngx_open_file_info_t         of;
+    ngx_http_eflv_mmap_t        *m;
+    ngx_http_eflv_index_t       *index;
+    ngx_http_core_loc_conf_t    *clcf;
+    ngx_http_eflv_index_file_t  *h;
+
+    log = r->connection->log;
+
+    path.len = ctx->path.len + sizeof(NGX_HTTP_EFLV_INDEX_FILE_EXT) - 1;
+    path.data = ngx_pnalloc(r->pool, path.len + 1);
+    if (path.data == NULL) {
+        return NGX_ERROR;
+    }
+
+    ngx_memcpy(ngx_cpymem(path.data, ctx->path.data, ctx->path.len),
+               NGX_HTTP_EFLV_INDEX_FILE_EXT,
+               sizeof(NGX_HTTP_EFLV_INDEX_FILE_EXT));
+
+    clcf = ngx_http_get_module_loc_conf(r, ngx_http_core_module);
+
+    ngx_memzero(&of, sizeof(ngx_open_file_info_t));
+
+    of.directio = NGX_MAX_OFF_T_VALUE;
+    of.valid = clcf->open_file_cache_valid;
+    of.min_uses = clcf->open_file_cache_min_uses;
+    of.errors = clcf->open_file_cache_errors;
+    of.events = clcf->open_file_cache_events;
+
+    if (ngx_open_cached_file(clcf->open_file_cache, &path, &of, r->pool)
+        != NGX_OK)
+    {
+        if (of.err != 0 && of.err != NGX_ENOENT && of.err != NGX_ENOTDIR) {
+            ngx_log_error(NGX_LOG_ERR, log, of.err,
+                          "%s \"%s\" failed", of.failed, path.data);
+        }
+
+        return NGX_DECLINED;
+    }
+
+    if (!of.is_file
+        || of.size < (off_t) sizeof(ngx_http_eflv_index_file_t)
+        || sizeof(off_t) != sizeof(int64_t))
+    {
+        return NGX_DECLINED;
+    }
+
+    size = (size_t) of.size;
+
+    cln = ngx_pool_cleanup_add(r->pool, sizeof(ngx_http_eflv_mmap_t));
+    if (cln == NULL) {
+        return NGX_ERROR;
+    }
+
+    p = mmap(NULL, size, PROT_READ, MAP_SHARED, of.fd, 0);
+
+    if (p == MAP_FAILED) {
+        ngx_log_error(NGX_LOG_CRIT, log, ngx_errno,
+                      "mmap(%uz) \"%s\" failed", size, path.data);
+        return NGX_DECLINED;
+    }
+
+    m = cln->data;
+    m->addr = p;
+    m->size = size;
+    m->log = log;
+
+    cln->handler = ngx_http_eflv_munmap;
+
+    h = (ngx_http_eflv_index_file_t *) p;
+
+    if (ngx_memcmp(h->magic, NGX_HTTP_EFLV_INDEX_FILE_MAGIC, 4) != 0
+        || h->version != NGX_HTTP_EFLV_INDEX_FILE_VERSION)
+    {
+        ngx_log_error(NGX_LOG_WARN, log, 0,
+                      "\"%s\" is not a valid index file", path.data);
+        return NGX_DECLINED;
+    }
+
+    if (h->size != (uint64_t) ctx->of.size
+        || h->mtime != (int64_t) ctx->of.mtime)
+    {
+        ngx_log_error(NGX_LOG_INFO, log, 0,
+                      "index file \"%s\" is stale", path.data);
+        return NGX_DECLINED;
+    }
+
+    if (h->keyframes > (size - sizeof(ngx_http_eflv_index_file_t))
+                       / (sizeof(double) + sizeof(int64_t))
+        || h->metadata_len > size || h->video_len > size
+        || h->audio_len > size
+        || sizeof(ngx_http_eflv_index_file_t)
+           + h->keyframes * (sizeof(double) + sizeof(int64_t))
+           + h->metadata_len + h->video_len + h->audio_len > size
+        || (h->duration_offset
+            && h->duration_offset + 8 > h->metadata_len)
+        || h->video_pos > h->size || h->video_len > h->size - h->video_pos
+        || h->audio_pos > h->size || h->audio_len > h->size - h->audio_pos)
+    {
+        ngx_log_error(NGX_LOG_WARN, log, 0,
+                      "index file \"%s\" is truncated", path.data);
+        return NGX_DECLINED;
+    }
+
+    index = &ctx->index;
+
+    ngx_memzero(index, sizeof(ngx_http_eflv_index_t));
+
+    p += sizeof(ngx_http_eflv_index_file_t);
+
+    index->duration = h->duration;
+    index->keyframes = (ngx_uint_t) h->keyframes;
+    index->times = (double *) p;
+    p += index->keyframes * sizeof(double);
+
+    index->filepositions = (off_t *) p;
+    p += index->keyframes * sizeof(off_t);
+
+    index->duration_offset = (size_t) h->duration_offset;
+
+    index->metadata.len = (size_t) h->metadata_len;
+    index->metadata.data = p;
+    p += index->metadata.len;
+
+    index->video.len = (size_t) h->video_len;
+    index->video.data = p;
+    p += index->video.len;
+
+    index->audio.len = (size_t) h->audio_len;
+    index->audio.data = p;
+
+    index->video_pos = (off_t) h->video_pos;
+    index->audio_pos = (off_t) h->audio_pos;
+
+    ngx_log_debug2(NGX_LOG_DEBUG_HTTP, log, 0,
+                   "eflv index file: \"%s\", %ui keyframes",
+                   path.data, index->keyframes);
+
+    return NGX_OK;
+}
+
+
+static ngx_int_t
+ngx_http_eflv_cache_lock(ngx_http_request_t *r, ngx_http_eflv_ctx_t *ctx)
+{
+    ngx_pool_cleanup_t          *cln;
+    ngx_http_eflv_cache_lock_t  *lock;
+    ngx_http_eflv_loc_conf_t    *elcf;
+
+    elcf = ngx_http_get_module_loc_conf(r, ngx_http_eflv_module);
+
+    /* the cleanup survives internal redirects, unlike the context */
+
+    cln = ngx_pool_cleanup_add(r->pool, sizeof(ngx_http_eflv_cache_lock_t));
+    if (cln == NULL) {
+        return NGX_ERROR;
+    }
+
+    lock = cln->data;
+    ngx_memzero(lock, sizeof(ngx_http_eflv_cache_lock_t));
+
+    lock->cache = elcf->cache_zone->data;
+    lock->path = ctx->path;
+    lock->start = ngx_current_msec;
+
+    lock->wait.handler = ngx_http_eflv_cache_lock_wait_handler;
+    lock->wait.data = r;
+    lock->wait.log = r->connection->log;
+
+    cln->handler = ngx_http_eflv_cache_lock_cleanup;
+
+    ctx->lock = lock;
+
+    return NGX_OK;
+}
+
+
+/*
+ * called while another request builds the index: returns NGX_AGAIN
+ * with a timer set to look it up again, or NGX_DECLINED to build the
+ * index without the lock once the timeout passes
+ */
+
+static ngx_int_t
+ngx_http_eflv_cache_lock_wait(ngx_http_request_t *r, ngx_http_eflv_ctx_t *ctx)
+{
+    ngx_msec_t                   timer;
+    ngx_msec_int_t               wait;
+    ngx_http_eflv_loc_conf_t    *elcf;
+    ngx_http_eflv_cache_lock_t  *lock;
+
+    elcf = ngx_http_get_module_loc_conf(r, ngx_http_eflv_module);
+    lock = ctx->lock;
+
+    wait = (ngx_msec_int_t) (lock->start + elcf->cache_lock_timeout
+                             - ngx_current_msec);
+
+    if (wait <= 0) {
+        ngx_log_error(NGX_LOG_INFO, r->connection->log, 0,
+                      "eflv index cache lock timeout for \"%V\"",
+                      &ctx->path);
+
+        ngx_http_eflv_stat(cache_lock_timeouts, 1);
+
+        return NGX_DECLINED;
+    }
+
+    if (!lock->waited) {
+        lock->waited = 1;
+        ngx_http_eflv_stat(cache_lock_waits, 1);
+    }
+
+    timer = ngx_min((ngx_msec_t) wait, NGX_HTTP_EFLV_LOCK_WAIT);
+
+    ngx_log_debug2(NGX_LOG_DEBUG_HTTP, r->connection->log, 0,
+                   "eflv index cache lock wait: \"%V\" %M",
+                   &ctx->path, timer);
+
+    ngx_add_timer(&lock->wait, timer);
+
+    r->main->blocked++;
+
+    return NGX_AGAIN;
+}
+
+
+static void
+ngx_http_eflv_cache_lock_wait_handler(ngx_event_t *ev)
+{
+    ngx_connection_t    *c;
+    ngx_http_request_t  *r;
+
+    r = ev->data;
+    c = r->connection;
+
+    ngx_http_set_log_request(c->log, r);
+
+    ngx_log_debug2(NGX_LOG_DEBUG_HTTP, c->log, 0,
+                   "eflv index cache lock: \"%V?%V\"", &r->uri, &r->args);
+
+    r->main->blocked--;
+
+    ngx_http_finalize_request(r, ngx_http_eflv_process(r));
+
+    ngx_http_run_posted_requests(c);
+}
+
+
+static ngx_int_t
+ngx_http_eflv_get_index(ngx_http_request_t *r, ngx_http_eflv_ctx_t *ctx)
+{
+    ngx_int_t                  rc;
+    ngx_http_eflv_loc_conf_t  *elcf;
+
+    elcf = ngx_http_get_module_loc_conf(r, ngx_http_eflv_module);
+
+    if (ctx->scan == NULL) {
+
+        if (elcf->cache_zone && ctx->buf == NULL) {
+
+            if (elcf->cache_lock && ctx->lock == NULL
+                && ngx_http_eflv_cache_lock(r, ctx) != NGX_OK)
+            {
+                return NGX_ERROR;
+            }
+
+            rc = ngx_http_eflv_cache_lookup(r, elcf->cache_zone, &ctx->path,
+                                            &ctx->of, &ctx->index, ctx->lock,
+                                            elcf->cache_lock_timeout);
+
+            if (rc == NGX_BUSY) {
+                rc = ngx_http_eflv_cache_lock_wait(r, ctx);
+            }
+
+            if (rc == NGX_OK) {
+                ctx->index_source = NGX_HTTP_EFLV_INDEX_CACHE;
+                ngx_http_eflv_stat(cache_hits, 1);
+            }
+
+            if (rc != NGX_DECLINED) {
+                return rc;
+            }
+
+            ngx_http_eflv_stat(cache_misses, 1);
+        }
+
+        rc = NGX_DECLINED;
+
+        if (elcf->index_file && ctx->buf == NULL) {
+            rc = ngx_http_eflv_read_index_file(r, ctx);
+
+            if (rc == NGX_OK) {
+                ctx->index_source = NGX_HTTP_EFLV_INDEX_FILE;
+                ngx_http_eflv_stat(index_files, 1);
+            }
+        }
+
+        if (rc == NGX_DECLINED) {
+            rc = ntx_http_eflv_metadata(r, ctx);
+
+            if (rc == NGX_OK) {
+                ctx->index_source = NGX_HTTP_EFLV_INDEX_PARSED;
+            }
+        }
+
+        if (rc != NGX_OK) {
+            goto failed;
+        }
+    }
+
+#if (NGX_THREADS)
+
+    /* eflv-index has already walked the tags of a file without keyframes */
+
+    if (ctx->index.keyframes == 0 && ctx->first && elcf->index_generate
+        && ctx->index_source != NGX_HTTP_EFLV_INDEX_FILE)
+    {
+        rc = ngx_http_eflv_generate_index(r, ctx);
+
+        if (rc == NGX_DECLINED) {
+
+            /*
+             * the file is sent whole; the index is not cached, so that
+             * locations with a thread pool still generate it
+             */
+
+            if (ctx->lock) {
+                ngx_http_eflv_cache_unlock(ctx->lock);
+            }
+
+            return NGX_OK;
+        }
+
+        if (rc != NGX_OK) {
+            goto failed;
+        }
+
+        ctx->index_source = NGX_HTTP_EFLV_INDEX_GENERATED;
+        ngx_http_eflv_stat(index_generated, 1);
+    }
+
+#endif
+
+    /* a sidecar index is inserted too, it replaces the lock of the file */
+
+    if (elcf->cache_zone) {
+        ngx_http_eflv_cache_insert(r, elcf->cache_zone, &ctx->path, &ctx->of,
+                                   &ctx->index);
+
+        if (ctx->lock) {
+            /* the insertion has removed the lock */
+            ctx->lock->id = 0;
+        }
+    }
+
+    return NGX_OK;
+
+failed:
+
+    if (rc != NGX_AGAIN && ctx->lock) {
+        /* the waiting requests build the index themselves */
+        ngx_http_eflv_cache_unlock(ctx->lock);
+    }
+
+    return rc;
+}
+
+
+static ngx_int_t
+ngx_http_eflv_process(ngx_http_request_t *r)
+{
+    ngx_int_t             rc;
+    ngx_http_eflv_ctx_t  *ctx;
+
+    ctx = ngx_http_get_module_ctx(r, ngx_http_eflv_module);
+
+    if (ctx->need_index) {
+
+        if (ctx->index_start == 0) {
+            ctx->index_start = ngx_http_eflv_usec();
+        }
+
+        rc = ngx_http_eflv_get_index(r, ctx);
+
+        if (rc == NGX_AGAIN) {
+            r->main->count++;
+            return NGX_DONE;
+        }
+
+        if (rc != NGX_OK) {
+            return NGX_HTTP_INTERNAL_SERVER_ERROR;
+        }
+
+        ctx->need_index = 0;
+
+        ctx->index_usec = ngx_http_eflv_usec() - ctx->index_start;
+        ngx_http_eflv_stat_time(index_time, ctx->index_usec);
+    }
+
+    return ctx->send(r, ctx);
+}
+
+
+static ngx_int_t
+ngx_http_eflv_open_file(ngx_http_request_t *r, ngx_http_eflv_ctx_t *ctx)
+{
+    u_char                    *last;
+    size_t                     root;
+    ngx_int_t                  rc;
+    ngx_uint_t                 level;
+    ngx_str_t                  path;
+    ngx_log_t                 *log;
+    ngx_open_file_info_t      *of;
+    ngx_http_core_loc_conf_t  *clcf;
+
+    last = ngx_http_map_uri_to_path(r, &path, &root, 0);
+    if (last == NULL) {
+        return NGX_HTTP_INTERNAL_SERVER_ERROR;
+    }
+
+    log = r->connection->log;
+
+    path.len = last - path.data;
+
+    ngx_log_debug1(NGX_LOG_DEBUG_HTTP, log, 0,
+                   "http flv filename: \"%V\"", &path);
+
+    clcf = ngx_http_get_module_loc_conf(r, ngx_http_core_module);
+
+    of = &ctx->of;
+
+    ngx_memzero(of, sizeof(ngx_open_file_info_t));
+
+    of->read_ahead = clcf->read_ahead;
+    of->directio = clcf->directio;
+    of->valid = clcf->open_file_cache_valid;
+    of->min_uses = clcf->open_file_cache_min_uses;
+    of->errors = clcf->open_file_cache_errors;
+    of->events = clcf->open_file_cache_events;
+
+    if (ngx_open_cached_file(clcf->open_file_cache, &path, of, r->pool)
+        != NGX_OK)
+    {
+        switch (of->err) {
+
+        case 0:
+            return NGX_HTTP_INTERNAL_SERVER_ERROR;
+
+        case NGX_ENOENT:
+        case NGX_ENOTDIR:
+        case NGX_ENAMETOOLONG:
+
+            level = NGX_LOG_ERR;
+            rc = NGX_HTTP_NOT_FOUND;
+            break;
+
+        case NGX_EACCES:
+
+            level = NGX_LOG_ERR;
+            rc = NGX_HTTP_FORBIDDEN;
+            break;
+
+        default:
+
+            level = NGX_LOG_CRIT;
+            rc = NGX_HTTP_INTERNAL_SERVER_ERROR;
+            break;
+        }
+
+        if (rc != NGX_HTTP_NOT_FOUND || clcf->log_not_found) {
+            ngx_log_error(level, log, of->err,
+                          "%s \"%s\" failed", of->failed, path.data);
+        }
+
+        return rc;
+    }
+
+    if (!of->is_file) {
+
+        if (ngx_close_file(of->fd) == NGX_FILE_ERROR) {
+            ngx_log_error(NGX_LOG_ALERT, log, ngx_errno,
+                          ngx_close_file_n " \"%s\" failed", path.data);
+        }
+
+        return NGX_DECLINED;
+    }
+
+    r->root_tested = !r->error_page;
+
+    ctx->path = path;
+
+    ctx->file.fd = of->fd;
+    ctx->file.name = path;
+    ctx->file.log = log;
+    ctx->file.directio = of->is_directio;
+
+    return NGX_OK;
+}
+
+
+static ngx_table_elt_t *
+ngx_http_eflv_push_header(ngx_http_request_t *r, char *key, size_t len)
+{
+    ngx_table_elt_t  *h;
+
+    h = ngx_list_push(&r->headers_out.headers);
+    if (h == NULL) {
+        return NULL;
+    }
+
+    ngx_memzero(h, sizeof(ngx_table_elt_t));
+
+    h->hash = 1;
+    h->key.len = len;
+    h->key.data = (u_char *) key;
+
+    return h;
+}
+
+
+/*
+ * the response is a virtual file: the FLV header and the tags held in
+ * memory followed by a slice of the file, so the entity tag is derived
+ * from the identity of the file and from the slice and the length
+ */
+
+static ngx_int_t
+ngx_http_eflv_set_etag(ngx_http_request_t *r, ngx_http_eflv_ctx_t *ctx,
+    off_t start, off_t end)
+{
+    ngx_table_elt_t           *etag;
+    ngx_http_core_loc_conf_t  *clcf;
+
+    clcf = ngx_http_get_module_loc_conf(r, ngx_http_core_module);
+
+    if (!clcf->etag) {
+        return NGX_OK;
+    }
+
+    etag = ngx_http_eflv_push_header(r, "ETag", sizeof("ETag") - 1);
+    if (etag == NULL) {
+        return NGX_ERROR;
+    }
+
+    etag->value.data = ngx_pnalloc(r->pool, NGX_TIME_T_LEN + 4 * NGX_OFF_T_LEN
+                                            + 6);
+    if (etag->value.data == NULL) {
+        return NGX_ERROR;
+    }
+
+    etag->value.len = ngx_sprintf(etag->value.data, "\"%xT-%xO-%xO-%xO-%xO\"",
+                                  ctx->of.mtime, ctx->of.size, start, end,
+                                  r->headers_out.content_length_n)
+                      - etag->value.data;
+
+    r->headers_out.etag = etag;
+
+    return NGX_OK;
+}
+
+
+static ngx_uint_t
+ngx_http_eflv_if_range(ngx_http_request_t *r)
+{
+    time_t      if_range_time;
+    ngx_str_t  *if_range, *etag;
+
+    if_range = &r->headers_in.if_range->value;
+
+    if (if_range->len >= 2 && if_range->data[if_range->len - 1] == '"') {
+
+        if (r->headers_out.etag == NULL) {
+            return 0;
+        }
+
+        etag = &r->headers_out.etag->value;
+
+        return (if_range->len == etag->len
+                && ngx_strncmp(if_range->data, etag->data, etag->len) == 0);
+    }
+
+    if (r->headers_out.last_modified_time == (time_t) -1) {
+        return 0;
+    }
+
+    if_range_time = ngx_parse_http_time(if_range->data, if_range->len);
+
+    return (if_range_time == r->headers_out.last_modified_time);
+}
+
+
+static ngx_int_t
+ngx_http_eflv_parse_range(ngx_http_request_t *r, off_t length,
+    ngx_array_t *ranges)
+{
+    u_char                    *p;
+    off_t                      start, end, size, cutoff, cutlim;
+    ngx_uint_t                 suffix;
+    ngx_http_eflv_range_t     *range;
+    ngx_http_core_loc_conf_t  *clcf;
+
+    p = r->headers_in.range->value.data;
+
+    if (r->headers_in.range->value.len < 7
+        || ngx_strncasecmp(p, (u_char *) "bytes=", 6) != 0)
+    {
+        return NGX_DECLINED;
+    }
+
+    p += 6;
+
+    clcf = ngx_http_get_module_loc_conf(r, ngx_http_core_module);
+
+    size = 0;
+    cutoff = NGX_MAX_OFF_T_VALUE / 10;
+    cutlim = NGX_MAX_OFF_T_VALUE % 10;
+
+    for ( ;; ) {
+        start = 0;
+        end = 0;
+        suffix = 0;
+
+        while (*p == ' ') { p++; }
+
+        if (*p != '-') {
+            if (*p < '0' || *p > '9') {
+                return NGX_HTTP_RANGE_NOT_SATISFIABLE;
+            }
+
+            while (*p >= '0' && *p <= '9') {
+                if (start >= cutoff && (start > cutoff || *p - '0' > cutlim)) {
+                    return NGX_HTTP_RANGE_NOT_SATISFIABLE;
+                }
+
+                start = start * 10 + (*p++ - '0');
+            }
+
+            while (*p == ' ') { p++; }
+
+            if (*p++ != '-') {
+                return NGX_HTTP_RANGE_NOT_SATISFIABLE;
+            }
+
+            while (*p == ' ') { p++; }
+
+            if (*p == ',' || *p == '\0') {
+                end = length;
+                goto found;
+            }
+
+        } else {
+            suffix = 1;
+            p++;
+        }
+
+        if (*p < '0' || *p > '9') {
+            return NGX_HTTP_RANGE_NOT_SATISFIABLE;
+        }
+
+        while (*p >= '0' && *p <= '9') {
+            if (end >= cutoff && (end > cutoff || *p - '0' > cutlim)) {
+                return NGX_HTTP_RANGE_NOT_SATISFIABLE;
+            }
+
+            end = end * 10 + (*p++ - '0');
+        }
+
+        while (*p == ' ') { p++; }
+
+        if (*p != ',' && *p != '\0') {
+            return NGX_HTTP_RANGE_NOT_SATISFIABLE;
+        }
+
+        if (suffix) {
+            start = (end < length) ? length - end : 0;
+            end = length;
+
+        } else {
+            if (start > end) {
+                return NGX_HTTP_RANGE_NOT_SATISFIABLE;
+            }
+
+            end = (end < length) ? end + 1 : length;
+        }
+
+    found:
+
+        if (start < end) {
+            range = ngx_array_push(ranges);
+            if (range == NULL) {
+                return NGX_ERROR;
+            }
+
+            range->start = start;
+            range->end = end;
+
+            size += end - start;
+
+            if (ranges->nelts > clcf->max_ranges) {
+                return NGX_DECLINED;
+            }
+        }
+
+        if (*p++ != ',') {
+            break;
+        }
+    }
+
+    if (ranges->nelts == 0) {
+        return NGX_HTTP_RANGE_NOT_SATISFIABLE;
+    }
+
+    if (size > length) {
+        return NGX_DECLINED;
+    }
+
+    return NGX_OK;
+}
+
+
+/* maps a byte range of the response onto its memory and file buffers */
+
+static ngx_chain_t **
+ngx_http_eflv_range_chain(ngx_http_request_t *r, ngx_chain_t *in,
+    off_t start, off_t end, ngx_chain_t **ll)
+{
+    off_t         pos, size, from, to;
+    ngx_buf_t    *b, *buf;
+    ngx_chain_t  *cl;
+
+    pos = 0;
+
+    for ( /* void */ ; in; in = in->next) {
+        buf = in->buf;
+        size = ngx_buf_size(buf);
+
+        if (pos + size <= start || pos >= end) {
+            pos += size;
+            continue;
+        }
+
+        from = ngx_max(start, pos) - pos;
+        to = ngx_min(end, pos + size) - pos;
+
+        b = ngx_calloc_buf(r->pool);
+        if (b == NULL) {
+            return NULL;
+        }
+
+        if (buf->in_file) {
+            b->in_file = 1;
+            b->file = buf->file;
+            b->file_pos = buf->file_pos + from;
+            b->file_last = buf->file_pos + to;
+
+        } else {
+            b->memory = 1;
+            b->pos = buf->pos + from;
+            b->last = buf->pos + to;
+        }
+
+        cl = ngx_alloc_chain_link(r->pool);
+        if (cl == NULL) {
+            return NULL;
+        }
+
+        cl->buf = b;
+        *ll = cl;
+        ll = &cl->next;
+
+        pos += size;
+    }
+
+    *ll = NULL;
+
+    return ll;
+}
+
+
+static ngx_chain_t **
+ngx_http_eflv_range_memory(ngx_http_request_t *r, u_char *p, size_t len,
+    ngx_chain_t **ll)
+{
+    ngx_buf_t    *b;
+    ngx_chain_t  *cl;
+
+    b = ngx_calloc_buf(r->pool);
+    if (b == NULL) {
+        return NULL;
+    }
+
+    b->memory = 1;
+    b->pos = p;
+    b->last = p + len;
+
+    cl = ngx_alloc_chain_link(r->pool);
+    if (cl == NULL) {
+        return NULL;
+    }
+
+    cl->buf = b;
+    cl->next = NULL;
+    *ll = cl;
+
+    return &cl->next;
+}
+
+
+static void
+ngx_http_eflv_follow_cleanup(void *data)
+{
+    ngx_http_eflv_follow_t  *fl = data;
+
+    if (fl->timer.timer_set) {
+        ngx_del_timer(&fl->timer);
+    }
+}
+
+
+/*
+ * a response which ends at the end of a file modified within
+ * "eflv_follow_timeout" keeps sending the data appended to the file
+ * while it is being recorded
+ */
+
+static ngx_int_t
+ngx_http_eflv_follow_init(ngx_http_request_t *r, ngx_http_eflv_ctx_t *ctx,
+    off_t end)
+{
+    ngx_pool_cleanup_t        *cln;
+    ngx_http_eflv_follow_t    *fl;
+    ngx_http_eflv_loc_conf_t  *elcf;
+
+    elcf = ngx_http_get_module_loc_conf(r, ngx_http_eflv_module);
+
+    if (!elcf->follow
+        || r != r->main
+        || r->headers_in.range
+        || end != ctx->of.size
+        || ngx_time() - ctx->of.mtime > (time_t) (elcf->follow_timeout / 1000))
+    {
+        return NGX_OK;
+    }
+
+    cln = ngx_pool_cleanup_add(r->pool, sizeof(ngx_http_eflv_follow_t));
+    if (cln == NULL) {
+        return NGX_ERROR;
+    }
+
+    fl = cln->data;
+    ngx_memzero(fl, sizeof(ngx_http_eflv_follow_t));
+
+    fl->pos = end;
+    fl->updated = ngx_current_msec;
+
+    fl->timer.handler = ngx_http_eflv_follow_handler;
+    fl->timer.data = r;
+    fl->timer.log = r->connection->log;
+
+    cln->handler = ngx_http_eflv_follow_cleanup;
+
+    ctx->follow = fl;
+
+    ngx_log_debug2(NGX_LOG_DEBUG_HTTP, r->connection->log, 0,
+                   "eflv follow: \"%V\" from %O", &ctx->path, end);
+
+    return NGX_OK;
+}
+
+
+/* the length is unknown, so the response is chunked and has no validators */
+
+static ngx_int_t
+ngx_http_eflv_follow_response(ngx_http_request_t *r, ngx_http_eflv_ctx_t *ctx,
+    ngx_chain_t *in)
+{
+    ngx_int_t     rc;
+    ngx_chain_t  *cl;
+
+    r->headers_out.content_length_n = -1;
+    ngx_http_clear_last_modified(r);
+
+    rc = ngx_http_send_header(r);
+    if (rc == NGX_ERROR || rc > NGX_OK || r->header_only) {
+        return rc;
+    }
+
+    for (cl = in; cl->next; cl = cl->next) { /* void */ }
+
+    cl->buf->last_buf = 0;
+    cl->buf->last_in_chain = 0;
+    cl->buf->flush = 1;
+
+    ngx_http_eflv_stat_chain(in);
+
+    rc = ngx_http_output_filter(r, in);
+    if (rc == NGX_ERROR) {
+        return rc;
+    }
+
+    ctx->send = ngx_http_eflv_follow_send;
+    r->write_event_handler = ngx_http_eflv_write_handler;
+
+    return ngx_http_eflv_follow_send(r, ctx);
+}
+
+
+/*
+ * flushes the response and checks whether the file has grown past "end":
+ * returns NGX_OK with "end" moved to the new size, NGX_DONE while the
+ * request is parked until the client or the file is ready, and
+ * NGX_DECLINED once the file has stopped growing
+ */
+
+static ngx_int_t
+ngx_http_eflv_follow_wait(ngx_http_request_t *r, ngx_http_eflv_ctx_t *ctx,
+    off_t *end)
+{
+    off_t                      size;
+    ngx_int_t                  rc;
+    ngx_event_t               *wev;
+    ngx_file_info_t            fi;
+    ngx_http_eflv_follow_t    *fl;
+    ngx_http_core_loc_conf_t  *clcf;
+    ngx_http_eflv_loc_conf_t  *elcf;
+
+    fl = ctx->follow;
+    wev = r->connection->write;
+
+    rc = ngx_http_output_filter(r, NULL);
+
+    if (rc == NGX_ERROR) {
+        return NGX_ERROR;
+    }
+
+    if (rc == NGX_AGAIN) {
+        clcf = ngx_http_get_module_loc_conf(r, ngx_http_core_module);
+
+        if (!wev->delayed) {
+            ngx_add_timer(wev, clcf->send_timeout);
+        }
+
+        if (ngx_handle_write_event(wev, clcf->send_lowat) != NGX_OK) {
+            return NGX_ERROR;
+        }
+
+        r->main->count++;
+        return NGX_DONE;
+    }
+
+    /* the client is not expected to read while the file is not growing */
+
+    if (wev->timer_set) {
+        wev->delayed = 0;
+        ngx_del_timer(wev);
+    }
+
+    if (ngx_exiting) {
+        return NGX_DECLINED;
+    }
+
+    if (ngx_fd_info(ctx->of.fd, &fi) == NGX_FILE_ERROR) {
+        ngx_log_error(NGX_LOG_CRIT, r->connection->log, ngx_errno,
+                      ngx_fd_info_n " \"%V\" failed", &ctx->path);
+        return NGX_ERROR;
+    }
+
+    size = ngx_file_size(&fi);
+
+    if (size > *end) {
+        fl->updated = ngx_current_msec;
+        *end = size;
+        return NGX_OK;
+    }
+
+    elcf = ngx_http_get_module_loc_conf(r, ngx_http_eflv_module);
+
+    if (size < *end || ngx_current_msec - fl->updated >= elcf->follow_timeout) {
+        ngx_log_debug2(NGX_LOG_DEBUG_HTTP, r->connection->log, 0,
+                       "eflv follow done: \"%V\" at %O", &ctx->path, size);
+        return NGX_DECLINED;
+    }
+
+    ngx_add_timer(&fl->timer, elcf->follow_interval);
+
+    r->main->count++;
+    return NGX_DONE;
+}
+
+
+/* sends the data appended to the file through sendfile as it arrives */
+
+static ngx_int_t
+ngx_http_eflv_follow_send(ngx_http_request_t *r, ngx_http_eflv_ctx_t *ctx)
+{
+    off_t                    end;
+    ngx_int_t                rc;
+    ngx_buf_t               *b;
+    ngx_chain_t             *cl;
+    ngx_http_eflv_follow_t  *fl;
+
+    fl = ctx->follow;
+
+    for ( ;; ) {
+        end = fl->pos;
+
+        rc = ngx_http_eflv_follow_wait(r, ctx, &end);
+
+        if (rc == NGX_DECLINED) {
+            return ngx_http_send_special(r, NGX_HTTP_LAST);
+        }
+
+        if (rc != NGX_OK) {
+            return rc;
+        }
+
+        cl = ngx_chain_get_free_buf(r->pool, &fl->free);
+        if (cl == NULL) {
+            return NGX_ERROR;
+        }
+
+        b = cl->buf;
+        ngx_memzero(b, sizeof(ngx_buf_t));
+
+        b->tag = (ngx_buf_tag_t) &ngx_http_eflv_module;
+        b->in_file = 1;
+        b->flush = 1;
+        b->file = &ctx->file;
+        b->file_pos = fl->pos;
+        b->file_last = end;
+
+        ngx_http_eflv_stat(file_bytes, end - fl->pos);
+
+        fl->pos = end;
+
+        rc = ngx_http_output_filter(r, cl);
+
+        ngx_chain_update_chains(r->pool, &fl->free, &fl->busy, &cl,
+                                (ngx_buf_tag_t) &ngx_http_eflv_module);
+
+        if (rc == NGX_ERROR) {
+            return rc;
+        }
+    }
+}
+
+
+static void
+ngx_http_eflv_follow_handler(ngx_event_t *ev)
+{
+    ngx_connection_t    *c;
+    ngx_http_request_t  *r;
+
+    r = ev->data;
+    c = r->connection;
+
+    ngx_http_set_log_request(c->log, r);
+
+    ngx_log_debug2(NGX_LOG_DEBUG_HTTP, c->log, 0,
+                   "eflv follow: \"%V?%V\"", &r->uri, &r->args);
+
+    ngx_http_finalize_request(r, ngx_http_eflv_process(r));
+
+    ngx_http_run_posted_requests(c);
+}
+
+
+/*
+ * sends the response chain, or the byte ranges of it requested with
+ * "Range" and "If-Range"; the standard range filter is not used as it
+ * supports multipart ranges of single buffer responses only
+ */
+
+static ngx_int_t
+ngx_http_eflv_send_response(ngx_http_request_t *r, ngx_http_eflv_ctx_t *ctx,
+    ngx_chain_t *in, off_t start, off_t end)
+{
+    u_char                 *p;
+    off_t                   length, len;
+    size_t                  size, hlen;
+    ngx_int_t               rc;
+    ngx_uint_t              i;
+    ngx_chain_t            *cl, *out, **ll;
+    ngx_array_t             ranges;
+    ngx_table_elt_t        *h;
+    ngx_atomic_uint_t       boundary;
+    ngx_http_eflv_range_t  *range;
+
+    length = 0;
+
+    for (cl = in; cl; cl = cl->next) {
+        length += ngx_buf_size(cl->buf);
+    }
+
+    if (ctx->follow) {
+        return ngx_http_eflv_follow_response(r, ctx, in);
+    }
+
+    r->headers_out.content_length_n = length;
+
+    if (ngx_http_eflv_set_etag(r, ctx, start, end) != NGX_OK) {
+        return NGX_HTTP_INTERNAL_SERVER_ERROR;
+    }
+
+    if (r != r->main) {
+        goto full;
+    }
+
+    h = ngx_http_eflv_push_header(r, "Accept-Ranges",
+                                  sizeof("Accept-Ranges") - 1);
+    if (h == NULL) {
+        return NGX_HTTP_INTERNAL_SERVER_ERROR;
+    }
+
+    ngx_str_set(&h->value, "bytes");
+    r->headers_out.accept_ranges = h;
+
+    if (r->headers_in.range == NULL
+        || (r->headers_in.if_range && !ngx_http_eflv_if_range(r)))
+    {
+        goto full;
+    }
+
+    if (ngx_array_init(&ranges, r->pool, 1, sizeof(ngx_http_eflv_range_t))
+        != NGX_OK)
+    {
+        return NGX_HTTP_INTERNAL_SERVER_ERROR;
+    }
+
+    rc = ngx_http_eflv_parse_range(r, length, &ranges);
+
+    if (rc == NGX_DECLINED) {
+        goto full;
+    }
+
+    if (rc == NGX_ERROR) {
+        return NGX_HTTP_INTERNAL_SERVER_ERROR;
+    }
+
+    h = ngx_http_eflv_push_header(r, "Content-Range",
+                                  sizeof("Content-Range") - 1);
+    if (h == NULL) {
+        return NGX_HTTP_INTERNAL_SERVER_ERROR;
+    }
+
+    r->headers_out.content_range = h;
+
+    h->value.data = ngx_pnalloc(r->pool, sizeof("bytes -/") - 1
+                                         + 3 * NGX_OFF_T_LEN);
+    if (h->value.data == NULL) {
+        return NGX_HTTP_INTERNAL_SERVER_ERROR;
+    }
+
+    if (rc == NGX_HTTP_RANGE_NOT_SATISFIABLE) {
+        h->value.len = ngx_sprintf(h->value.data, "bytes */%O", length)
+                       - h->value.data;
+
+        r->headers_out.status = NGX_HTTP_RANGE_NOT_SATISFIABLE;
+        r->headers_out.content_length_n = 0;
+
+        rc = ngx_http_send_header(r);
+        if (rc == NGX_ERROR || rc > NGX_OK || r->header_only) {
+            return rc;
+        }
+
+        return ngx_http_send_special(r, NGX_HTTP_LAST);
+    }
+
+    r->headers_out.status = NGX_HTTP_PARTIAL_CONTENT;
+
+    range = ranges.elts;
+    out = NULL;
+    ll = &out;
+
+    if (ranges.nelts == 1) {
+        h->value.len = ngx_sprintf(h->value.data, "bytes %O-%O/%O",
+                                   range->start, range->end - 1, length)
+                       - h->value.data;
+
+        r->headers_out.content_length_n = range->end - range->start;
+
+        ll = ngx_http_eflv_range_chain(r, in, range->start, range->end, ll);
+        if (ll == NULL) {
+            return NGX_HTTP_INTERNAL_SERVER_ERROR;
+        }
+
+        goto send;
+    }
+
+    /* multipart/byteranges */
+
+    r->headers_out.content_range = NULL;
+    h->hash = 0;
+
+    boundary = ngx_next_temp_number(0);
+
+    hlen = sizeof(CRLF "--") - 1 + NGX_ATOMIC_T_LEN
+           + sizeof(CRLF "Content-Type: ") - 1
+           + r->headers_out.content_type.len
+           + sizeof(CRLF "Content-Range: bytes -/" CRLF CRLF) - 1
+           + 3 * NGX_OFF_T_LEN;
+
+    len = 0;
+
+    for (i = 0; i < ranges.nelts; i++) {
+        p = ngx_pnalloc(r->pool, hlen);
+        if (p == NULL) {
+            return NGX_HTTP_INTERNAL_SERVER_ERROR;
+        }
+
+        len += range[i].end - range[i].start;
+        size = ngx_sprintf(p, CRLF "--%0muA" CRLF "Content-Type: %V" CRLF
+                           "Content-Range: bytes %O-%O/%O" CRLF CRLF,
+                           boundary, &r->headers_out.content_type,
+                           range[i].start, range[i].end - 1, length)
+               - p;
+        len += size;
+
+        ll = ngx_http_eflv_range_memory(r, p, size, ll);
+        if (ll == NULL) {
+            return NGX_HTTP_INTERNAL_SERVER_ERROR;
+        }
+
+        ll = ngx_http_eflv_range_chain(r, in, range[i].start, range[i].end,
+                                       ll);
+        if (ll == NULL) {
+            return NGX_HTTP_INTERNAL_SERVER_ERROR;
+        }
+    }
+
+    p = ngx_pnalloc(r->pool, sizeof(CRLF "--" "--" CRLF) - 1
+                             + NGX_ATOMIC_T_LEN);
+    if (p == NULL) {
+        return NGX_HTTP_INTERNAL_SERVER_ERROR;
+    }
+
+    size = ngx_sprintf(p, CRLF "--%0muA--" CRLF, boundary) - p;
+    len += size;
+
+    ll = ngx_http_eflv_range_memory(r, p, size, ll);
+    if (ll == NULL) {
+        return NGX_HTTP_INTERNAL_SERVER_ERROR;
+    }
+
+    r->headers_out.content_type.data = ngx_pnalloc(r->pool,
+                                   sizeof("multipart/byteranges; boundary=") - 1
+                                   + NGX_ATOMIC_T_LEN);
+    if (r->headers_out.content_type.data == NULL) {
+        return NGX_HTTP_INTERNAL_SERVER_ERROR;
+    }
+
+    r->headers_out.content_type.len =
+                           ngx_sprintf(r->headers_out.content_type.data,
+                                       "multipart/byteranges; boundary=%0muA",
+                                       boundary)
+                           - r->headers_out.content_type.data;
+
+    r->headers_out.content_type_len = r->headers_out.content_type.len;
+    r->headers_out.charset.len = 0;
+
+    r->headers_out.content_length_n = len;
+
+send:
+
+    for (cl = out; cl->next; cl = cl->next) { /* void */ }
+
+    cl->buf->last_buf = 1;
+    cl->buf->last_in_chain = 1;
+
+    in = out;
+
+full:
+
+    rc = ngx_http_send_header(r);
+    if (rc == NGX_ERROR || rc > NGX_OK || r->header_only) {
+        return rc;
+    }
+
+    ngx_http_eflv_stat_chain(in);
+
+    return ngx_http_output_filter(r, in);
+}
+
+
+/*
+ * a sequence header tag is sent from the file when its offset is known,
+ * so that the response goes through sendfile as a whole, and from the
+ * copy held in the index otherwise
+ */
+
+static ngx_buf_t *
+ngx_http_eflv_tag_buf(ngx_http_request_t *r, ngx_http_eflv_ctx_t *ctx,
+    ngx_str_t *tag, off_t pos)
+{
+    ngx_buf_t  *b;
+
+    b = ngx_calloc_buf(r->pool);
+    if (b == NULL) {
+        return NULL;
+    }
+
+    if (pos > 0 && pos + (off_t) tag->len <= ctx->of.size) {
+        b->in_file = 1;
+        b->file = &ctx->file;
+        b->file_pos = pos;
+        b->file_last = pos + tag->len;
+
+    } else {
+        b->memory = 1;
+        b->pos = tag->data;
+        b->last = tag->data + tag->len;
+    }
+
+    return b;
+}
+
+
+/*
+ * paces the response at a multiple of the average bitrate of the data
+ * sent from the file, after the bytes sent before the data and the first
+ * "eflv_limit_rate_after" seconds of the data itself
+ */
+
+static void
+ngx_http_eflv_pace(ngx_http_request_t *r, off_t size, double duration,
+    off_t prefix)
+{
+    off_t                      rate;
+    ngx_http_eflv_loc_conf_t  *elcf;
+
+    elcf = ngx_http_get_module_loc_conf(r, ngx_http_eflv_module);
+
+    if (elcf->limit_rate == 0 || size <= 0 || duration <= 0) {
+        return;
+    }
+
+    rate = (off_t) (size / duration);
+
+    if (rate == 0) {
+        return;
+    }
+
+    r->limit_rate = (size_t) (rate * elcf->limit_rate / 100);
+    r->limit_rate_after = (size_t) (prefix + rate * elcf->limit_rate_after);
+
+#if (nginx_version >= 1017000)
+    r->limit_rate_set = 1;
+    r->limit_rate_after_set = 1;
+#endif
+
+    ngx_log_debug2(NGX_LOG_DEBUG_HTTP, r->connection->log, 0,
+                   "eflv limit rate: %uz after %uz",
+                   r->limit_rate, r->limit_rate_after);
+}
+
+
+/*
+ * the start of the tag at or before "pos" in a window of the file read at
+ * "offset": a header is taken when it is followed by its PreviousTagSize
+ * or preceded by that of the tag before, whichever of them is within the
+ * window, and neither of them contradicts it
+ */
+
+static off_t
+ngx_http_eflv_snap_search(u_char *buf, size_t n, off_t offset, off_t pos,
+    off_t size)
+{
+    u_char         *p, *q;
+    off_t           at;
+    size_t          i, start, datasize, prev;
+    ngx_uint_t      checked;
+    ngx_flv_tag_t  *tag;
+
+    /* a short read may end before "pos" */
+
+    start = (size_t) ngx_min(pos - offset, (off_t) n);
+
+    for (i = start + 1; i-- > 0; /* void */ ) {
+
+        p = buf + i;
+        at = offset + (off_t) i;
+
+        if (at < (off_t) sizeof(ngx_flv_header) - 1) {
+            break;
+        }
+
+        if (n - i < sizeof(ngx_flv_tag_t)) {
+            continue;
+        }
+
+        tag = (ngx_flv_tag_t *) p;
+
+        if ((tag->type != NGX_FLV_AUDIODATA
+             && tag->type != NGX_FLV_VIDEODATA
+             && tag->type != NGX_FLV_SCRIPTDATAOBJECT)
+            || tag->streamid[0] || tag->streamid[1] || tag->streamid[2])
+        {
+            continue;
+        }
+
+        datasize = ngx_flv_get_24value(tag->datasize);
+
+        if (at + (off_t) ngx_flv_tag_size(tag) > size) {
+            continue;
+        }
+
+        checked = 0;
+
+        if (n - i >= ngx_flv_tag_size(tag)) {
+            q = p + sizeof(ngx_flv_tag_t) + datasize;
+
+            if (ngx_flv_get_32value(q) != sizeof(ngx_flv_tag_t) + datasize) {
+                continue;
+            }
+
+            checked = 1;
+        }
+
+        if (i >= 4) {
+            prev = ngx_flv_get_32value(p - 4);
+
+            if (prev == 0) {
+                /* only the first tag follows a zero PreviousTagSize */
+
+                if (at != (off_t) sizeof(ngx_flv_header) - 1) {
+                    continue;
+                }
+
+                checked = 1;
+
+            } else if (i - 4 >= prev) {
+                q = p - 4 - prev;
+
+                if (prev < sizeof(ngx_flv_tag_t)
+                    || (q[0] != NGX_FLV_AUDIODATA
+                        && q[0] != NGX_FLV_VIDEODATA
+                        && q[0] != NGX_FLV_SCRIPTDATAOBJECT)
+                    || ngx_flv_get_24value(q + 1)
+                       != prev - sizeof(ngx_flv_tag_t))
+                {
+                    continue;
+                }
+
+                checked = 1;
+            }
+        }
+
+        if (checked) {
+            return at;
+        }
+    }
+
+    return -1;
+}
+
+
+/* moves "pos" back to the start of a tag found near it */
+
+static ngx_int_t
+ngx_http_eflv_snap_tag(ngx_http_request_t *r, ngx_http_eflv_ctx_t *ctx,
+    off_t *pos)
+{
+    off_t    offset, at;
+    size_t   len;
+    ssize_t  n;
+
+    if (*pos <= (off_t) sizeof(ngx_flv_header) - 1) {
+        *pos = sizeof(ngx_flv_header) - 1;
+        return NGX_OK;
+    }
+
+    if (*pos >= ctx->of.size) {
+        return NGX_OK;
+    }
+
+    /* back far enough for most tags, and past the end of small ones */
+
+    offset = ngx_max(*pos - NGX_FLV_SCAN_STEP, 0);
+    len = (size_t) (ngx_min(*pos + NGX_FLV_HEAD_STEP, ctx->of.size) - offset);
+
+    if (ctx->snap == NULL) {
+        ctx->snap = ngx_pnalloc(r->pool, NGX_FLV_SCAN_STEP + NGX_FLV_HEAD_STEP);
+        if (ctx->snap == NULL) {
+            return NGX_ERROR;
+        }
+    }
+
+    n = ngx_http_eflv_read(r, &ctx->file, ctx->snap, len, offset);
+
+    if (n == NGX_AGAIN || n == NGX_ERROR) {
+        return n;
+    }
+
+    at = ngx_http_eflv_snap_search(ctx->snap, (size_t) n, offset, *pos,
+                                   ctx->of.size);
+
+    if (at == -1) {
+        ngx_log_error(NGX_LOG_INFO, r->connection->log, 0,
+                      "no tag boundary before offset %O in \"%V\", "
+                      "sent as requested", *pos, &ctx->path);
+        ngx_http_eflv_stat(seek_failures, 1);
+        return NGX_OK;
+    }
+
+    ngx_log_debug2(NGX_LOG_DEBUG_HTTP, r->connection->log, 0,
+                   "eflv snap: %O to %O", *pos, at);
+
+    *pos = at;
+
+    return NGX_OK;
+}
+
+
+/* the last keyframe of the index at or before "pos" */
+
+static off_t
+ngx_http_eflv_snap_keyframe(ngx_http_eflv_index_t *index, off_t pos)
+{
+    ngx_uint_t  lo, hi, mid;
+
+    if (index->keyframes == 0 || index->filepositions[0] > pos) {
+        return -1;
+    }
+
+    lo = 0;
+    hi = index->keyframes;
+
+    while (hi - lo > 1) {
+        mid = lo + (hi - lo) / 2;
+
+        if (index->filepositions[mid] <= pos) {
+            lo = mid;
+
+        } else {
+            hi = mid;
+        }
+    }
+
+    return index->filepositions[lo];
+}
+
+
+/*
+ * moves the byte offsets of an sflv request to the starts of tags, the
+ * start one back to a keyframe with "eflv_snap keyframe", so that players
+ * asking for arbitrary offsets get whole tags
+ */
+
+static ngx_int_t
+ngx_http_eflv_snap(ngx_http_request_t *r, ngx_http_eflv_ctx_t *ctx)
+{
+    off_t                      pos, at;
+    ngx_int_t                  rc;
+    ngx_http_eflv_loc_conf_t  *elcf;
+
+    elcf = ngx_http_get_module_loc_conf(r, ngx_http_eflv_module);
+
+    if (!ctx->snapped_start) {
+
+        if (ctx->start != 0) {
+            pos = (off_t) ctx->start;
+
+            at = (elcf->snap == NGX_HTTP_EFLV_SNAP_KEYFRAME)
+                 ? ngx_http_eflv_snap_keyframe(&ctx->index, pos) : -1;
+
+            if (at != -1) {
+                pos = at;
+
+            } else {
+                rc = ngx_http_eflv_snap_tag(r, ctx, &pos);
+                if (rc != NGX_OK) {
+                    return rc;
+                }
+            }
+
+            /* the first tag: the file as it is */
+
+            if (pos == (off_t) sizeof(ngx_flv_header) - 1) {
+                pos = 0;
+            }
+
+            ctx->start = pos;
+        }
+
+        ctx->snapped_start = 1;
+    }
+
+    if (ctx->end > ctx->start && ctx->end < ctx->of.size) {
+        pos = (off_t) ctx->end;
+
+        rc = ngx_http_eflv_snap_tag(r, ctx, &pos);
+        if (rc != NGX_OK) {
+            return rc;
+        }
+
+        ctx->end = pos;
+    }
+
+    ctx->snapped = 1;
+
+    return NGX_OK;
+}
+
+
+static ngx_int_t
+ngx_http_sflv_send(ngx_http_request_t *r, ngx_http_eflv_ctx_t *ctx)
+{
+    double                     start, end, len;
+    ngx_int_t                  rc;
+    ngx_uint_t                 i,j;
+    ngx_log_t                 *log;
+    ngx_buf_t                 *b;
+    ngx_chain_t                out[4];
+    ngx_http_eflv_loc_conf_t  *elcf;
+
+    i= 0;
+    j= 0;
+
+    log = r->connection->log;
+
+    elcf = ngx_http_get_module_loc_conf(r, ngx_http_eflv_module);
+
+    if (elcf->snap != NGX_HTTP_EFLV_SNAP_OFF && !ctx->snapped) {
+        rc = ngx_http_eflv_snap(r, ctx);
+
+        if (rc == NGX_AGAIN) {
+            r->main->count++;
+            return NGX_DONE;
+        }
+
+        if (rc != NGX_OK) {
+            return NGX_HTTP_INTERNAL_SERVER_ERROR;
+        }
+    }
+
+    start = ctx->start;
+    end = ctx->end;
+    len = ctx->of.size;
+
+    log->action = "sending sflv to client";
+    r->headers_out.status = NGX_HTTP_OK;
+    r->headers_out.last_modified_time = ctx->of.mtime;
+
+    if (ngx_http_set_content_type(r) != NGX_OK) {
+        return NGX_HTTP_INTERNAL_SERVER_ERROR;
+    }
+
+    if (start != 0) {
+        b = ngx_pcalloc(r->pool, sizeof(ngx_buf_t));
+        if (b == NULL) {
+            return NGX_HTTP_INTERNAL_SERVER_ERROR;
+        }
+
+        b->pos = ngx_flv_header;
+        b->last = ngx_flv_header + sizeof(ngx_flv_header) - 1;
+        b->memory = 1;
+
+        out[j].buf = b;
+        out[j].next = &out[j+1];
+        j++;
+
+        if (ctx->index.video.len != 0) {
+            b = ngx_http_eflv_tag_buf(r, ctx, &ctx->index.video,
+                                      ctx->index.video_pos);
+            if (b == NULL) {
+                return NGX_HTTP_INTERNAL_SERVER_ERROR;
+            }
+
+            out[j].buf = b;
+            out[j].next = &out[j+1];
+            j++;
+        }
+
+        if (ctx->index.audio.len != 0) {
+            b = ngx_http_eflv_tag_buf(r, ctx, &ctx->index.audio,
+                                      ctx->index.audio_pos);
+            if (b == NULL) {
+                return NGX_HTTP_INTERNAL_SERVER_ERROR;
+            }
+
+            out[j].buf = b;
+            out[j].next = &out[j+1];
+            j++;
+        }
+
+        if (start > end) {
+            end = len;
+        }
+
+        if ((start != len) && (start != end)) {
+            b = ngx_pcalloc(r->pool, sizeof(ngx_buf_t));
+            if (b == NULL) {
+                return NGX_HTTP_INTERNAL_SERVER_ERROR;
+            }
+
+            b->file = ngx_pcalloc(r->pool, sizeof(ngx_file_t));
+            if (b->file == NULL) {
+                return NGX_HTTP_INTERNAL_SERVER_ERROR;
+            }
+
+            b->file_pos = (off_t)start;
+            b->file_last = (off_t)end;
+
+            b->in_file = b->file_last ? 1: 0;
+            b->last_buf = 1;
+            b->last_in_chain = 1;
+
+            b->file->fd = ctx->of.fd;
+            b->file->name = ctx->path;
+            b->file->log = log;
+            b->file->directio = ctx->of.is_directio;
+
+            out[j].buf = b;
+            out[j].next = NULL;
+        } else {
+            b->last_buf = 1;
+            b->last_in_chain = 1;
+            out[--j].next = NULL;
+        }
+    } else {
+        b = ngx_pcalloc(r->pool, sizeof(ngx_buf_t));
+        if (b == NULL) {
+            return NGX_HTTP_INTERNAL_SERVER_ERROR;
+        }
+
+        b->file = ngx_pcalloc(r->pool, sizeof(ngx_file_t));
+        if (b->file == NULL) {
+            return NGX_HTTP_INTERNAL_SERVER_ERROR;
+        }
+
+        b->file_pos = (off_t)start;
+        b->file_last = (off_t)end;
+
+        b->in_file = b->file_last ? 1: 0;
+        b->last_buf = 1;
+        b->last_in_chain = 1;
+
+        b->file->fd = ctx->of.fd;
+        b->file->name = ctx->path;
+        b->file->log = log;
+        b->file->directio = ctx->of.is_directio;
+
+        out[0].buf = b;
+        out[0].next = NULL;
+    }
+
+    ctx->slice_start = (off_t) start;
+    ctx->slice_end = (off_t) ngx_max(start, end);
+    ctx->sliced = 1;
+
+    if (ngx_http_eflv_follow_init(r, ctx, (off_t) end) != NGX_OK) {
+        return NGX_HTTP_INTERNAL_SERVER_ERROR;
+    }
+
+    /* the whole file's bitrate, known once the index has been read */
+
+    if (ctx->index.duration > 0) {
+        ngx_http_eflv_pace(r, ctx->of.size, ctx->index.duration, 0);
+    }
+
+    return ngx_http_eflv_send_response(r, ctx, &out[i], (off_t) start,
+                                       (off_t) end);
+}
+
+
+static ngx_int_t
+ngx_http_sflv_handler(ngx_http_request_t *r)
+{
+    double                     start = 0, end = 0, len;
+    ngx_int_t                  rc;
+    ngx_str_t                  value;
+    ngx_http_eflv_ctx_t       *ctx;
+
+    if (!(r->method & (NGX_HTTP_GET|NGX_HTTP_HEAD))) {
+        return NGX_HTTP_NOT_ALLOWED;
+    }
+
+    if (r->uri.data[r->uri.len - 1] == '/') {
+        return NGX_DECLINED;
+    }
+
+    rc = ngx_http_discard_request_body(r);
+
+    if (rc != NGX_OK) {
+        return rc;
+    }
+
+    ngx_http_eflv_stat(sflv_requests, 1);
+
+    ctx = ngx_pcalloc(r->pool, sizeof(ngx_http_eflv_ctx_t));
+    if (ctx == NULL) {
+        return NGX_HTTP_INTERNAL_SERVER_ERROR;
+    }
+
+    ngx_http_set_ctx(r, ctx, ngx_http_eflv_module);
+
+    rc = ngx_http_eflv_open_file(r, ctx);
+
+    if (rc != NGX_OK) {
+        return rc;
+    }
+
+    start = 0;
+    len = ctx->of.size;
+
+
+    if (ngx_http_arg(r, (u_char *) "start", 5, &value) == NGX_OK) {
+
+        start = ngx_atoof(value.data, value.len);
+
+        if (start > len){
+            return NGX_DECLINED;
+        }
+
+        if (start == NGX_ERROR) {
+            start = 0;
+        }
+
+    }
+
+    end = len;
+    if (ngx_http_arg(r, (u_char *) "end", 3, &value) == NGX_OK) {
+
+        end = ngx_atoof(value.data, value.len) + 1;
+        if (end == NGX_ERROR || (end > len)) {
+            end = len;
+        }
+    }
+
+    ctx->start = start;
+    ctx->end = end;
+    ctx->send = ngx_http_sflv_send;
+    ctx->need_index = (start != 0);
+
+    return ngx_http_eflv_process(r);
+}
+
+
+/*
+ * shifts the timestamps of the tags whose headers are within the buffer
+ * read from the file at "pos" so that the first tag starts at 0; returns
+ * the number of bytes that may be sent, which excludes a tag header cut
+ * by the end of the buffer
+ */
+
+static size_t
+ngx_http_eflv_rebase_buf(ngx_http_eflv_rebase_t *rb, u_char *buf, size_t n)
+{
+    u_char         *p;
+    off_t           last;
+    uint32_t        timestamp;
+    ngx_flv_tag_t  *flvtag;
+
+    last = rb->pos + n;
+
+    while (rb->next + (off_t) sizeof(ngx_flv_tag_t) <= last) {
+
+        flvtag = (ngx_flv_tag_t *) (buf + (rb->next - rb->pos));
+
+        timestamp = ngx_flv_tag_timestamp(flvtag);
+
+        if (!rb->started) {
+            rb->base = timestamp;
+            rb->started = 1;
+        }
+
+        timestamp = (timestamp > rb->base) ? timestamp - rb->base : 0;
+
+        p = flvtag->timestamp;
+        ngx_flv_put_24value(p, timestamp);
+        flvtag->timestamp_ex = (u_char) (timestamp >> 24);
+
+        rb->next += ngx_flv_tag_size(flvtag);
+    }
+
+    if (rb->next < last
+        && (rb->follow
+            || rb->next + (off_t) sizeof(ngx_flv_tag_t) <= rb->end))
+    {
+        return (size_t) (rb->next - rb->pos);
+    }
+
+    return n;
+}
+
+
+/*
+ * sends the file slice through a few memory buffers, shifting the tag
+ * timestamps; the request is parked while a read is in progress or all
+ * buffers are still being sent
+ */
+
+static ngx_int_t
+ngx_http_eflv_rebase_send(ngx_http_request_t *r, ngx_http_eflv_ctx_t *ctx)
+{
+    size_t                     size;
+    ssize_t                    n;
+    ngx_int_t                  rc;
+    ngx_buf_t                 *b;
+    ngx_chain_t               *cl;
+    ngx_event_t               *wev;
+    ngx_http_eflv_rebase_t    *rb;
+    ngx_http_core_loc_conf_t  *clcf;
+    ngx_http_eflv_loc_conf_t  *elcf;
+
+    rb = &ctx->rebase;
+
+    if (r->aio) {
+        r->main->count++;
+        return NGX_DONE;
+    }
+
+    elcf = ngx_http_get_module_loc_conf(r, ngx_http_eflv_module);
+
+    for ( ;; ) {
+
+        if (rb->buf == NULL && rb->free == NULL
+            && rb->allocated == (ngx_uint_t) elcf->rebase_bufs.num)
+        {
+            rc = ngx_http_output_filter(r, NULL);
+
+            ngx_chain_update_chains(r->pool, &rb->free, &rb->busy, NULL,
+                                    (ngx_buf_tag_t) &ngx_http_eflv_module);
+
+            if (rc == NGX_ERROR) {
+                return NGX_ERROR;
+            }
+
+            if (rb->free == NULL) {
+                wev = r->connection->write;
+                clcf = ngx_http_get_module_loc_conf(r, ngx_http_core_module);
+
+                if (!wev->delayed) {
+                    ngx_add_timer(wev, clcf->send_timeout);
+                }
+
+                if (ngx_handle_write_event(wev, clcf->send_lowat) != NGX_OK) {
+                    return NGX_ERROR;
+                }
+
+                r->main->count++;
+                return NGX_DONE;
+            }
+        }
+
+        /* wait until the file has the next tag header as a whole */
+
+        if (rb->follow
+            && (rb->pos == rb->end
+                || (rb->pos == rb->next
+                    && rb->end - rb->pos < (off_t) sizeof(ngx_flv_tag_t))))
+        {
+            rc = ngx_http_eflv_follow_wait(r, ctx, &rb->end);
+
+            if (rc == NGX_DECLINED) {
+                rb->follow = 0;
+
+                if (rb->pos == rb->end) {
+                    rb->done = 1;
+                    return ngx_http_send_special(r, NGX_HTTP_LAST);
+                }
+
+            } else if (rc != NGX_OK) {
+                return rc;
+            }
+
+            continue;
+        }
+
+        b = rb->buf;
+
+        if (b == NULL) {
+
+            if (rb->free) {
+                cl = rb->free;
+                rb->free = cl->next;
+                b = cl->buf;
+                ngx_free_chain(r->pool, cl);
+
+            } else {
+                b = ngx_create_temp_buf(r->pool, elcf->rebase_bufs.size);
+                if (b == NULL) {
+                    return NGX_ERROR;
+                }
+
+                b->tag = (ngx_buf_tag_t) &ngx_http_eflv_module;
+                rb->allocated++;
+            }
+
+            rb->buf = b;
+        }
+
+        size = (size_t) ngx_min((off_t) (b->end - b->start),
+                                rb->end - rb->pos);
+
+        n = 0;
+
+        if (size) {
+            n = ngx_http_eflv_read(r, &ctx->file, b->start, size, rb->pos);
+
+            if (n == NGX_AGAIN) {
+                r->main->count++;
+                return NGX_DONE;
+            }
+
+            if (n == NGX_ERROR) {
+                return NGX_ERROR;
+            }
+
+            if ((size_t) n != size) {
+                ngx_log_error(NGX_LOG_CRIT, r->connection->log, 0,
+                              "read only %z of %uz from \"%V\"",
+                              n, size, &ctx->path);
+                return NGX_ERROR;
+            }
+
+            n = ngx_http_eflv_rebase_buf(rb, b->start, n);
+
+            ngx_http_eflv_stat(file_bytes, n);
+        }
+
+        rb->buf = NULL;
+        rb->pos += n;
+
+        b->pos = b->start;
+        b->last = b->start + n;
+
+        if (rb->follow) {
+            b->flush = 1;
+
+        } else if (rb->pos == rb->end) {
+            b->last_buf = 1;
+            b->last_in_chain = 1;
+            rb->done = 1;
+        }
+
+        cl = ngx_alloc_chain_link(r->pool);
+        if (cl == NULL) {
+            return NGX_ERROR;
+        }
+
+        cl->buf = b;
+        cl->next = NULL;
+
+        rc = ngx_http_output_filter(r, cl);
+
+        ngx_chain_update_chains(r->pool, &rb->free, &rb->busy, &cl,
+                                (ngx_buf_tag_t) &ngx_http_eflv_module);
+
+        if (rc == NGX_ERROR || rb->done) {
+            return rc;
+        }
+    }
+}
+
+
+static void
+ngx_http_eflv_write_handler(ngx_http_request_t *r)
+{
+    ngx_event_t               *wev;
+    ngx_connection_t          *c;
+    ngx_http_core_loc_conf_t  *clcf;
+
+    c = r->connection;
+    wev = c->write;
+
+    ngx_log_debug2(NGX_LOG_DEBUG_HTTP, c->log, 0,
+                   "eflv writer: \"%V?%V\"", &r->uri, &r->args);
+
+    if (wev->timedout) {
+        ngx_log_error(NGX_LOG_INFO, c->log, NGX_ETIMEDOUT,
+                      "client timed out");
+        c->timedout = 1;
+
+        ngx_http_finalize_request(r, NGX_HTTP_REQUEST_TIME_OUT);
+        return;
+    }
+
+    if (wev->delayed || r->aio) {
+        clcf = ngx_http_get_module_loc_conf(r, ngx_http_core_module);
+
+        if (ngx_handle_write_event(wev, clcf->send_lowat) != NGX_OK) {
+            ngx_http_finalize_request(r, NGX_ERROR);
+        }
+
+        return;
+    }
+
+    ngx_http_finalize_request(r, ngx_http_eflv_process(r));
+}
+
+
+static u_char *
+ngx_http_eflv_format_keyframes(u_char *p, ngx_http_eflv_ctx_t *ctx)
+{
+    p = ngx_sprintf(p, "%ui-", ctx->clip.start_index);
+
+    if (ctx->clip.end_index < ctx->index.keyframes) {
+        p = ngx_sprintf(p, "%ui", ctx->clip.end_index);
+    }
+
+    return p;
+}
+
+
+static ngx_uint_t
+ngx_http_eflv_arg_is(u_char *p, u_char *last, char *name, size_t len)
+{
+    return (size_t) (last - p) >= len
+           && ngx_strncasecmp(p, (u_char *) name, len) == 0
+           && (p + len == last || p[len] == '=');
+}
+
+
+/*
+ * appends the request arguments other than those selecting the part of
+ * the file sent, each after "&", in their order
+ */
+
+static u_char *
+ngx_http_eflv_copy_args(ngx_http_request_t *r, u_char *p)
+{
+    u_char  *arg, *next, *last;
+
+    last = r->args.data + r->args.len;
+
+    for (arg = r->args.data; arg < last; arg = next + 1) {
+
+        next = ngx_strlchr(arg, last, '&');
+        if (next == NULL) {
+            next = last;
+        }
+
+        if (next == arg
+            || ngx_http_eflv_arg_is(arg, next, "start", 5)
+            || ngx_http_eflv_arg_is(arg, next, "end", 3)
+            || ngx_http_eflv_arg_is(arg, next, "kf", 2)
+            || ngx_http_eflv_arg_is(arg, next, "hls", 3))
+        {
+            continue;
+        }
+
+        *p++ = '&';
+        p = ngx_cpymem(p, arg, next - arg);
+    }
+
+    return p;
+}
+
+
+/*
+ * redirects a request for a time window to the "kf" form of the keyframe
+ * window it resolves to, so all times within the same keyframe interval
+ * share a single URI; other arguments are kept in their order
+ */
+
+static ngx_int_t
+ngx_http_eflv_canonical_redirect(ngx_http_request_t *r,
+    ngx_http_eflv_ctx_t *ctx)
+{
+    size_t            len;
+    u_char           *p;
+    uintptr_t         escape;
+    ngx_table_elt_t  *location;
+
+    escape = 2 * ngx_escape_uri(NULL, r->uri.data, r->uri.len,
+                                NGX_ESCAPE_URI);
+
+    len = r->uri.len + escape + sizeof("?kf=-") - 1 + 2 * NGX_INT_T_LEN
+          + 1 + r->args.len;
+
+    p = ngx_pnalloc(r->pool, len);
+    if (p == NULL) {
+        return NGX_HTTP_INTERNAL_SERVER_ERROR;
+    }
+
+    location = ngx_http_eflv_push_header(r, "Location", sizeof("Location") - 1);
+    if (location == NULL) {
+        return NGX_HTTP_INTERNAL_SERVER_ERROR;
+    }
+
+    location->value.data = p;
+
+    if (escape) {
+        p = (u_char *) ngx_escape_uri(p, r->uri.data, r->uri.len,
+                                      NGX_ESCAPE_URI);
+
+    } else {
+        p = ngx_cpymem(p, r->uri.data, r->uri.len);
+    }
+
+    p = ngx_cpymem(p, "?kf=", sizeof("?kf=") - 1);
+    p = ngx_http_eflv_format_keyframes(p, ctx);
+    p = ngx_http_eflv_copy_args(r, p);
+
+    location->value.len = p - location->value.data;
+
+    r->headers_out.location = location;
+
+    ngx_log_debug1(NGX_LOG_DEBUG_HTTP, r->connection->log, 0,
+                   "eflv canonical redirect: \"%V\"", &location->value);
+
+    return NGX_HTTP_MOVED_TEMPORARILY;
+}
+
+
+static ngx_int_t
+ngx_http_tflv_send(ngx_http_request_t *r, ngx_http_eflv_ctx_t *ctx)
+{
+    double                     start, end, len;
+    size_t                     headers;
+    uint64_t                   usec;
+    ngx_int_t                  rc;
+    ngx_buf_t                 *b;
+    ngx_log_t                 *log;
+    ngx_str_t                  metadata;
+    ngx_uint_t                 i, j, whole;
+    ngx_chain_t                out[5];
+    ngx_http_eflv_clip_t       clip;
+    ngx_http_eflv_index_t     *index;
+    ngx_http_eflv_loc_conf_t  *elcf;
+
+    log = r->connection->log;
+    index = &ctx->index;
+
+    start = ctx->start;
+    end = ctx->end;
+    len = ctx->of.size;
+    i = 0;
+    j = 0;
+    whole = 0;
+    headers = index->video.len + index->audio.len;
+
+    elcf = ngx_http_get_module_loc_conf(r, ngx_http_eflv_module);
+
+    usec = ngx_http_eflv_usec();
+
+    ngx_memzero(&clip, sizeof(ngx_http_eflv_clip_t));
+
+    if (ctx->have_kf) {
+        rc = ngx_http_eflv_keyframe_position(index, ctx->kf_start,
+                                             ctx->kf_end, ctx->have_kf_end,
+                                             &start, &end, len, &clip);
+
+        if (rc == -1 && index->keyframes) {
+            ngx_log_error(NGX_LOG_INFO, log, 0,
+                          "keyframes %ui-%ui are out of the index of \"%V\"",
+                          ctx->kf_start, ctx->kf_end, &ctx->path);
+            ngx_http_eflv_stat(seek_failures, 1);
+            return NGX_HTTP_BAD_REQUEST;
+        }
+
+    } else {
+        rc = ngx_http_eflv_time_drag_position(index, &start, &end, len,
+                                              ctx->have_end, &clip);
+    }
+
+    if (rc == -1) {
+        /* no keyframes to seek to: send the whole file body */
+
+        ngx_log_error(NGX_LOG_INFO, log, 0,
+                      "\"%V\" has no keyframe index, time seeking ignored",
+                      &ctx->path);
+
+        ngx_http_eflv_stat(seek_failures, 1);
+
+        start = sizeof(ngx_flv_header) - 1;
+        end = len;
+        clip.duration = index->duration;
+
+        /*
+         * the body has the onMetaData and sequence header tags already,
+         * as with sflv from the first tag
+         */
+
+        whole = 1;
+        headers = 0;
+
+    } else {
+        ctx->clip = clip;
+        ctx->resolved = 1;
+
+        if (elcf->canonical_redirect && ctx->have_time) {
+            return ngx_http_eflv_canonical_redirect(r, ctx);
+        }
+    }
+
+    rc = NGX_DECLINED;
+
+    if (ctx->resolved && index->metadata.len) {
+        rc = ngx_http_eflv_rewrite_metadata(r, index, &clip, (off_t) start,
+                                            (off_t) end,
+                                            sizeof(ngx_flv_header) - 1
+                                            + headers, &metadata);
+        if (rc == NGX_ERROR) {
+            return NGX_HTTP_INTERNAL_SERVER_ERROR;
+        }
+    }
+
+    if (rc == NGX_DECLINED) {
+        metadata.len = whole ? 0 : index->metadata.len;
+        metadata.data = NULL;
+
+        if (metadata.len) {
+            metadata.data = ngx_pnalloc(r->pool, metadata.len);
+            if (metadata.data == NULL) {
+                return NGX_HTTP_INTERNAL_SERVER_ERROR;
+            }
+
+            ngx_memcpy(metadata.data, index->metadata.data, metadata.len);
+
+            if (index->duration_offset) {
+                ngx_flv_put_double(metadata.data + index->duration_offset,
+                                   clip.duration);
+            }
+        }
+    }
+
+    ctx->resolve_usec = ngx_http_eflv_usec() - usec;
+    ngx_http_eflv_stat_time(seek_time, ctx->resolve_usec);
+
+    log->action = "sending tflv to client";
+    r->headers_out.status = NGX_HTTP_OK;
+    r->headers_out.last_modified_time = ctx->of.mtime;
+    if (ngx_http_set_content_type(r) != NGX_OK) {
+        return NGX_HTTP_INTERNAL_SERVER_ERROR;
+    }
+
+    b = ngx_pcalloc(r->pool, sizeof(ngx_buf_t));
+    if (b == NULL) {
+        return NGX_HTTP_INTERNAL_SERVER_ERROR;
+    }
+
+    b->pos = ngx_flv_header;
+    b->last = ngx_flv_header + sizeof(ngx_flv_header) - 1;
+    b->memory = 1;
+
+    out[j].buf = b;
+    out[j].next = &out[j + 1];
+    j++;
+
+    if (metadata.len) {
+        b = ngx_pcalloc(r->pool, sizeof(ngx_buf_t));
+        if (b == NULL) {
+            return NGX_HTTP_INTERNAL_SERVER_ERROR;
+        }
+
+        b->pos = metadata.data;
+        b->last = metadata.data + metadata.len;
+        b->memory = 1;
+        out[j].buf = b;
+        out[j].next = &out[j + 1];
+        j++;
+    }
+
+    if (!whole && index->video.len != 0) {
+        b = ngx_http_eflv_tag_buf(r, ctx, &index->video, index->video_pos);
+        if (b == NULL) {
+            return NGX_HTTP_INTERNAL_SERVER_ERROR;
+        }
+
+        out[j].buf = b;
+        out[j].next = &out[j + 1];
+        j++;
+    }
+
+    if (!whole && index->audio.len != 0) {
+        b = ngx_http_eflv_tag_buf(r, ctx, &index->audio, index->audio_pos);
+        if (b == NULL) {
+            return NGX_HTTP_INTERNAL_SERVER_ERROR;
+        }
+
+        out[j].buf = b;
+        out[j].next = &out[j + 1];
+        j++;
+    }
+
+    ctx->slice_start = (off_t) start;
+    ctx->slice_end = (off_t) end;
+    ctx->sliced = 1;
+
+    ngx_http_eflv_pace(r, (off_t) (end - start), clip.duration,
+                       sizeof(ngx_flv_header) - 1 + metadata.len + headers);
+
+    if (ngx_http_eflv_follow_init(r, ctx, (off_t) end) != NGX_OK) {
+        return NGX_HTTP_INTERNAL_SERVER_ERROR;
+    }
+
+    if (elcf->rebase_timestamps) {
+        r->headers_out.content_length_n = sizeof(ngx_flv_header) - 1
+                                          + metadata.len + end - start
+                                          + headers;
+
+        if (ctx->follow) {
+            r->headers_out.content_length_n = -1;
+            ngx_http_clear_last_modified(r);
+            ctx->rebase.follow = 1;
+        }
+
+        rc = ngx_http_send_header(r);
+        if (rc == NGX_ERROR || rc > NGX_OK || r->header_only) {
+            return rc;
+        }
+
+        out[j - 1].next = NULL;
+
+        ngx_http_eflv_stat_chain(&out[i]);
+
+        rc = ngx_http_output_filter(r, &out[i]);
+        if (rc == NGX_ERROR) {
+            return rc;
+        }
+
+        ctx->rebase.pos = (off_t) start;
+        ctx->rebase.next = (off_t) start;
+        ctx->rebase.end = (off_t) end;
+
+        ctx->send = ngx_http_eflv_rebase_send;
+        r->write_event_handler = ngx_http_eflv_write_handler;
+
+        return ngx_http_eflv_rebase_send(r, ctx);
+    }
+
+    b = ngx_pcalloc(r->pool, sizeof(ngx_buf_t));
+    if (b == NULL) {
+        return NGX_HTTP_INTERNAL_SERVER_ERROR;
+    }
+
+    b->file = ngx_pcalloc(r->pool, sizeof(ngx_file_t));
+    if (b->file == NULL) {
+        return NGX_HTTP_INTERNAL_SERVER_ERROR;
+    }
+
+    b->file_pos = (off_t) start;
+    b->file_last = (off_t) end;
+
+    b->in_file = b->file_last ? 1 : 0;
+    b->last_buf = 1;
+    b->last_in_chain = 1;
+
+    b->file->fd = ctx->of.fd;
+    b->file->name = ctx->path;
+    b->file->log = log;
+    b->file->directio = ctx->of.is_directio;
+
+    out[j].buf = b;
+    out[j].next = NULL;
+
+    return ngx_http_eflv_send_response(r, ctx, &out[i], (off_t) start,
+                                       (off_t) end);
+}
+
+
+/* "kf=start-end" or "kf=start-" */
+
+static ngx_int_t
+ngx_http_eflv_parse_kf(ngx_http_eflv_ctx_t *ctx, ngx_str_t *value)
+{
+    u_char     *dash, *last;
+    ngx_int_t   n;
+
+    last = value->data + value->len;
+
+    dash = ngx_strlchr(value->data, last, '-');
+    if (dash == NULL) {
+        return NGX_ERROR;
+    }
+
+    n = ngx_atoi(value->data, dash - value->data);
+    if (n == NGX_ERROR) {
+        return NGX_ERROR;
+    }
+
+    ctx->kf_start = n;
+
+    if (dash + 1 < last) {
+        n = ngx_atoi(dash + 1, last - dash - 1);
+        if (n == NGX_ERROR) {
+            return NGX_ERROR;
+        }
+
+        ctx->kf_end = n;
+        ctx->have_kf_end = 1;
+    }
+
+    ctx->have_kf = 1;
+
+    return NGX_OK;
+}
+
+
+/* the sequence headers in the index set the streams of the segments */
+
+static ngx_int_t
+ngx_http_eflv_hls_codecs(ngx_http_request_t *r, ngx_http_eflv_ctx_t *ctx,
+    ngx_http_eflv_ts_t *ts)
+{
+    ngx_http_eflv_index_t  *index;
+
+    index = &ctx->index;
+
+    if (index->video.len) {
+        (void) ngx_http_eflv_ts_avc_config(ts, index->video.data,
+                                           index->video.len);
+    }
+
+    if (index->audio.len) {
+        (void) ngx_http_eflv_ts_aac_config(ts, index->audio.data,
+                                           index->audio.len);
+    }
+
+    if (!ts->video && !ts->audio) {
+        ngx_log_error(NGX_LOG_INFO, r->connection->log, 0,
+                      "\"%V\" has no H.264 or AAC sequence header, "
+                      "HLS is not supported", &ctx->path);
+        return NGX_DECLINED;
+    }
+
+    return NGX_OK;
+}
+
+
+/* the first keyframe at least a fragment past the start of a segment */
+
+static ngx_uint_t
+ngx_http_eflv_hls_next(ngx_http_eflv_index_t *index, ngx_uint_t start,
+    double fragment)
+{
+    return ngx_http_eflv_lower_bound(index->times, index->keyframes,
+                                     start + 1,
+                                     index->times[start] + fragment);
+}
+
+
+static double
+ngx_http_eflv_hls_duration(ngx_http_eflv_index_t *index, ngx_uint_t start,
+    ngx_uint_t end)
+{
+    double  duration;
+
+    duration = ((end < index->keyframes) ? index->times[end]
+                                         : index->duration)
+               - index->times[start];
+
+    return (duration > 0) ? duration : 0;
+}
+
+
+/*
+ * a VOD playlist of segments cut at keyframes, each one referring to the
+ * file with the "hls=ts" and "kf" arguments
+ */
+
+static ngx_int_t
+ngx_http_eflv_hls_playlist(ngx_http_request_t *r, ngx_http_eflv_ctx_t *ctx)
+{
+    u_char                    *p, *name;
+    size_t                     len, nlen;
+    double                     fragment, duration, target;
+    uintptr_t                  escape;
+    ngx_int_t                  rc;
+    ngx_buf_t                 *b;
+    ngx_uint_t                 start, end, n;
+    ngx_chain_t                out;
+    ngx_http_eflv_ts_t         ts;
+    ngx_http_eflv_index_t     *index;
+    ngx_http_eflv_loc_conf_t  *elcf;
+
+    elcf = ngx_http_get_module_loc_conf(r, ngx_http_eflv_module);
+    index = &ctx->index;
+
+    ngx_memzero(&ts, sizeof(ngx_http_eflv_ts_t));
+
+    if (ngx_http_eflv_hls_codecs(r, ctx, &ts) != NGX_OK) {
+        return NGX_HTTP_UNSUPPORTED_MEDIA_TYPE;
+    }
+
+    fragment = elcf->hls_fragment / 1000.0;
+
+    /* without keyframes the file is a single segment */
+
+    n = 1;
+    target = index->duration;
+
+    if (index->keyframes) {
+        n = 0;
+        target = 0;
+
+        for (start = 0; start < index->keyframes; start = end) {
+            end = ngx_http_eflv_hls_next(index, start, fragment);
+            duration = ngx_http_eflv_hls_duration(index, start, end);
+
+            if (duration > target) {
+                target = duration;
+            }
+
+            n++;
+        }
+    }
+
+    name = r->uri.data + r->uri.len;
+
+    while (name > r->uri.data && name[-1] != '/') {
+        name--;
+    }
+
+    nlen = r->uri.data + r->uri.len - name;
+    escape = 2 * ngx_escape_uri(NULL, name, nlen, NGX_ESCAPE_URI);
+
+    len = sizeof("#EXTM3U\n#EXT-X-VERSION:3\n"
+                 "#EXT-X-PLAYLIST-TYPE:VOD\n#EXT-X-MEDIA-SEQUENCE:0\n"
+                 "#EXT-X-TARGETDURATION:\n#EXT-X-ENDLIST\n") - 1
+          + NGX_INT_T_LEN
+          + n * (sizeof("#EXTINF:.000,\n?hls=ts&kf=-\n") - 1
+                 + 3 * NGX_INT_T_LEN + nlen + escape + 1 + r->args.len);
+
+    b = ngx_create_temp_buf(r->pool, len);
+    if (b == NULL) {
+        return NGX_HTTP_INTERNAL_SERVER_ERROR;
+    }
+
+    p = ngx_sprintf(b->pos, "#EXTM3U\n#EXT-X-VERSION:3\n"
+                            "#EXT-X-PLAYLIST-TYPE:VOD\n"
+                            "#EXT-X-MEDIA-SEQUENCE:0\n"
+                            "#EXT-X-TARGETDURATION:%ui\n",
+                    ngx_max((ngx_uint_t) (target + 0.5), 1));
+
+    start = 0;
+
+    do {
+        if (index->keyframes) {
+            end = ngx_http_eflv_hls_next(index, start, fragment);
+            duration = ngx_http_eflv_hls_duration(index, start, end);
+
+        } else {
+            end = 0;
+            duration = index->duration;
+        }
+
+        p = ngx_sprintf(p, "#EXTINF:%.3f,\n", duration);
+
+        if (escape) {
+            p = (u_char *) ngx_escape_uri(p, name, nlen, NGX_ESCAPE_URI);
+
+        } else {
+            p = ngx_cpymem(p, name, nlen);
+        }
+
+        p = ngx_cpymem(p, "?hls=ts", sizeof("?hls=ts") - 1);
+
+        if (index->keyframes) {
+            p = ngx_sprintf(p, "&kf=%ui-", start);
+
+            if (end < index->keyframes) {
+                p = ngx_sprintf(p, "%ui", end);
+            }
+        }
+
+        p = ngx_http_eflv_copy_args(r, p);
+        *p++ = LF;
+
+        start = end;
+
+    } while (start < index->keyframes);
+
+    p = ngx_cpymem(p, "#EXT-X-ENDLIST\n", sizeof("#EXT-X-ENDLIST\n") - 1);
+
+    b->last = p;
+    b->last_buf = (r == r->main) ? 1 : 0;
+    b->last_in_chain = 1;
+
+    r->headers_out.status = NGX_HTTP_OK;
+    r->headers_out.content_length_n = b->last - b->pos;
+    r->headers_out.last_modified_time = ctx->of.mtime;
+
+    ngx_str_set(&r->headers_out.content_type,
+                "application/vnd.apple.mpegurl");
+    r->headers_out.content_type_len = r->headers_out.content_type.len;
+
+    rc = ngx_http_send_header(r);
+    if (rc == NGX_ERROR || rc > NGX_OK || r->header_only) {
+        return rc;
+    }
+
+    out.buf = b;
+    out.next = NULL;
+
+    ngx_http_eflv_stat_chain(&out);
+
+    return ngx_http_output_filter(r, &out);
+}
+
+
+static ngx_int_t
+ngx_http_eflv_hls_output(ngx_http_request_t *r, ngx_http_eflv_hls_t *hls,
+    ngx_uint_t last)
+{
+    ngx_int_t     rc;
+    ngx_buf_t    *b;
+    ngx_chain_t  *cl;
+
+    b = hls->buf;
+    hls->buf = NULL;
+
+    if (last && b->pos == b->last) {
+        return ngx_http_send_special(r, NGX_HTTP_LAST);
+    }
+
+    if (last) {
+        b->last_buf = 1;
+        b->last_in_chain = 1;
+    }
+
+    cl = ngx_alloc_chain_link(r->pool);
+    if (cl == NULL) {
+        return NGX_ERROR;
+    }
+
+    cl->buf = b;
+    cl->next = NULL;
+
+    ngx_http_eflv_stat(memory_bytes, b->last - b->pos);
+
+    rc = ngx_http_output_filter(r, cl);
+
+    ngx_chain_update_chains(r->pool, &hls->free, &hls->busy, &cl,
+                            (ngx_buf_tag_t) &ngx_http_eflv_module);
+
+    return rc;
+}
+
+
+/*
+ * makes the next tag of the segment whole in the input buffer, which
+ * grows to the largest tag: returns NGX_OK, NGX_DONE at the end of the
+ * segment, or NGX_AGAIN while a read is in progress
+ */
+
+static ngx_int_t
+ngx_http_eflv_hls_read_tag(ngx_http_request_t *r, ngx_http_eflv_ctx_t *ctx,
+    ngx_flv_tag_t **tag)
+{
+    size_t                len, avail, need;
+    ssize_t               n;
+    ngx_buf_t            *in, *b;
+    ngx_flv_tag_t        *flvtag;
+    ngx_http_eflv_hls_t  *hls;
+
+    hls = ctx->hls;
+    in = hls->in;
+
+    for ( ;; ) {
+        avail = in->last - in->pos;
+        need = sizeof(ngx_flv_tag_t);
+
+        if (avail >= need) {
+            flvtag = (ngx_flv_tag_t *) in->pos;
+
+            if (flvtag->type != NGX_FLV_AUDIODATA
+                && flvtag->type != NGX_FLV_VIDEODATA
+                && flvtag->type != NGX_FLV_SCRIPTDATAOBJECT)
+            {
+                ngx_log_error(NGX_LOG_WARN, r->connection->log, 0,
+                              "unexpected tag type %d at offset %O in \"%V\"",
+                              (int) flvtag->type,
+                              hls->offset - (off_t) avail, &ctx->path);
+                return NGX_DONE;
+            }
+
+            need = ngx_flv_tag_size(flvtag);
+
+            if (avail >= need) {
+                *tag = flvtag;
+                in->pos += need;
+                return NGX_OK;
+            }
+        }
+
+        /* a tag cut by the end of the segment */
+
+        if (hls->offset == hls->end) {
+            return NGX_DONE;
+        }
+
+        if ((size_t) (in->end - in->pos) < need) {
+
+            if ((size_t) (in->end - in->start) < need) {
+                b = ngx_create_temp_buf(r->pool,
+                                        ngx_max(need,
+                                                2 * (size_t) (in->end
+                                                              - in->start)));
+                if (b == NULL) {
+                    return NGX_ERROR;
+                }
+
+                b->last = ngx_cpymem(b->pos, in->pos, avail);
+
+                ngx_pfree(r->pool, in->start);
+
+                hls->in = b;
+                in = b;
+
+            } else {
+                in->last = ngx_movemem(in->start, in->pos, avail);
+                in->pos = in->start;
+            }
+        }
+
+        len = (size_t) ngx_min((off_t) (in->end - in->last),
+                               hls->end - hls->offset);
+
+        n = ngx_http_eflv_read(r, &ctx->file, in->last, len, hls->offset);
+
+        if (n == NGX_AGAIN || n == NGX_ERROR) {
+            return n;
+        }
+
+        if ((size_t) n != len) {
+            ngx_log_error(NGX_LOG_CRIT, r->connection->log, 0,
+                          "read only %z of %uz from \"%V\"",
+                          n, len, &ctx->path);
+            return NGX_ERROR;
+        }
+
+        in->last += n;
+        hls->offset += n;
+    }
+}
+
+
+/*
+ * sends the tags of the segment as MPEG-TS through a few memory buffers,
+ * packetizing a frame at a time; the request is parked while a read is
+ * in progress or all buffers are still being sent
+ */
+
+static ngx_int_t
+ngx_http_eflv_hls_send(ngx_http_request_t *r, ngx_http_eflv_ctx_t *ctx)
+{
+    size_t                     size;
+    ngx_int_t                  rc;
+    ngx_buf_t                 *b;
+    ngx_chain_t               *cl;
+    ngx_event_t               *wev;
+    ngx_flv_tag_t             *tag;
+    ngx_http_eflv_hls_t       *hls;
+    ngx_http_core_loc_conf_t  *clcf;
+    ngx_http_eflv_loc_conf_t  *elcf;
+
+    hls = ctx->hls;
+
+    if (r->aio) {
+        r->main->count++;
+        return NGX_DONE;
+    }
+
+    elcf = ngx_http_get_module_loc_conf(r, ngx_http_eflv_module);
+
+    for ( ;; ) {
+
+        if (hls->buf == NULL) {
+
+            if (hls->free == NULL
+                && hls->allocated == (ngx_uint_t) elcf->rebase_bufs.num)
+            {
+                rc = ngx_http_output_filter(r, NULL);
+
+                ngx_chain_update_chains(r->pool, &hls->free, &hls->busy, NULL,
+                                        (ngx_buf_tag_t) &ngx_http_eflv_module);
+
+                if (rc == NGX_ERROR) {
+                    return NGX_ERROR;
+                }
+
+                if (hls->free == NULL) {
+                    wev = r->connection->write;
+                    clcf = ngx_http_get_module_loc_conf(r,
+                                                        ngx_http_core_module);
+
+                    if (!wev->delayed) {
+                        ngx_add_timer(wev, clcf->send_timeout);
+                    }
+
+                    if (ngx_handle_write_event(wev, clcf->send_lowat)
+                        != NGX_OK)
+                    {
+                        return NGX_ERROR;
+                    }
+
+                    r->main->count++;
+                    return NGX_DONE;
+                }
+            }
+
+            if (hls->free) {
+                cl = hls->free;
+                hls->free = cl->next;
+                b = cl->buf;
+                ngx_free_chain(r->pool, cl);
+
+            } else {
+                /* whole packets, and at least the PAT and PMT */
+
+                size = ngx_max(elcf->rebase_bufs.size / NGX_HTTP_EFLV_TS_PACKET,
+                               2) * NGX_HTTP_EFLV_TS_PACKET;
+
+                b = ngx_create_temp_buf(r->pool, size);
+                if (b == NULL) {
+                    return NGX_ERROR;
+                }
+
+                b->tag = (ngx_buf_tag_t) &ngx_http_eflv_module;
+                hls->allocated++;
+            }
+
+            b->pos = b->start;
+            b->last = b->start;
+
+            hls->buf = b;
+        }
+
+        b = hls->buf;
+
+        if (!hls->tables) {
+            b->last = ngx_http_eflv_ts_pat(&hls->ts, b->last);
+            b->last = ngx_http_eflv_ts_pmt(&hls->ts, b->last);
+            hls->tables = 1;
+        }
+
+        while (hls->pes.pos < hls->pes.last
+               && b->end - b->last >= NGX_HTTP_EFLV_TS_PACKET)
+        {
+            b->last = ngx_http_eflv_ts_packet(&hls->ts, &hls->pes, b->last);
+        }
+
+        if (b->end - b->last < NGX_HTTP_EFLV_TS_PACKET) {
+            if (ngx_http_eflv_hls_output(r, hls, 0) == NGX_ERROR) {
+                return NGX_ERROR;
+            }
+
+            continue;
+        }
+
+        rc = ngx_http_eflv_hls_read_tag(r, ctx, &tag);
+
+        if (rc == NGX_AGAIN) {
+            r->main->count++;
+            return NGX_DONE;
+        }
+
+        if (rc == NGX_DONE) {
+            return ngx_http_eflv_hls_output(r, hls, 1);
+        }
+
+        if (rc != NGX_OK) {
+            return NGX_ERROR;
+        }
+
+        size = ngx_http_eflv_ts_payload_bound(&hls->ts,
+                                          ngx_flv_get_24value(tag->datasize));
+
+        if (size > hls->payload_size) {
+            if (hls->payload) {
+                ngx_pfree(r->pool, hls->payload);
+            }
+
+            size = ngx_max(size, 2 * hls->payload_size);
+
+            hls->payload = ngx_pnalloc(r->pool, size);
+            if (hls->payload == NULL) {
+                return NGX_ERROR;
+            }
+
+            hls->payload_size = size;
+        }
+
+        (void) ngx_http_eflv_ts_pes(&hls->ts, tag, hls->payload, &hls->pes);
+    }
+}
+
+
+static ngx_int_t
+ngx_http_eflv_hls_segment(ngx_http_request_t *r, ngx_http_eflv_ctx_t *ctx)
+{
+    double                  start, end;
+    ngx_int_t               rc;
+    ngx_http_eflv_hls_t    *hls;
+    ngx_http_eflv_clip_t    clip;
+    ngx_http_eflv_index_t  *index;
+
+    index = &ctx->index;
+
+    start = sizeof(ngx_flv_header) - 1;
+    end = ctx->of.size;
+
+    if (ctx->have_kf && index->keyframes) {
+        ngx_memzero(&clip, sizeof(ngx_http_eflv_clip_t));
+
+        if (ngx_http_eflv_keyframe_position(index, ctx->kf_start,
+                                            ctx->kf_end, ctx->have_kf_end,
+                                            &start, &end, ctx->of.size,
+                                            &clip)
+            == -1)
+        {
+            ngx_log_error(NGX_LOG_INFO, r->connection->log, 0,
+                          "keyframes %ui-%ui are out of the index of \"%V\"",
+                          ctx->kf_start, ctx->kf_end, &ctx->path);
+            ngx_http_eflv_stat(seek_failures, 1);
+            return NGX_HTTP_BAD_REQUEST;
+        }
+
+        ctx->clip = clip;
+        ctx->resolved = 1;
+    }
+
+    hls = ngx_pcalloc(r->pool, sizeof(ngx_http_eflv_hls_t));
+    if (hls == NULL) {
+        return NGX_HTTP_INTERNAL_SERVER_ERROR;
+    }
+
+    if (ngx_http_eflv_hls_codecs(r, ctx, &hls->ts) != NGX_OK) {
+        return NGX_HTTP_UNSUPPORTED_MEDIA_TYPE;
+    }
+
+    hls->in = ngx_create_temp_buf(r->pool, NGX_FLV_SCAN_STEP);
+    if (hls->in == NULL) {
+        return NGX_HTTP_INTERNAL_SERVER_ERROR;
+    }
+
+    hls->offset = (off_t) start;
+    hls->end = (off_t) end;
+
+    ctx->hls = hls;
+
+    ctx->slice_start = (off_t) start;
+    ctx->slice_end = (off_t) end;
+    ctx->sliced = 1;
+
+    r->connection->log->action = "sending hls segment to client";
+
+    r->headers_out.status = NGX_HTTP_OK;
+    r->headers_out.content_length_n = -1;
+    r->headers_out.last_modified_time = ctx->of.mtime;
+
+    ngx_str_set(&r->headers_out.content_type, "video/mp2t");
+    r->headers_out.content_type_len = r->headers_out.content_type.len;
+
+    rc = ngx_http_send_header(r);
+    if (rc == NGX_ERROR || rc > NGX_OK || r->header_only) {
+        return rc;
+    }
+
+    ctx->send = ngx_http_eflv_hls_send;
+    r->write_event_handler = ngx_http_eflv_write_handler;
+
+    return ngx_http_eflv_hls_send(r, ctx);
+}
+
+
+static ngx_int_t
+ngx_http_tflv_handler(ngx_http_request_t *r)
+{
+    double                     start, end, len;
+    ngx_int_t                  rc, i_have_start, i_have_end;
+    ngx_str_t                  value;
+    ngx_http_eflv_ctx_t       *ctx;
+    ngx_http_eflv_loc_conf_t  *elcf;
+
+    if (!(r->method & (NGX_HTTP_GET|NGX_HTTP_HEAD))) {
+        return NGX_HTTP_NOT_ALLOWED;
+    }
+
+    if (r->uri.data[r->uri.len - 1] == '/') {
+        return NGX_DECLINED;
+    }
+
+    rc = ngx_http_discard_request_body(r);
+
+    if (rc != NGX_OK) {
+        return rc;
+    }
+
+    ngx_http_eflv_stat(tflv_requests, 1);
+
+    ctx = ngx_pcalloc(r->pool, sizeof(ngx_http_eflv_ctx_t));
+    if (ctx == NULL) {
+        return NGX_HTTP_INTERNAL_SERVER_ERROR;
+    }
+
+    ngx_http_set_ctx(r, ctx, ngx_http_eflv_module);
+
+    rc = ngx_http_eflv_open_file(r, ctx);
+
+    if (rc != NGX_OK) {
+        return rc;
+    }
+
+    start = 0;
+    len = ctx->of.size;
+    i_have_start = 0;
+    i_have_end = 0;
+
+    if (ngx_http_arg(r, (u_char *) "kf", 2, &value) == NGX_OK) {
+        if (ngx_http_eflv_parse_kf(ctx, &value) != NGX_OK) {
+            return NGX_HTTP_BAD_REQUEST;
+        }
+    }
+
+    if (ngx_http_arg(r, (u_char *) "start", 5, &value) == NGX_OK) {
+
+        i_have_start = 1;
+
+        start = ngx_atoint(value.data, value.len);
+
+        if (start > len) {
+            return NGX_DECLINED;
+        }
+
+        if (start == NGX_ERROR) {
+            start = 0;
+        }
+    }
+
+    end = len;
+    if (ngx_http_arg(r, (u_char *) "end", 3, &value) == NGX_OK) {
+        i_have_end = 1;
+
+        end = ngx_atoint(value.data, value.len);
+        if (end == NGX_ERROR || (end > len)) {
+            i_have_end = 0;
+            end = len;
+        }
+    }
+
+    ctx->start = start;
+    ctx->end = end;
+    ctx->have_end = i_have_end;
+    ctx->have_time = (i_have_start || i_have_end);
+    ctx->send = ngx_http_tflv_send;
+    ctx->need_index = 1;
+
+    elcf = ngx_http_get_module_loc_conf(r, ngx_http_eflv_module);
+
+    if (elcf->hls
+        && ngx_http_arg(r, (u_char *) "hls", 3, &value) == NGX_OK)
+    {
+        if (value.len == 4 && ngx_strncmp(value.data, "m3u8", 4) == 0) {
+            ctx->send = ngx_http_eflv_hls_playlist;
+
+        } else if (value.len == 2 && ngx_strncmp(value.data, "ts", 2) == 0) {
+            ctx->send = ngx_http_eflv_hls_segment;
+
+        } else {
+            return NGX_HTTP_BAD_REQUEST;
+        }
+    }
+
+    return ngx_http_eflv_process(r);
+}
+
+
+#define NGX_HTTP_EFLV_STATUS_LEN  8192
+
+
+static u_char *
+ngx_http_eflv_status_hist(u_char *p, u_char *last, char *name,
+    ngx_http_eflv_hist_t *hist, ngx_uint_t format)
+{
+    ngx_uint_t         i;
+    ngx_atomic_uint_t  count, sum;
+
+    count = 0;
+    sum = hist->sum;
+
+    if (format == NGX_HTTP_EFLV_STATUS_JSON) {
+        p = ngx_slprintf(p, last, ",\"%s\":{\"le\":{", name);
+    } else {
+        p = ngx_slprintf(p, last, "# TYPE eflv_%s_seconds histogram\n",
+                         name);
+    }
+
+    /* the buckets are cumulative, as in Prometheus */
+
+    for (i = 0; i < NGX_HTTP_EFLV_HIST_BUCKETS; i++) {
+        count += hist->count[i];
+
+        if (format == NGX_HTTP_EFLV_STATUS_JSON) {
+            p = ngx_slprintf(p, last, "%s\"%V\":%uA", i ? "," : "",
+                             &ngx_http_eflv_hist_labels[i], count);
+        } else {
+            p = ngx_slprintf(p, last,
+                             "eflv_%s_seconds_bucket{le=\"%V\"} %uA\n",
+                             name, &ngx_http_eflv_hist_labels[i], count);
+        }
+    }
+
+    if (format == NGX_HTTP_EFLV_STATUS_JSON) {
+        return ngx_slprintf(p, last, "},\"sum_usec\":%uA,\"count\":%uA}",
+                            sum, count);
+    }
+
+    return ngx_slprintf(p, last, "eflv_%s_seconds_sum %uA.%06uA\n"
+                        "eflv_%s_seconds_count %uA\n",
+                        name, sum / 1000000, sum % 1000000, name, count);
+}
+
+
+static ngx_int_t
+ngx_http_eflv_status_handler(ngx_http_request_t *r)
+{
+    u_char                    *last;
+    ngx_int_t                  rc;
+    ngx_buf_t                 *b;
+    ngx_chain_t                out;
+    ngx_http_eflv_stats_t     *st;
+    ngx_http_eflv_loc_conf_t  *elcf;
+
+    if (!(r->method & (NGX_HTTP_GET|NGX_HTTP_HEAD))) {
+        return NGX_HTTP_NOT_ALLOWED;
+    }
+
+    rc = ngx_http_discard_request_body(r);
+
+    if (rc != NGX_OK) {
+        return rc;
+    }
+
+    st = ngx_http_eflv_stats;
+
+    if (st == NULL) {
+        return NGX_HTTP_INTERNAL_SERVER_ERROR;
+    }
+
+    elcf = ngx_http_get_module_loc_conf(r, ngx_http_eflv_module);
+
+    if (elcf->status_format == NGX_HTTP_EFLV_STATUS_JSON) {
+        ngx_str_set(&r->headers_out.content_type, "application/json");
+
+    } else {
+        ngx_str_set(&r->headers_out.content_type,
+                    "text/plain; version=0.0.4");
+    }
+
+    r->headers_out.content_type_len = r->headers_out.content_type.len;
+
+    b = ngx_create_temp_buf(r->pool, NGX_HTTP_EFLV_STATUS_LEN);
+    if (b == NULL) {
+        return NGX_HTTP_INTERNAL_SERVER_ERROR;
+    }
+
+    last = b->end;
+
+    if (elcf->status_format == NGX_HTTP_EFLV_STATUS_JSON) {
+        b->last = ngx_slprintf(b->last, last,
+                          "{\"requests\":{\"tflv\":%uA,\"sflv\":%uA},"
+                          "\"seek_failures\":%uA,"
+                          "\"index_cache\":{\"hits\":%uA,\"misses\":%uA,"
+                          "\"evictions\":%uA,\"lock_waits\":%uA,"
+                          "\"lock_timeouts\":%uA},"
+                          "\"index_files\":%uA,\"index_generated\":%uA,"
+                          "\"bytes\":{\"memory\":%uA,\"file\":%uA}",
+                          st->tflv_requests, st->sflv_requests,
+                          st->seek_failures, st->cache_hits,
+                          st->cache_misses, st->cache_evictions,
+                          st->cache_lock_waits, st->cache_lock_timeouts,
+                          st->index_files, st->index_generated,
+                          st->memory_bytes, st->file_bytes);
+
+    } else {
+        b->last = ngx_slprintf(b->last, last,
+                          "# TYPE eflv_requests_total counter\n"
+                          "eflv_requests_total{mode=\"tflv\"} %uA\n"
+                          "eflv_requests_total{mode=\"sflv\"} %uA\n"
+                          "# TYPE eflv_seek_failures_total counter\n"
+                          "eflv_seek_failures_total %uA\n"
+                          "# TYPE eflv_index_cache_hits_total counter\n"
+                          "eflv_index_cache_hits_total %uA\n"
+                          "# TYPE eflv_index_cache_misses_total counter\n"
+                          "eflv_index_cache_misses_total %uA\n"
+                          "# TYPE eflv_index_cache_evictions_total counter\n"
+                          "eflv_index_cache_evictions_total %uA\n"
+                          "# TYPE eflv_index_cache_lock_waits_total counter\n"
+                          "eflv_index_cache_lock_waits_total %uA\n"
+                          "# TYPE eflv_index_cache_lock_timeouts_total "
+                          "counter\n"
+                          "eflv_index_cache_lock_timeouts_total %uA\n"
+                          "# TYPE eflv_index_files_total counter\n"
+                          "eflv_index_files_total %uA\n"
+                          "# TYPE eflv_index_generated_total counter\n"
+                          "eflv_index_generated_total %uA\n"
+                          "# TYPE eflv_sent_bytes_total counter\n"
+                          "eflv_sent_bytes_total{source=\"memory\"} %uA\n"
+                          "eflv_sent_bytes_total{source=\"file\"} %uA\n",
+                          st->tflv_requests, st->sflv_requests,
+                          st->seek_failures, st->cache_hits,
+                          st->cache_misses, st->cache_evictions,
+                          st->cache_lock_waits, st->cache_lock_timeouts,
+                          st->index_files, st->index_generated,
+                          st->memory_bytes, st->file_bytes);
+    }
+
+    b->last = ngx_http_eflv_status_hist(b->last, last, "index_read",
+                                        &st->index_time, elcf->status_format);
+    b->last = ngx_http_eflv_status_hist(b->last, last, "seek",
+                                        &st->seek_time, elcf->status_format);
+
+    if (elcf->status_format == NGX_HTTP_EFLV_STATUS_JSON) {
+        b->last = ngx_slprintf(b->last, last, "}\n");
+    }
+
+    b->last_buf = (r == r->main) ? 1 : 0;
+    b->last_in_chain = 1;
+
+    out.buf = b;
+    out.next = NULL;
 
-    clcf = ngx_http_get_module_loc_conf(r, ngx_http_core_module);
+    r->headers_out.status = NGX_HTTP_OK;
+    r->headers_out.content_length_n = b->last - b->pos;
 
-    ngx_memzero(&of, sizeof(ngx_open_file_info_t));
+    rc = ngx_http_send_header(r);
 
-    of.read_ahead = clcf->read_ahead;
-    of.directio = clcf->directio;
-    of.valid = clcf->open_file_cache_valid;
-    of.min_uses = clcf->open_file_cache_min_uses;
-    of.errors = clcf->open_file_cache_errors;
-    of.events = clcf->open_file_cache_events;
+    if (rc == NGX_ERROR || rc > NGX_OK || r->header_only) {
+        return rc;
+    }
 
-    if (ngx_open_cached_file(clcf->open_file_cache, &path, &of, r->pool)
-        != NGX_OK)
-    {
-        switch (of.err) {
+    return ngx_http_output_filter(r, &out);
+}
 
-        case 0:
-            return NGX_HTTP_INTERNAL_SERVER_ERROR;
 
-        case NGX_ENOENT:
-        case NGX_ENOTDIR:
-        case NGX_ENAMETOOLONG:
+static char *
+ngx_http_tflv(ngx_conf_t *cf, ngx_command_t *cmd, void *conf)
+{
+    ngx_http_core_loc_conf_t  *clcf;
 
-            level = NGX_LOG_ERR;
-            rc = NGX_HTTP_NOT_FOUND;
-            break;
+    clcf = ngx_http_conf_get_module_loc_conf(cf, ngx_http_core_module);
+    clcf->handler = ngx_http_tflv_handler;
 
-        case NGX_EACCES:
+    return NGX_CONF_OK;
+}
 
-            level = NGX_LOG_ERR;
-            rc = NGX_HTTP_FORBIDDEN;
-            break;
 
-        default:
+static char *
+ngx_http_sflv(ngx_conf_t *cf, ngx_command_t *cmd, void *conf)
+{
+    ngx_http_core_loc_conf_t  *clcf;
 
-            level = NGX_LOG_CRIT;
-            rc = NGX_HTTP_INTERNAL_SERVER_ERROR;
-            break;
-        }
+    clcf = ngx_http_conf_get_module_loc_conf(cf, ngx_http_core_module);
+    clcf->handler = ngx_http_sflv_handler;
 
-        if (rc != NGX_HTTP_NOT_FOUND || clcf->log_not_found) {
-            ngx_log_error(level, log, of.err,
-                          "%s \"%s\" failed", of.failed, path.data);
-        }
+    return NGX_CONF_OK;
+}
 
 
-        return rc;
+static char *
+ngx_http_eflv_limit_rate(ngx_conf_t *cf, ngx_command_t *cmd, void *conf)
+{
+    ngx_http_eflv_loc_conf_t *elcf = conf;
+
+    ngx_int_t   n;
+    ngx_str_t  *value;
+
+    if (elcf->limit_rate != NGX_CONF_UNSET_UINT) {
+        return "is duplicate";
     }
 
-    if (!of.is_file) {
+    value = cf->args->elts;
 
-        if (ngx_close_file(of.fd) == NGX_FILE_ERROR) {
-            ngx_log_error(NGX_LOG_ALERT, log, ngx_errno,
-                          ngx_close_file_n " \"%s\" failed", path.data);
+    if (ngx_strcmp(value[1].data, "off") == 0) {
+        elcf->limit_rate = 0;
+        return NGX_CONF_OK;
+    }
+
+    n = ngx_atofp(value[1].data, value[1].len, 2);
+    if (n == NGX_ERROR || n == 0) {
+        ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
+                           "invalid factor \"%V\"", &value[1]);
+        return NGX_CONF_ERROR;
+    }
+
+    elcf->limit_rate = n;
+
+    return NGX_CONF_OK;
+}
+
+
+static ngx_int_t
+ngx_http_eflv_add_variables(ngx_conf_t *cf)
+{
+    ngx_http_variable_t  *var, *v;
+
+    for (v = ngx_http_eflv_vars; v->name.len; v++) {
+        var = ngx_http_add_variable(cf, &v->name, v->flags);
+        if (var == NULL) {
+            return NGX_ERROR;
         }
 
-        return NGX_DECLINED;
+        var->get_handler = v->get_handler;
+        var->data = v->data;
     }
 
-    r->root_tested = !r->error_page;
+    return NGX_OK;
+}
 
-    start = 0;
-    len = of.size;
-    i = 0;
-    j = 0;
 
-        if (ngx_http_arg(r, (u_char *) "start", 5, &value) == NGX_OK) {
+static ngx_int_t
+ngx_http_eflv_keyframes_variable(ngx_http_request_t *r,
+    ngx_http_variable_value_t *v, uintptr_t data)
+{
+    u_char               *p;
+    ngx_http_eflv_ctx_t  *ctx;
 
-            i_have_start = 1;
+    ctx = ngx_http_get_module_ctx(r, ngx_http_eflv_module);
 
-            start = ngx_atoint(value.data, value.len);
+    if (ctx == NULL || !ctx->resolved) {
+        v->not_found = 1;
+        return NGX_OK;
+    }
 
-            if (start > len){
-                return NGX_DECLINED;
-            }
+    p = ngx_pnalloc(r->pool, 2 * NGX_INT_T_LEN + 1);
+    if (p == NULL) {
+        return NGX_ERROR;
+    }
 
-            if (start == NGX_ERROR) {
-                start = 0;
-            }
+    v->len = ngx_http_eflv_format_keyframes(p, ctx) - p;
+    v->valid = 1;
+    v->no_cacheable = 0;
+    v->not_found = 0;
+    v->data = p;
 
-        }
+    return NGX_OK;
+}
 
 
-        end = len;
-        if (ngx_http_arg(r, (u_char *) "end", 3, &value) == NGX_OK) {
-            i_have_end = 1;
+static char *
+ngx_http_eflv_status(ngx_conf_t *cf, ngx_command_t *cmd, void *conf)
+{
+    ngx_http_eflv_loc_conf_t *elcf = conf;
 
-            end = ngx_atoint(value.data, value.len);
-            if (end == NGX_ERROR || (end > len)) {
-                i_have_end = 0;
-                end = len;
-            }
-        }
+    ngx_str_t                 *value, name;
+    ngx_shm_zone_t            *shm_zone;
+    ngx_http_core_loc_conf_t  *clcf;
 
-        if ((0 == i_have_start) && (0 == i_have_end)){
-        }
+    value = cf->args->elts;
 
-        ngx_int_t meta_size = ntx_http_eflv_metadata(of.fd,&start,&end,i_have_end,len,send_metadata_buf,send_tH264VideoTag_buf,send_tH264AudioTag_buf,&video_size,&audio_size, r);
+    if (cf->args->nelts == 1 || ngx_strcmp(value[1].data, "json") == 0) {
+        elcf->status_format = NGX_HTTP_EFLV_STATUS_JSON;
 
-        log->action = "sending tflv to client";
-        r->headers_out.status = NGX_HTTP_OK;
-        r->headers_out.last_modified_time = of.mtime;
-        if (ngx_http_set_content_type(r) != NGX_OK) {
-                return NGX_HTTP_INTERNAL_SERVER_ERROR;
-        }
+    } else if (ngx_strcmp(value[1].data, "prometheus") == 0) {
+        elcf->status_format = NGX_HTTP_EFLV_STATUS_PROMETHEUS;
 
-        b = ngx_pcalloc(r->pool, sizeof(ngx_buf_t));
-        if (b == NULL) {
-                return NGX_HTTP_INTERNAL_SERVER_ERROR;
+    } else {
+        ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
+                           "invalid format \"%V\"", &value[1]);
+        return NGX_CONF_ERROR;
+    }
+
+    /* all "eflv_status" locations share the zone */
+
+    ngx_str_set(&name, "eflv_status");
+
+    shm_zone = ngx_shared_memory_add(cf, &name, 8 * ngx_pagesize,
+                                     &ngx_http_eflv_module);
+    if (shm_zone == NULL) {
+        return NGX_CONF_ERROR;
+    }
+
+    shm_zone->init = ngx_http_eflv_init_status_zone;
+
+    clcf = ngx_http_conf_get_module_loc_conf(cf, ngx_http_core_module);
+    clcf->handler = ngx_http_eflv_status_handler;
+
+    return NGX_CONF_OK;
+}
+
+
+static ngx_int_t
+ngx_http_eflv_init(ngx_conf_t *cf)
+{
+    /* the zone of the previous cycle may be gone */
+
+    ngx_http_eflv_stats = NULL;
+
+    return NGX_OK;
+}
+
+
+static ngx_int_t
+ngx_http_eflv_init_status_zone(ngx_shm_zone_t *shm_zone, void *data)
+{
+    ngx_slab_pool_t  *shpool;
+
+    if (data) {
+        shm_zone->data = data;
+        ngx_http_eflv_stats = data;
+        return NGX_OK;
+    }
+
+    shpool = (ngx_slab_pool_t *) shm_zone->shm.addr;
+
+    if (shm_zone->shm.exists) {
+        shm_zone->data = shpool->data;
+        ngx_http_eflv_stats = shpool->data;
+        return NGX_OK;
+    }
+
+    ngx_http_eflv_stats = ngx_slab_alloc(shpool,
+                                         sizeof(ngx_http_eflv_stats_t));
+    if (ngx_http_eflv_stats == NULL) {
+        return NGX_ERROR;
+    }
+
+    ngx_memzero(ngx_http_eflv_stats, sizeof(ngx_http_eflv_stats_t));
+
+    shpool->data = ngx_http_eflv_stats;
+    shm_zone->data = ngx_http_eflv_stats;
+
+    return NGX_OK;
+}
+
+
+static ngx_int_t
+ngx_http_eflv_variable(ngx_http_request_t *r, ngx_http_variable_value_t *v,
+    uintptr_t data)
+{
+    u_char               *p;
+    ngx_http_eflv_ctx_t  *ctx;
+
+    ctx = ngx_http_get_module_ctx(r, ngx_http_eflv_module);
+
+    if (ctx == NULL) {
+        v->not_found = 1;
+        return NGX_OK;
+    }
+
+    if (data == NGX_HTTP_EFLV_VAR_INDEX_SOURCE) {
+
+        if (ctx->index_source == 0) {
+            v->not_found = 1;
+            return NGX_OK;
         }
 
-        b->pos = ngx_flv_header;
-        b->last = ngx_flv_header + sizeof(ngx_flv_header) - 1;
-        b->memory = 1;
+        v->len = ngx_http_eflv_index_sources[ctx->index_source].len;
+        v->valid = 1;
+        v->no_cacheable = 0;
+        v->not_found = 0;
+        v->data = ngx_http_eflv_index_sources[ctx->index_source].data;
 
-        out[j].buf = b;
-        out[j].next = &out[j+1];
-        j++;
+        return NGX_OK;
+    }
 
-        b = ngx_pcalloc(r->pool, sizeof(ngx_buf_t));
-        b->pos = (u_char*)send_metadata_buf;
-        b->last = (u_char*)(send_metadata_buf + meta_size);
-        b->memory = 1;
-        out[j].buf = b;
-        out[j].next = &out[j+1];
-        j++;
+    p = ngx_pnalloc(r->pool, NGX_OFF_T_LEN + 5);
+    if (p == NULL) {
+        return NGX_ERROR;
+    }
+
+    v->data = p;
+
+    switch (data) {
 
-        if (video_size !=0){
-                b = ngx_pcalloc(r->pool, sizeof(ngx_buf_t));
-                b->pos = (u_char*)send_tH264VideoTag_buf;
-                b->last = (u_char*)(send_tH264VideoTag_buf + video_size);
-                b->memory = 1;
-                out[j].buf = b;
-                out[j].next = &out[j+1];
-                j++;
+    case NGX_HTTP_EFLV_VAR_START_OFFSET:
+    case NGX_HTTP_EFLV_VAR_END_OFFSET:
+
+        if (!ctx->sliced) {
+            goto not_found;
         }
 
-        if (audio_size !=0){
-                b = ngx_pcalloc(r->pool, sizeof(ngx_buf_t));
-                b->pos = (u_char*)send_tH264AudioTag_buf;
-                b->last = (u_char*)(send_tH264AudioTag_buf + audio_size);
-                b->memory = 1;
-                out[j].buf = b;
-                out[j].next = &out[j+1];
-                j++;
+        p = ngx_sprintf(p, "%O", (data == NGX_HTTP_EFLV_VAR_START_OFFSET)
+                                 ? ctx->slice_start : ctx->slice_end);
+        break;
+
+    case NGX_HTTP_EFLV_VAR_KEYFRAME_INDEX:
+
+        if (!ctx->resolved) {
+            goto not_found;
         }
 
-        r->headers_out.content_length_n =sizeof(ngx_flv_header) - 1 + meta_size + end -start + video_size + audio_size;
+        p = ngx_sprintf(p, "%ui", ctx->clip.start_index);
+        break;
 
-        b = ngx_pcalloc(r->pool, sizeof(ngx_buf_t));
-        if (b == NULL) {
-                return NGX_HTTP_INTERNAL_SERVER_ERROR;
+    case NGX_HTTP_EFLV_VAR_CLIP_DURATION:
+
+        if (!ctx->resolved) {
+            goto not_found;
         }
 
-        b->file = ngx_pcalloc(r->pool, sizeof(ngx_file_t));
-        if (b->file == NULL) {
-                return NGX_HTTP_INTERNAL_SERVER_ERROR;
+        p = ngx_sprintf(p, "%.3f", ctx->clip.duration);
+        break;
+
+    case NGX_HTTP_EFLV_VAR_INDEX_USEC:
+
+        if (ctx->index_source == 0) {
+            goto not_found;
         }
 
-        r->allow_ranges = 1;
-        rc = ngx_http_send_header(r);
-        if (rc == NGX_ERROR || rc > NGX_OK || r->header_only) {
-                return rc;
+        p = ngx_sprintf(p, "%uL", ctx->index_usec);
+        break;
+
+    default: /* NGX_HTTP_EFLV_VAR_RESOLVE_USEC */
+
+        if (!ctx->resolved) {
+            goto not_found;
         }
 
-        b->file_pos = (off_t)start;
-        b->file_last = (off_t)end;
+        p = ngx_sprintf(p, "%uL", ctx->resolve_usec);
+        break;
+    }
 
-        b->in_file = b->file_last ? 1: 0;
-        b->last_buf = 1;
-        b->last_in_chain = 1;
+    v->len = p - v->data;
+    v->valid = 1;
+    v->no_cacheable = 0;
+    v->not_found = 0;
 
-        b->file->fd = of.fd;
-        b->file->name = path;
-        b->file->log = log;
-        b->file->directio = of.is_directio;
+    return NGX_OK;
 
-        out[j].buf = b;
-        out[j].next = NULL;
+not_found:
+
+    v->not_found = 1;
+
+    return NGX_OK;
+}
+
+
+static ngx_int_t
+ngx_http_eflv_init_zone(ngx_shm_zone_t *shm_zone, void *data)
+{
+    ngx_http_eflv_cache_t  *ocache = data;
+
+    size_t                  len;
+    ngx_http_eflv_cache_t  *cache;
+
+    cache = shm_zone->data;
+
+    if (ocache) {
+        cache->sh = ocache->sh;
+        cache->shpool = ocache->shpool;
+        return NGX_OK;
+    }
 
-        return ngx_http_output_filter(r, &out[i]);
+    cache->shpool = (ngx_slab_pool_t *) shm_zone->shm.addr;
+
+    if (shm_zone->shm.exists) {
+        cache->sh = cache->shpool->data;
+        return NGX_OK;
+    }
+
+    cache->sh = ngx_slab_alloc(cache->shpool, sizeof(ngx_http_eflv_cache_sh_t));
+    if (cache->sh == NULL) {
+        return NGX_ERROR;
+    }
+
+    cache->shpool->data = cache->sh;
+
+    ngx_rbtree_init(&cache->sh->rbtree, &cache->sh->sentinel,
+                    ngx_str_rbtree_insert_value);
+
+    ngx_queue_init(&cache->sh->queue);
+
+    cache->sh->lock = 0;
+
+    len = sizeof(" in eflv index cache zone \"\"") + shm_zone->shm.name.len;
+
+    cache->shpool->log_ctx = ngx_slab_alloc(cache->shpool, len);
+    if (cache->shpool->log_ctx == NULL) {
+        return NGX_ERROR;
+    }
+
+    ngx_sprintf(cache->shpool->log_ctx, " in eflv index cache zone \"%V\"%Z",
+                &shm_zone->shm.name);
+
+    cache->shpool->log_nomem = 0;
+
+    return NGX_OK;
+}
+
+
+static void *
+ngx_http_eflv_create_loc_conf(ngx_conf_t *cf)
+{
+    ngx_http_eflv_loc_conf_t  *conf;
+
+    conf = ngx_pcalloc(cf->pool, sizeof(ngx_http_eflv_loc_conf_t));
+    if (conf == NULL) {
+        return NULL;
+    }
+
+    conf->cache_zone = NGX_CONF_UNSET_PTR;
+    conf->cache_lock = NGX_CONF_UNSET;
+    conf->cache_lock_timeout = NGX_CONF_UNSET_MSEC;
+    conf->index_generate = NGX_CONF_UNSET;
+    conf->index_file = NGX_CONF_UNSET;
+    conf->rebase_timestamps = NGX_CONF_UNSET;
+    conf->canonical_redirect = NGX_CONF_UNSET;
+    conf->snap = NGX_CONF_UNSET_UINT;
+    conf->follow = NGX_CONF_UNSET;
+    conf->follow_interval = NGX_CONF_UNSET_MSEC;
+    conf->follow_timeout = NGX_CONF_UNSET_MSEC;
+    conf->hls = NGX_CONF_UNSET;
+    conf->hls_fragment = NGX_CONF_UNSET_MSEC;
+    conf->limit_rate = NGX_CONF_UNSET_UINT;
+    conf->limit_rate_after = NGX_CONF_UNSET;
+
+    return conf;
 }
 
 
 static char *
-ngx_http_tflv(ngx_conf_t *cf, ngx_command_t *cmd, void *conf)
+ngx_http_eflv_merge_loc_conf(ngx_conf_t *cf, void *parent, void *child)
 {
-    ngx_http_core_loc_conf_t  *clcf;
+    ngx_http_eflv_loc_conf_t *prev = parent;
+    ngx_http_eflv_loc_conf_t *conf = child;
+
+    ngx_conf_merge_ptr_value(conf->cache_zone, prev->cache_zone, NULL);
+    ngx_conf_merge_value(conf->cache_lock, prev->cache_lock, 0);
+    ngx_conf_merge_msec_value(conf->cache_lock_timeout,
+                              prev->cache_lock_timeout, 5000);
+    ngx_conf_merge_value(conf->index_generate, prev->index_generate, 1);
+    ngx_conf_merge_value(conf->index_file, prev->index_file, 0);
+    ngx_conf_merge_value(conf->rebase_timestamps, prev->rebase_timestamps, 0);
+    ngx_conf_merge_bufs_value(conf->rebase_bufs, prev->rebase_bufs,
+                              4, 64 * 1024);
+    ngx_conf_merge_value(conf->canonical_redirect, prev->canonical_redirect,
+                         0);
+    ngx_conf_merge_uint_value(conf->snap, prev->snap,
+                              NGX_HTTP_EFLV_SNAP_OFF);
+    ngx_conf_merge_value(conf->follow, prev->follow, 0);
+    ngx_conf_merge_msec_value(conf->follow_interval, prev->follow_interval,
+                              1000);
+    ngx_conf_merge_msec_value(conf->follow_timeout, prev->follow_timeout,
+                              30000);
+    ngx_conf_merge_value(conf->hls, prev->hls, 0);
+    ngx_conf_merge_msec_value(conf->hls_fragment, prev->hls_fragment, 5000);
+    ngx_conf_merge_uint_value(conf->limit_rate, prev->limit_rate, 0);
+    ngx_conf_merge_value(conf->limit_rate_after, prev->limit_rate_after, 60);
+
+    if (conf->rebase_bufs.size < sizeof(ngx_flv_tag_t)) {
+        ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
+                           "\"eflv_rebase_buffers\" size is too small");
+        return NGX_CONF_ERROR;
+    }
+
+    return NGX_CONF_OK;
+}
 
-    clcf = ngx_http_conf_get_module_loc_conf(cf, ngx_http_core_module);
-    clcf->handler = ngx_http_tflv_handler;
+
+static char *
+ngx_http_eflv_index_cache_zone(ngx_conf_t *cf, ngx_command_t *cmd, void *conf)
+{
+    u_char                 *p;
+    ssize_t                 size;
+    ngx_str_t              *value, name, s;
+    ngx_shm_zone_t         *shm_zone;
+    ngx_http_eflv_cache_t  *cache;
+
+    value = cf->args->elts;
+
+    p = (u_char *) ngx_strchr(value[1].data, ':');
+
+    if (p == NULL || p == value[1].data) {
+        ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
+                           "invalid zone \"%V\"", &value[1]);
+        return NGX_CONF_ERROR;
+    }
+
+    name.data = value[1].data;
+    name.len = p - value[1].data;
+
+    s.data = p + 1;
+    s.len = value[1].data + value[1].len - s.data;
+
+    size = ngx_parse_size(&s);
+
+    if (size == NGX_ERROR) {
+        ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
+                           "invalid zone size \"%V\"", &value[1]);
+        return NGX_CONF_ERROR;
+    }
+
+    if (size < (ssize_t) (8 * ngx_pagesize)) {
+        ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
+                           "zone \"%V\" is too small", &value[1]);
+        return NGX_CONF_ERROR;
+    }
+
+    cache = ngx_pcalloc(cf->pool, sizeof(ngx_http_eflv_cache_t));
+    if (cache == NULL) {
+        return NGX_CONF_ERROR;
+    }
+
+    shm_zone = ngx_shared_memory_add(cf, &name, size, &ngx_http_eflv_module);
+    if (shm_zone == NULL) {
+        return NGX_CONF_ERROR;
+    }
+
+    if (shm_zone->data) {
+        ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
+                           "duplicate zone \"%V\"", &name);
+        return NGX_CONF_ERROR;
+    }
+
+    shm_zone->init = ngx_http_eflv_init_zone;
+    shm_zone->data = cache;
 
     return NGX_CONF_OK;
 }
 
 
 static char *
-ngx_http_sflv(ngx_conf_t *cf, ngx_command_t *cmd, void *conf)
+ngx_http_eflv_index_cache(ngx_conf_t *cf, ngx_command_t *cmd, void *conf)
 {
-    ngx_http_core_loc_conf_t  *clcf;
+    ngx_http_eflv_loc_conf_t *elcf = conf;
 
-    clcf = ngx_http_conf_get_module_loc_conf(cf, ngx_http_core_module);
-    clcf->handler = ngx_http_sflv_handler;
+    ngx_str_t  *value;
+
+    if (elcf->cache_zone != NGX_CONF_UNSET_PTR) {
+        return "is duplicate";
+    }
+
+    value = cf->args->elts;
+
+    if (ngx_strcmp(value[1].data, "off") == 0) {
+        elcf->cache_zone = NULL;
+        return NGX_CONF_OK;
+    }
+
+    elcf->cache_zone = ngx_shared_memory_add(cf, &value[1], 0,
+                                             &ngx_http_eflv_module);
+    if (elcf->cache_zone == NULL) {
+        return NGX_CONF_ERROR;
+    }
 
     return NGX_CONF_OK;
 }
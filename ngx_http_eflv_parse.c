@@ -0,0 +1,392 @@
+
+/*
+ * Copyright (C) xunen <leixunen@gmail.com> and others.
+ * Copyright (C) Leevid Inc.
+ */
+
+
+#include <string.h>
+
+#include "ngx_http_eflv_parse.h"
+
+
+double
+ngx_flv_get_double(const u_char *p)
+{
+    double    value;
+    uint64_t  v;
+    size_t    i;
+
+    v = 0;
+
+    for (i = 0; i < 8; i++) {
+        v = (v << 8) | p[i];
+    }
+
+    memcpy(&value, &v, sizeof(double));
+
+    return value;
+}
+
+
+void
+ngx_flv_put_double(u_char *p, double value)
+{
+    uint64_t  v;
+    size_t    i;
+
+    memcpy(&v, &value, sizeof(double));
+
+    for (i = 8; i > 0; i--) {
+        p[i - 1] = (u_char) v;
+        v >>= 8;
+    }
+}
+
+
+/*
+ * a keyframe which is not an AVC sequence header, or the coded frames of
+ * an enhanced FLV keyframe; the video flags and the AVCPacketType have to
+ * follow the tag header
+ */
+
+int
+ngx_http_eflv_tag_keyframe(ngx_flv_tag_t *tag)
+{
+    u_char  *p;
+
+    if (tag->type != NGX_FLV_VIDEODATA) {
+        return 0;
+    }
+
+    p = (u_char *) tag + sizeof(ngx_flv_tag_t);
+
+    if (p[0] & NGX_FLV_VIDEO_EX_HEADER) {
+        return ((p[0] >> 4) & 0x7) == 1
+               && ((p[0] & 0xf) == NGX_FLV_EX_CODED_FRAMES
+                   || (p[0] & 0xf) == NGX_FLV_EX_CODED_FRAMES_X);
+    }
+
+    return (p[0] >> 4) == 1
+           && ((p[0] & 0xf) != NGX_FLV_AVCVIDEOPACKET || p[1] == 1);
+}
+
+
+/*
+ * the decoder configuration of the video: an AVC sequence header, or the
+ * sequence start of an enhanced FLV codec; the video flags and the
+ * AVCPacketType have to follow the tag header
+ */
+
+int
+ngx_http_eflv_tag_video_config(ngx_flv_tag_t *tag)
+{
+    u_char  *p;
+
+    if (tag->type != NGX_FLV_VIDEODATA) {
+        return 0;
+    }
+
+    p = (u_char *) tag + sizeof(ngx_flv_tag_t);
+
+    if (p[0] & NGX_FLV_VIDEO_EX_HEADER) {
+        return (p[0] & 0xf) == NGX_FLV_EX_SEQUENCE_START;
+    }
+
+    return (p[0] & 0xf) == NGX_FLV_AVCVIDEOPACKET && p[1] == 0;
+}
+
+
+/*
+ * an audio frame of any format, which is not an AAC sequence header; the
+ * sound flags and the AACPacketType have to follow the tag header
+ */
+
+int
+ngx_http_eflv_tag_audio_frame(ngx_flv_tag_t *tag)
+{
+    u_char  *p;
+
+    if (tag->type != NGX_FLV_AUDIODATA) {
+        return 0;
+    }
+
+    p = (u_char *) tag + sizeof(ngx_flv_tag_t);
+
+    return (p[0] >> 4) != NGX_FLV_AAC || p[1] == 1;
+}
+
+
+u_char *
+ngx_http_eflv_amf_skip(u_char *p, u_char *last, unsigned depth)
+{
+    size_t    len;
+    uint32_t  n;
+
+    if (p >= last || depth > NGX_FLV_AMF_MAX_DEPTH) {
+        return NULL;
+    }
+
+    switch (*p++) {
+
+    case NGX_FLV_AMF_NUMBER:
+        len = 8;
+        break;
+
+    case NGX_FLV_AMF_BOOLEAN:
+        len = 1;
+        break;
+
+    case NGX_FLV_AMF_STRING:
+        if (last - p < 2) {
+            return NULL;
+        }
+
+        len = 2 + ngx_flv_get_16value(p);
+        break;
+
+    case NGX_FLV_AMF_OBJECT:
+        return ngx_http_eflv_amf_skip_props(p, last, depth + 1);
+
+    case NGX_FLV_AMF_NULL:
+    case NGX_FLV_AMF_UNDEFINED:
+    case NGX_FLV_AMF_UNSUPPORTED:
+        len = 0;
+        break;
+
+    case NGX_FLV_AMF_REFERENCE:
+        len = 2;
+        break;
+
+    case NGX_FLV_AMF_ECMA_ARRAY:
+        if (last - p < 4) {
+            return NULL;
+        }
+
+        return ngx_http_eflv_amf_skip_props(p + 4, last, depth + 1);
+
+    case NGX_FLV_AMF_STRICT_ARRAY:
+        if (last - p < 4) {
+            return NULL;
+        }
+
+        n = ngx_flv_get_32value(p);
+        p += 4;
+
+        while (n--) {
+            p = ngx_http_eflv_amf_skip(p, last, depth + 1);
+            if (p == NULL) {
+                return NULL;
+            }
+        }
+
+        return p;
+
+    case NGX_FLV_AMF_DATE:
+        len = 10;
+        break;
+
+    case NGX_FLV_AMF_LONG_STRING:
+    case NGX_FLV_AMF_XML_DOCUMENT:
+        if (last - p < 4) {
+            return NULL;
+        }
+
+        len = 4 + (size_t) ngx_flv_get_32value(p);
+        break;
+
+    case NGX_FLV_AMF_TYPED_OBJECT:
+        if (last - p < 2) {
+            return NULL;
+        }
+
+        len = 2 + ngx_flv_get_16value(p);
+
+        if ((size_t) (last - p) < len) {
+            return NULL;
+        }
+
+        return ngx_http_eflv_amf_skip_props(p + len, last, depth + 1);
+
+    default:
+        return NULL;
+    }
+
+    if ((size_t) (last - p) < len) {
+        return NULL;
+    }
+
+    return p + len;
+}
+
+
+/*
+ * returns the value of the property at "p" and its name, or NULL at
+ * the object end marker
+ */
+
+u_char *
+ngx_http_eflv_amf_next_prop(u_char *p, u_char *last, u_char **name,
+    size_t *len)
+{
+    size_t  n;
+
+    if (last - p < 3) {
+        /* tolerate objects truncated right before the end marker */
+        return NULL;
+    }
+
+    n = ngx_flv_get_16value(p);
+    p += 2;
+
+    if (n == 0 && *p == NGX_FLV_AMF_OBJECT_END) {
+        return NULL;
+    }
+
+    if ((size_t) (last - p) < n + 1) {
+        return NULL;
+    }
+
+    *name = p;
+    *len = n;
+
+    return p + n;
+}
+
+
+u_char *
+ngx_http_eflv_amf_skip_props(u_char *p, u_char *last, unsigned depth)
+{
+    u_char  *v, *name;
+    size_t   len;
+
+    for ( ;; ) {
+        v = ngx_http_eflv_amf_next_prop(p, last, &name, &len);
+
+        if (v == NULL) {
+            break;
+        }
+
+        p = ngx_http_eflv_amf_skip(v, last, depth);
+        if (p == NULL) {
+            return NULL;
+        }
+    }
+
+    if (last - p >= 3) {
+        /* object end marker */
+        return p + 3;
+    }
+
+    return last;
+}
+
+
+/*
+ * returns the object or ECMA array marker of the onMetaData tag value,
+ * with "last" set to the end of the tag data
+ */
+
+u_char *
+ngx_http_eflv_amf_metadata(u_char *tag, size_t len, u_char **last)
+{
+    u_char  *p, *v;
+
+    if (len < sizeof(ngx_flv_tag_t) + 4) {
+        return NULL;
+    }
+
+    p = tag + sizeof(ngx_flv_tag_t);
+    *last = tag + len - 4;
+
+    /* "onMetaData" */
+
+    if (*p != NGX_FLV_AMF_STRING) {
+        return NULL;
+    }
+
+    v = ngx_http_eflv_amf_skip(p, *last, 0);
+    if (v == NULL || v == *last) {
+        return NULL;
+    }
+
+    if (*v == NGX_FLV_AMF_ECMA_ARRAY) {
+        return (*last - v >= 5) ? v : NULL;
+    }
+
+    return (*v == NGX_FLV_AMF_OBJECT) ? v : NULL;
+}
+
+
+/*
+ * returns the first element of the strict array at "p" and the number
+ * of elements that fit before "last" if all of them are numbers
+ */
+
+u_char *
+ngx_http_eflv_amf_array(u_char *p, u_char *last, size_t *n)
+{
+    size_t  len;
+
+    if (last - p < 5 || *p != NGX_FLV_AMF_STRICT_ARRAY) {
+        return NULL;
+    }
+
+    len = ngx_flv_get_32value(p + 1);
+    p += 5;
+
+    if (len > (size_t) (last - p) / 9) {
+        len = (size_t) (last - p) / 9;
+    }
+
+    *n = len;
+
+    return p;
+}
+
+
+/* reads up to the first element which is not a number */
+
+size_t
+ngx_http_eflv_amf_numbers(u_char *p, size_t n, double *values)
+{
+    size_t  i;
+
+    for (i = 0; i < n; i++, p += 9) {
+
+        if (*p != NGX_FLV_AMF_NUMBER) {
+            break;
+        }
+
+        values[i] = ngx_flv_get_double(p + 1);
+    }
+
+    return i;
+}
+
+
+/* the first of the sorted times at or after the value, searching from "from" */
+
+size_t
+ngx_http_eflv_lower_bound(double *times, size_t n, size_t from, double value)
+{
+    double  *base;
+    size_t   half;
+
+    if (from >= n) {
+        return n;
+    }
+
+    base = times + from;
+    n -= from;
+
+    /* the loop body compiles to a conditional move */
+
+    while (n > 1) {
+        half = n / 2;
+        base = (base[half] < value) ? base + half : base;
+        n -= half;
+    }
+
+    return base - times + (*base < value);
+}
@@ -0,0 +1,143 @@
+
+/*
+ * Copyright (C) xunen <leixunen@gmail.com> and others.
+ * Copyright (C) Leevid Inc.
+ */
+
+
+#ifndef _NGX_HTTP_EFLV_PARSE_H_INCLUDED_
+#define _NGX_HTTP_EFLV_PARSE_H_INCLUDED_
+
+
+/*
+ * FLV and AMF0 parsing shared by the module and the tools.
+ *
+ * The parser only needs the C library: it works on memory buffers,
+ * never allocates, and returns NULL on malformed or truncated input,
+ * so it is safe to run on untrusted data.
+ */
+
+
+#include <sys/types.h>
+#include <stddef.h>
+#include <stdint.h>
+
+
+typedef struct {
+    u_char                signature[3];
+    u_char                version;
+    u_char                flags;
+    u_char                headersize[4];
+} ngx_flv_header_t;
+
+
+typedef struct {
+    u_char                type;
+    u_char                datasize[3];
+    u_char                timestamp[3];
+    u_char                timestamp_ex;
+    u_char                streamid[3];
+} ngx_flv_tag_t;
+
+
+#define ngx_flv_get_32value(p)                                                \
+    ( ((uint32_t) ((u_char *) (p))[0] << 24)                                  \
+    + (           ((u_char *) (p))[1] << 16)                                  \
+    + (           ((u_char *) (p))[2] << 8)                                   \
+    + (           ((u_char *) (p))[3]) )
+
+#define ngx_flv_get_24value(p)                                                \
+    ( ((uint32_t) ((u_char *) (p))[0] << 16)                                  \
+    + (           ((u_char *) (p))[1] << 8)                                   \
+    + (           ((u_char *) (p))[2]) )
+
+#define ngx_flv_get_16value(p)                                                \
+    ( ((uint32_t) ((u_char *) (p))[0] << 8)                                   \
+    + (           ((u_char *) (p))[1]) )
+
+#define ngx_flv_put_32value(p, n)                                             \
+    ((u_char *) (p))[0] = (u_char) ((n) >> 24);                               \
+    ((u_char *) (p))[1] = (u_char) ((n) >> 16);                               \
+    ((u_char *) (p))[2] = (u_char) ((n) >> 8);                                \
+    ((u_char *) (p))[3] = (u_char)  (n)
+
+#define ngx_flv_put_24value(p, n)                                             \
+    ((u_char *) (p))[0] = (u_char) ((n) >> 16);                               \
+    ((u_char *) (p))[1] = (u_char) ((n) >> 8);                                \
+    ((u_char *) (p))[2] = (u_char)  (n)
+
+
+/* TagHeader + TagData + PreviousTagSize */
+
+#define ngx_flv_tag_size(tag)                                                 \
+    (sizeof(ngx_flv_tag_t) + ngx_flv_get_24value((tag)->datasize) + 4)
+
+#define ngx_flv_tag_timestamp(tag)                                            \
+    (ngx_flv_get_24value((tag)->timestamp)                                    \
+     | ((uint32_t) (tag)->timestamp_ex << 24))
+
+
+#define NGX_FLV_AUDIODATA           8
+#define NGX_FLV_VIDEODATA           9
+#define NGX_FLV_SCRIPTDATAOBJECT    18
+#define NGX_FLV_H263VIDEOPACKET     2
+#define NGX_FLV_SCREENVIDEOPACKET   3
+#define NGX_FLV_VP6VIDEOPACKET      4
+#define NGX_FLV_VP6ALPHAVIDEOPACKET 5
+#define NGX_FLV_SCREENV2VIDEOPACKET 6
+#define NGX_FLV_AVCVIDEOPACKET      7
+#define NGX_FLV_AAC                 10
+
+/*
+ * enhanced FLV: with the IsExHeader bit the low nibble of the video flags
+ * is a packet type, and a FourCC such as "hvc1" or "av01" follows them
+ */
+#define NGX_FLV_VIDEO_EX_HEADER     0x80
+#define NGX_FLV_EX_SEQUENCE_START   0
+#define NGX_FLV_EX_CODED_FRAMES     1
+#define NGX_FLV_EX_SEQUENCE_END     2
+#define NGX_FLV_EX_CODED_FRAMES_X   3
+
+/* the minimum interval of the seek points of audio-only files, seconds */
+#define NGX_FLV_AUDIO_SEEK_STEP     1.0
+
+
+#define NGX_FLV_AMF_NUMBER          0x00
+#define NGX_FLV_AMF_BOOLEAN         0x01
+#define NGX_FLV_AMF_STRING          0x02
+#define NGX_FLV_AMF_OBJECT          0x03
+#define NGX_FLV_AMF_NULL            0x05
+#define NGX_FLV_AMF_UNDEFINED       0x06
+#define NGX_FLV_AMF_REFERENCE       0x07
+#define NGX_FLV_AMF_ECMA_ARRAY      0x08
+#define NGX_FLV_AMF_OBJECT_END      0x09
+#define NGX_FLV_AMF_STRICT_ARRAY    0x0a
+#define NGX_FLV_AMF_DATE            0x0b
+#define NGX_FLV_AMF_LONG_STRING     0x0c
+#define NGX_FLV_AMF_UNSUPPORTED     0x0d
+#define NGX_FLV_AMF_XML_DOCUMENT    0x0f
+#define NGX_FLV_AMF_TYPED_OBJECT    0x10
+
+#define NGX_FLV_AMF_MAX_DEPTH       16
+
+
+double ngx_flv_get_double(const u_char *p);
+void ngx_flv_put_double(u_char *p, double value);
+
+int ngx_http_eflv_tag_keyframe(ngx_flv_tag_t *tag);
+int ngx_http_eflv_tag_video_config(ngx_flv_tag_t *tag);
+int ngx_http_eflv_tag_audio_frame(ngx_flv_tag_t *tag);
+
+u_char *ngx_http_eflv_amf_skip(u_char *p, u_char *last, unsigned depth);
+u_char *ngx_http_eflv_amf_skip_props(u_char *p, u_char *last, unsigned depth);
+u_char *ngx_http_eflv_amf_next_prop(u_char *p, u_char *last, u_char **name,
+    size_t *len);
+u_char *ngx_http_eflv_amf_metadata(u_char *tag, size_t len, u_char **last);
+u_char *ngx_http_eflv_amf_array(u_char *p, u_char *last, size_t *n);
+size_t ngx_http_eflv_amf_numbers(u_char *p, size_t n, double *values);
+
+size_t ngx_http_eflv_lower_bound(double *times, size_t n, size_t from,
+    double value);
+
+
+#endif /* _NGX_HTTP_EFLV_PARSE_H_INCLUDED_ */
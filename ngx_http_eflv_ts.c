@@ -0,0 +1,543 @@
+
+/*
+ * Copyright (C) xunen <leixunen@gmail.com> and others.
+ * Copyright (C) Leevid Inc.
+ */
+
+
+#include <string.h>
+
+#include "ngx_http_eflv_ts.h"
+
+
+#define NGX_HTTP_EFLV_TS_PMT_PID    0x1000
+#define NGX_HTTP_EFLV_TS_VIDEO_PID  0x100
+#define NGX_HTTP_EFLV_TS_AUDIO_PID  0x101
+
+/* the PCR runs behind the timestamps, in 90 kHz units */
+#define NGX_HTTP_EFLV_TS_DELAY      63000
+
+
+static u_char *
+ngx_http_eflv_ts_header(u_char *p, unsigned pid, unsigned start, u_char *cc)
+{
+    *p++ = 0x47;
+    *p++ = (u_char) ((start ? 0x40 : 0) | (pid >> 8));
+    *p++ = (u_char) pid;
+    *p++ = (u_char) (0x10 | (*cc & 0x0f));
+
+    (*cc)++;
+
+    return p;
+}
+
+
+/* the CRC-32 of MPEG-2 sections, written after the section */
+
+static u_char *
+ngx_http_eflv_ts_crc(u_char *p, u_char *last)
+{
+    unsigned  i;
+    uint32_t  crc;
+
+    crc = 0xffffffff;
+
+    while (p < last) {
+        crc ^= (uint32_t) *p++ << 24;
+
+        for (i = 0; i < 8; i++) {
+            crc = (crc & 0x80000000) ? (crc << 1) ^ 0x04c11db7 : crc << 1;
+        }
+    }
+
+    ngx_flv_put_32value(p, crc);
+
+    return p + 4;
+}
+
+
+static u_char *
+ngx_http_eflv_ts_timestamp(u_char *p, unsigned prefix, uint64_t ts)
+{
+    unsigned  v;
+
+    *p++ = (u_char) (prefix | ((ts >> 29) & 0x0e) | 1);
+
+    v = (unsigned) ((ts >> 14) & 0xfffe) | 1;
+    *p++ = (u_char) (v >> 8);
+    *p++ = (u_char) v;
+
+    v = (unsigned) ((ts << 1) & 0xfffe) | 1;
+    *p++ = (u_char) (v >> 8);
+    *p++ = (u_char) v;
+
+    return p;
+}
+
+
+static u_char *
+ngx_http_eflv_ts_pcr(u_char *p, uint64_t pcr)
+{
+    *p++ = (u_char) (pcr >> 25);
+    *p++ = (u_char) (pcr >> 17);
+    *p++ = (u_char) (pcr >> 9);
+    *p++ = (u_char) (pcr >> 1);
+    *p++ = (u_char) (pcr << 7 | 0x7e);
+    *p++ = 0;
+
+    return p;
+}
+
+
+/*
+ * takes the SPS and PPS from the AVCDecoderConfigurationRecord of a
+ * sequence header tag
+ */
+
+int
+ngx_http_eflv_ts_avc_config(ngx_http_eflv_ts_t *ts, u_char *tag, size_t len)
+{
+    u_char         *p, *last, *out;
+    size_t          n, size;
+    unsigned        i, k, count;
+    ngx_flv_tag_t  *flvtag;
+
+    if (len < sizeof(ngx_flv_tag_t) + 5) {
+        return -1;
+    }
+
+    flvtag = (ngx_flv_tag_t *) tag;
+    size = ngx_flv_get_24value(flvtag->datasize);
+
+    p = tag + sizeof(ngx_flv_tag_t);
+
+    if (flvtag->type != NGX_FLV_VIDEODATA
+        || size < 5 + 6 || size > len - sizeof(ngx_flv_tag_t)
+        || (p[0] & NGX_FLV_VIDEO_EX_HEADER)
+        || (p[0] & 0xf) != NGX_FLV_AVCVIDEOPACKET || p[1] != 0)
+    {
+        return -1;
+    }
+
+    last = p + size;
+    p += 5;
+
+    ts->nal_length_size = (p[4] & 0x03) + 1;
+    count = p[5] & 0x1f;
+    p += 6;
+
+    out = ts->avc_config;
+
+    /* the SPS, then the PPS */
+
+    for (k = 0; k < 2; k++) {
+
+        for (i = 0; i < count; i++) {
+            if (last - p < 2) {
+                return -1;
+            }
+
+            n = ngx_flv_get_16value(p);
+            p += 2;
+
+            if ((size_t) (last - p) < n
+                || (size_t) (ts->avc_config + NGX_HTTP_EFLV_TS_CONFIG_MAX - out)
+                   < n + 4)
+            {
+                return -1;
+            }
+
+            memcpy(out, "\0\0\0\1", 4);
+            memcpy(out + 4, p, n);
+
+            out += n + 4;
+            p += n;
+        }
+
+        if (k == 0) {
+            if (p == last) {
+                return -1;
+            }
+
+            count = *p++;
+        }
+    }
+
+    ts->avc_config_len = out - ts->avc_config;
+    ts->video = 1;
+
+    return 0;
+}
+
+
+/* takes the profile, rate and channels from an AAC sequence header tag */
+
+int
+ngx_http_eflv_ts_aac_config(ngx_http_eflv_ts_t *ts, u_char *tag, size_t len)
+{
+    u_char         *p;
+    size_t          size;
+    unsigned        object, index;
+    ngx_flv_tag_t  *flvtag;
+
+    if (len < sizeof(ngx_flv_tag_t) + 4) {
+        return -1;
+    }
+
+    flvtag = (ngx_flv_tag_t *) tag;
+    size = ngx_flv_get_24value(flvtag->datasize);
+
+    p = tag + sizeof(ngx_flv_tag_t);
+
+    if (flvtag->type != NGX_FLV_AUDIODATA
+        || size < 4 || size > len - sizeof(ngx_flv_tag_t)
+        || (p[0] >> 4) != NGX_FLV_AAC || p[1] != 0)
+    {
+        return -1;
+    }
+
+    object = p[2] >> 3;
+    index = ((p[2] & 0x07) << 1) | (p[3] >> 7);
+
+    /* an explicit sampling rate cannot be signalled in ADTS */
+
+    if (object == 0 || index > 12) {
+        return -1;
+    }
+
+    /* ADTS has room for the first four object types, SBR is implicit */
+
+    ts->aac_profile = (u_char) ((object > 4) ? 2 : object);
+    ts->aac_sr_index = (u_char) index;
+    ts->aac_channels = (p[3] >> 3) & 0x0f;
+    ts->audio = 1;
+
+    return 0;
+}
+
+
+u_char *
+ngx_http_eflv_ts_pat(ngx_http_eflv_ts_t *ts, u_char *p)
+{
+    u_char  *packet, *section;
+
+    packet = p;
+
+    p = ngx_http_eflv_ts_header(p, 0, 1, &ts->cc[0]);
+
+    /* the pointer field */
+    *p++ = 0;
+
+    section = p;
+
+    *p++ = 0x00;
+    *p++ = 0xb0;
+    *p++ = 13;
+    *p++ = 0x00;
+    *p++ = 0x01;
+    *p++ = 0xc1;
+    *p++ = 0x00;
+    *p++ = 0x00;
+
+    /* program 1 */
+    *p++ = 0x00;
+    *p++ = 0x01;
+    *p++ = 0xe0 | (NGX_HTTP_EFLV_TS_PMT_PID >> 8);
+    *p++ = NGX_HTTP_EFLV_TS_PMT_PID & 0xff;
+
+    p = ngx_http_eflv_ts_crc(section, p);
+
+    memset(p, 0xff, packet + NGX_HTTP_EFLV_TS_PACKET - p);
+
+    return packet + NGX_HTTP_EFLV_TS_PACKET;
+}
+
+
+u_char *
+ngx_http_eflv_ts_pmt(ngx_http_eflv_ts_t *ts, u_char *p)
+{
+    u_char    *packet, *section;
+    unsigned   pcr;
+
+    packet = p;
+
+    pcr = ts->video ? NGX_HTTP_EFLV_TS_VIDEO_PID : NGX_HTTP_EFLV_TS_AUDIO_PID;
+
+    p = ngx_http_eflv_ts_header(p, NGX_HTTP_EFLV_TS_PMT_PID, 1, &ts->cc[1]);
+
+    *p++ = 0;
+
+    section = p;
+
+    *p++ = 0x02;
+    *p++ = 0xb0;
+    *p++ = (u_char) (13 + 5 * (ts->video + ts->audio));
+    *p++ = 0x00;
+    *p++ = 0x01;
+    *p++ = 0xc1;
+    *p++ = 0x00;
+    *p++ = 0x00;
+    *p++ = (u_char) (0xe0 | (pcr >> 8));
+    *p++ = (u_char) pcr;
+    *p++ = 0xf0;
+    *p++ = 0x00;
+
+    if (ts->video) {
+        /* H.264 */
+        *p++ = 0x1b;
+        *p++ = 0xe0 | (NGX_HTTP_EFLV_TS_VIDEO_PID >> 8);
+        *p++ = NGX_HTTP_EFLV_TS_VIDEO_PID & 0xff;
+        *p++ = 0xf0;
+        *p++ = 0x00;
+    }
+
+    if (ts->audio) {
+        /* AAC in ADTS */
+        *p++ = 0x0f;
+        *p++ = 0xe0 | (NGX_HTTP_EFLV_TS_AUDIO_PID >> 8);
+        *p++ = NGX_HTTP_EFLV_TS_AUDIO_PID & 0xff;
+        *p++ = 0xf0;
+        *p++ = 0x00;
+    }
+
+    p = ngx_http_eflv_ts_crc(section, p);
+
+    memset(p, 0xff, packet + NGX_HTTP_EFLV_TS_PACKET - p);
+
+    return packet + NGX_HTTP_EFLV_TS_PACKET;
+}
+
+
+/* the size of the PES payload of a tag, with start codes and ADTS header */
+
+size_t
+ngx_http_eflv_ts_payload_bound(ngx_http_eflv_ts_t *ts, size_t datasize)
+{
+    size_t  n;
+
+    n = datasize;
+
+    if (ts->nal_length_size && ts->nal_length_size < 4) {
+        n += datasize / ts->nal_length_size * (4 - ts->nal_length_size);
+    }
+
+    /* an access unit delimiter, the SPS and PPS, or the ADTS header */
+
+    return 6 + ts->avc_config_len + n + 7;
+}
+
+
+/*
+ * converts the H.264 or AAC frame of a tag into a PES payload in "buf";
+ * returns 0 for the tags which are not sent, such as sequence headers
+ */
+
+int
+ngx_http_eflv_ts_pes(ngx_http_eflv_ts_t *ts, ngx_flv_tag_t *tag, u_char *buf,
+    ngx_http_eflv_ts_pes_t *pes)
+{
+    u_char    *p, *last, *out;
+    size_t     i, n, size;
+    int32_t    cts;
+    uint64_t   dts;
+
+    size = ngx_flv_get_24value(tag->datasize);
+
+    p = (u_char *) tag + sizeof(ngx_flv_tag_t);
+    last = p + size;
+    out = buf;
+
+    dts = (uint64_t) ngx_flv_tag_timestamp(tag) * 90 + NGX_HTTP_EFLV_TS_DELAY;
+
+    if (tag->type == NGX_FLV_VIDEODATA) {
+
+        if (!ts->video || size < 5
+            || (p[0] & NGX_FLV_VIDEO_EX_HEADER)
+            || (p[0] & 0xf) != NGX_FLV_AVCVIDEOPACKET || p[1] != 1)
+        {
+            return 0;
+        }
+
+        pes->key = ((p[0] >> 4) == 1);
+
+        /* the composition time offset is signed */
+        cts = (int32_t) (ngx_flv_get_24value(p + 2) << 8) >> 8;
+
+        p += 5;
+
+        memcpy(out, "\0\0\0\1\x09\xf0", 6);
+        out += 6;
+
+        if (pes->key) {
+            memcpy(out, ts->avc_config, ts->avc_config_len);
+            out += ts->avc_config_len;
+        }
+
+        while ((size_t) (last - p) >= ts->nal_length_size) {
+
+            n = 0;
+
+            for (i = 0; i < ts->nal_length_size; i++) {
+                n = (n << 8) | *p++;
+            }
+
+            if (n > (size_t) (last - p)) {
+                break;
+            }
+
+            /* access unit delimiters are replaced with the one above */
+
+            if (n && (p[0] & 0x1f) != 9) {
+                memcpy(out, "\0\0\0\1", 4);
+                memcpy(out + 4, p, n);
+                out += n + 4;
+            }
+
+            p += n;
+        }
+
+        pes->video = 1;
+        pes->dts = dts;
+        pes->pts = (cts < 0 && (uint64_t) -cts * 90 > dts)
+                   ? dts : dts + (int64_t) cts * 90;
+
+    } else if (tag->type == NGX_FLV_AUDIODATA) {
+
+        if (!ts->audio || size < 3
+            || (p[0] >> 4) != NGX_FLV_AAC || p[1] != 1)
+        {
+            return 0;
+        }
+
+        /* the frame length includes the ADTS header */
+
+        n = size - 2 + 7;
+
+        if (n > 0x1fff) {
+            return 0;
+        }
+
+        out[0] = 0xff;
+        out[1] = 0xf1;
+        out[2] = (u_char) (((ts->aac_profile - 1) << 6)
+                           | (ts->aac_sr_index << 2)
+                           | ((ts->aac_channels >> 2) & 0x01));
+        out[3] = (u_char) (((ts->aac_channels & 0x03) << 6) | (n >> 11));
+        out[4] = (u_char) (n >> 3);
+        out[5] = (u_char) (((n & 0x07) << 5) | 0x1f);
+        out[6] = 0xfc;
+
+        memcpy(out + 7, p + 2, size - 2);
+        out += n;
+
+        pes->video = 0;
+        pes->key = !ts->video;
+        pes->dts = dts;
+        pes->pts = dts;
+
+    } else {
+        return 0;
+    }
+
+    pes->pos = buf;
+    pes->last = out;
+    pes->first = 1;
+
+    return 1;
+}
+
+
+/*
+ * writes the next packet of the PES; the first one carries the PES
+ * header, and the PCR on the keyframes of the stream that carries it
+ */
+
+u_char *
+ngx_http_eflv_ts_packet(ngx_http_eflv_ts_t *ts, ngx_http_eflv_ts_pes_t *pes,
+    u_char *packet)
+{
+    u_char    *p, *base;
+    size_t     body, in, stuff, size;
+    unsigned   pid, hlen;
+
+    pid = pes->video ? NGX_HTTP_EFLV_TS_VIDEO_PID : NGX_HTTP_EFLV_TS_AUDIO_PID;
+
+    p = ngx_http_eflv_ts_header(packet, pid, pes->first,
+                                &ts->cc[pes->video ? 2 : 3]);
+
+    if (pes->first) {
+
+        if (pes->key) {
+            packet[3] |= 0x20;
+
+            /* the random access indicator and the PCR */
+
+            *p++ = 7;
+            *p++ = 0x50;
+
+            p = ngx_http_eflv_ts_pcr(p, pes->dts - NGX_HTTP_EFLV_TS_DELAY);
+        }
+
+        hlen = (pes->pts != pes->dts) ? 10 : 5;
+
+        size = (pes->last - pes->pos) + 3 + hlen;
+
+        if (size > 0xffff) {
+            size = 0;
+        }
+
+        *p++ = 0x00;
+        *p++ = 0x00;
+        *p++ = 0x01;
+        *p++ = pes->video ? 0xe0 : 0xc0;
+        *p++ = (u_char) (size >> 8);
+        *p++ = (u_char) size;
+        *p++ = 0x80;
+        *p++ = (hlen == 10) ? 0xc0 : 0x80;
+        *p++ = (u_char) hlen;
+
+        p = ngx_http_eflv_ts_timestamp(p, (hlen == 10) ? 0x30 : 0x20,
+                                       pes->pts);
+
+        if (hlen == 10) {
+            p = ngx_http_eflv_ts_timestamp(p, 0x10, pes->dts);
+        }
+
+        pes->first = 0;
+    }
+
+    body = packet + NGX_HTTP_EFLV_TS_PACKET - p;
+    in = pes->last - pes->pos;
+
+    if (body > in) {
+
+        /* the last packet is padded with adaptation field stuffing */
+
+        stuff = body - in;
+
+        if (packet[3] & 0x20) {
+            base = &packet[5] + packet[4];
+            memmove(base + stuff, base, p - base);
+            memset(base, 0xff, stuff);
+            packet[4] += (u_char) stuff;
+
+        } else {
+            packet[3] |= 0x20;
+            memmove(&packet[4] + stuff, &packet[4], p - &packet[4]);
+            packet[4] = (u_char) (stuff - 1);
+
+            if (stuff >= 2) {
+                packet[5] = 0;
+                memset(&packet[6], 0xff, stuff - 2);
+            }
+        }
+
+        p += stuff;
+        body = in;
+    }
+
+    memcpy(p, pes->pos, body);
+    pes->pos += body;
+
+    return packet + NGX_HTTP_EFLV_TS_PACKET;
+}
@@ -0,0 +1,77 @@
+
+/*
+ * Copyright (C) xunen <leixunen@gmail.com> and others.
+ * Copyright (C) Leevid Inc.
+ */
+
+
+#ifndef _NGX_HTTP_EFLV_TS_H_INCLUDED_
+#define _NGX_HTTP_EFLV_TS_H_INCLUDED_
+
+
+/*
+ * MPEG-TS packetizing of FLV tags with H.264 video and AAC audio, for
+ * HLS segments cut at keyframes.
+ *
+ * Like the parser it only needs the C library and never allocates: a tag
+ * is turned into a PES in a buffer of ngx_http_eflv_ts_payload_bound()
+ * bytes, which is then written out one 188 byte packet at a time.
+ */
+
+
+#include "ngx_http_eflv_parse.h"
+
+
+#define NGX_HTTP_EFLV_TS_PACKET      188
+
+/* the SPS and PPS with start codes */
+#define NGX_HTTP_EFLV_TS_CONFIG_MAX  1024
+
+
+typedef struct {
+    u_char                avc_config[NGX_HTTP_EFLV_TS_CONFIG_MAX];
+    size_t                avc_config_len;
+    size_t                nal_length_size;
+
+    u_char                aac_profile;
+    u_char                aac_sr_index;
+    u_char                aac_channels;
+
+    /* the continuity counters of the PAT, PMT, video and audio */
+    u_char                cc[4];
+
+    unsigned              video:1;
+    unsigned              audio:1;
+} ngx_http_eflv_ts_t;
+
+
+typedef struct {
+    u_char               *pos;
+    u_char               *last;
+
+    uint64_t              pts;
+    uint64_t              dts;
+
+    unsigned              video:1;
+    unsigned              key:1;
+    unsigned              first:1;
+} ngx_http_eflv_ts_pes_t;
+
+
+int ngx_http_eflv_ts_avc_config(ngx_http_eflv_ts_t *ts, u_char *tag,
+    size_t len);
+int ngx_http_eflv_ts_aac_config(ngx_http_eflv_ts_t *ts, u_char *tag,
+    size_t len);
+
+u_char *ngx_http_eflv_ts_pat(ngx_http_eflv_ts_t *ts, u_char *p);
+u_char *ngx_http_eflv_ts_pmt(ngx_http_eflv_ts_t *ts, u_char *p);
+
+size_t ngx_http_eflv_ts_payload_bound(ngx_http_eflv_ts_t *ts,
+    size_t datasize);
+int ngx_http_eflv_ts_pes(ngx_http_eflv_ts_t *ts, ngx_flv_tag_t *tag,
+    u_char *buf, ngx_http_eflv_ts_pes_t *pes);
+u_char *ngx_http_eflv_ts_packet(ngx_http_eflv_ts_t *ts,
+    ngx_http_eflv_ts_pes_t *pes, u_char *p);
+
+
+#endif /* _NGX_HTTP_EFLV_TS_H_INCLUDED_ */
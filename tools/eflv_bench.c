@@ -0,0 +1,390 @@
+/*
+ * Copyright (C) xunen <leixunen@gmail.com> and others.
+ * Copyright (C) Leevid Inc.
+ */
+
+
+/*
+ * eflv-bench: measures the parser of ngx_http_eflv_parse.c outside of
+ * nginx, on files written by eflv-gen or real recordings.
+ *
+ *     eflv-bench [-n lookups] [-t seconds] file.flv ...
+ *
+ *     -n    the number of keyframe lookups in a round, 1000000 by default
+ *     -t    the minimum time each measurement runs for, 0.5 by default
+ *
+ * For each file one JSON object is printed on a line of its own, with
+ * the throughput of walking all tags as eflv-index and the tag scan of
+ * the module do, in MB/s, of reading the keyframe times out of
+ * onMetaData, in MB/s of the tag, and the keyframe lookups per second
+ * of ngx_http_eflv_lower_bound() for random times.
+ */
+
+
+#define _FILE_OFFSET_BITS  64
+
+#include <sys/types.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "ngx_http_eflv_parse.h"
+
+
+typedef struct {
+    const char   *name;
+    u_char       *map;
+    size_t        size;
+
+    /* the onMetaData tag */
+    u_char       *metadata;
+    size_t        metadata_len;
+} eflv_bench_file_t;
+
+
+static int eflv_bench(const char *name, uint64_t lookups, double min);
+static uint64_t eflv_walk(eflv_bench_file_t *f);
+static size_t eflv_times(eflv_bench_file_t *f, double **times);
+static double eflv_now(void);
+static void eflv_put_string(const char *s);
+static void eflv_usage(const char *name);
+
+
+/* keeps the results of the measured calls alive */
+static volatile uint64_t  eflv_sink;
+
+
+int
+main(int argc, char **argv)
+{
+    int       c, rc;
+    double    min;
+    uint64_t  lookups;
+
+    lookups = 1000000;
+    min = 0.5;
+
+    while ((c = getopt(argc, argv, "n:t:")) != -1) {
+
+        switch (c) {
+
+        case 'n':
+            lookups = strtoull(optarg, NULL, 10);
+            break;
+
+        case 't':
+            min = atof(optarg);
+            break;
+
+        default:
+            eflv_usage(argv[0]);
+            return 2;
+        }
+    }
+
+    if (optind == argc || lookups == 0 || min <= 0) {
+        eflv_usage(argv[0]);
+        return 2;
+    }
+
+    rc = 0;
+
+    for ( /* void */ ; optind < argc; optind++) {
+        if (eflv_bench(argv[optind], lookups, min) != 0) {
+            rc = 1;
+        }
+    }
+
+    return rc;
+}
+
+
+static void
+eflv_usage(const char *name)
+{
+    fprintf(stderr, "usage: %s [-n lookups] [-t seconds] file.flv ...\n",
+            name);
+}
+
+
+static int
+eflv_bench(const char *name, uint64_t lookups, double min)
+{
+    int                 fd;
+    double              start, elapsed, *times, t;
+    size_t              n, i;
+    uint32_t            seed;
+    uint64_t            rounds, keyframes, sum;
+    struct stat         st;
+    eflv_bench_file_t   f;
+
+    memset(&f, 0, sizeof(eflv_bench_file_t));
+
+    f.name = name;
+
+    fd = open(name, O_RDONLY);
+    if (fd == -1) {
+        fprintf(stderr, "eflv-bench: open(\"%s\") failed: %s\n",
+                name, strerror(errno));
+        return -1;
+    }
+
+    if (fstat(fd, &st) == -1 || st.st_size < 13) {
+        fprintf(stderr, "eflv-bench: \"%s\" is not an FLV file\n", name);
+        close(fd);
+        return -1;
+    }
+
+    f.size = (size_t) st.st_size;
+
+    f.map = mmap(NULL, f.size, PROT_READ, MAP_SHARED, fd, 0);
+
+    close(fd);
+
+    if (f.map == MAP_FAILED) {
+        fprintf(stderr, "eflv-bench: mmap(\"%s\") failed: %s\n",
+                name, strerror(errno));
+        return -1;
+    }
+
+    /* the file is read into the page cache before the first measurement */
+
+    keyframes = eflv_walk(&f);
+
+    start = eflv_now();
+    rounds = 0;
+
+    do {
+        eflv_sink += eflv_walk(&f);
+        rounds++;
+        elapsed = eflv_now() - start;
+    } while (elapsed < min);
+
+    printf("{\"file\":");
+    eflv_put_string(name);
+    printf(",\"bytes\":%llu,\"keyframes\":%llu,\"walk_mbps\":%.1f",
+           (unsigned long long) f.size, (unsigned long long) keyframes,
+           f.size * rounds / elapsed / 1e6);
+
+    times = NULL;
+    n = 0;
+
+    if (f.metadata) {
+        n = eflv_times(&f, &times);
+        free(times);
+
+        start = eflv_now();
+        rounds = 0;
+
+        do {
+            eflv_sink += eflv_times(&f, &times);
+            free(times);
+            rounds++;
+            elapsed = eflv_now() - start;
+        } while (elapsed < min);
+
+        printf(",\"metadata_bytes\":%llu,\"metadata_keyframes\":%llu,"
+               "\"metadata_mbps\":%.1f",
+               (unsigned long long) f.metadata_len, (unsigned long long) n,
+               f.metadata_len * rounds / elapsed / 1e6);
+
+        n = eflv_times(&f, &times);
+    }
+
+    if (n) {
+        seed = 1;
+        sum = 0;
+
+        start = eflv_now();
+        rounds = 0;
+
+        do {
+            for (i = 0; i < lookups; i++) {
+                seed = seed * 1103515245 + 12345;
+                t = times[n - 1] * (seed >> 8) / (1 << 24);
+
+                sum += ngx_http_eflv_lower_bound(times, n, 0, t);
+            }
+
+            rounds++;
+            elapsed = eflv_now() - start;
+        } while (elapsed < min);
+
+        eflv_sink += sum;
+
+        printf(",\"lookups_per_sec\":%.0f", lookups * rounds / elapsed);
+    }
+
+    printf("}\n");
+
+    free(times);
+    munmap(f.map, f.size);
+
+    return 0;
+}
+
+
+/*
+ * walks the tags like eflv-index: returns the number of keyframes and
+ * remembers the onMetaData tag
+ */
+
+static uint64_t
+eflv_walk(eflv_bench_file_t *f)
+{
+    size_t          pos, len;
+    uint64_t        keyframes;
+    ngx_flv_tag_t  *tag;
+
+    pos = ngx_flv_get_32value(f->map + 5) + 4;
+    keyframes = 0;
+
+    while (pos + sizeof(ngx_flv_tag_t) + 2 <= f->size) {
+
+        tag = (ngx_flv_tag_t *) (f->map + pos);
+        len = ngx_flv_tag_size(tag);
+
+        if (pos + len > f->size) {
+            break;
+        }
+
+        switch (tag->type) {
+
+        case NGX_FLV_SCRIPTDATAOBJECT:
+
+            if (f->metadata == NULL) {
+                f->metadata = (u_char *) tag;
+                f->metadata_len = len;
+            }
+
+            break;
+
+        case NGX_FLV_AUDIODATA:
+            eflv_sink += ngx_http_eflv_tag_audio_frame(tag);
+            break;
+
+        case NGX_FLV_VIDEODATA:
+
+            if (!ngx_http_eflv_tag_video_config(tag)) {
+                keyframes += ngx_http_eflv_tag_keyframe(tag);
+            }
+
+            break;
+
+        default:
+            return keyframes;
+        }
+
+        pos += len;
+    }
+
+    return keyframes;
+}
+
+
+/* reads the keyframe times out of onMetaData as the module does */
+
+static size_t
+eflv_times(eflv_bench_file_t *f, double **times)
+{
+    u_char  *p, *v, *last, *name;
+    size_t   len, n;
+
+    *times = NULL;
+
+    p = ngx_http_eflv_amf_metadata(f->metadata, f->metadata_len, &last);
+    if (p == NULL) {
+        return 0;
+    }
+
+    p += (*p == NGX_FLV_AMF_ECMA_ARRAY) ? 5 : 1;
+
+    for ( ;; ) {
+        v = ngx_http_eflv_amf_next_prop(p, last, &name, &len);
+        if (v == NULL) {
+            return 0;
+        }
+
+        if (len == 9 && memcmp(name, "keyframes", 9) == 0
+            && *v == NGX_FLV_AMF_OBJECT)
+        {
+            break;
+        }
+
+        p = ngx_http_eflv_amf_skip(v, last, 1);
+        if (p == NULL) {
+            return 0;
+        }
+    }
+
+    p = v + 1;
+
+    for ( ;; ) {
+        v = ngx_http_eflv_amf_next_prop(p, last, &name, &len);
+        if (v == NULL) {
+            return 0;
+        }
+
+        if (len == 5 && memcmp(name, "times", 5) == 0) {
+            break;
+        }
+
+        p = ngx_http_eflv_amf_skip(v, last, 1);
+        if (p == NULL) {
+            return 0;
+        }
+    }
+
+    p = ngx_http_eflv_amf_array(v, last, &n);
+    if (p == NULL || n == 0) {
+        return 0;
+    }
+
+    *times = malloc(n * sizeof(double));
+    if (*times == NULL) {
+        return 0;
+    }
+
+    return ngx_http_eflv_amf_numbers(p, n, *times);
+}
+
+
+static double
+eflv_now(void)
+{
+    struct timespec  ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+
+static void
+eflv_put_string(const char *s)
+{
+    putchar('"');
+
+    for ( /* void */ ; *s; s++) {
+
+        if (*s == '"' || *s == '\\') {
+            putchar('\\');
+            putchar(*s);
+
+        } else if ((unsigned char) *s < 0x20) {
+            printf("\\u%04x", (unsigned char) *s);
+
+        } else {
+            putchar(*s);
+        }
+    }
+
+    putchar('"');
+}
@@ -0,0 +1,161 @@
+/*
+ * Copyright (C) xunen <leixunen@gmail.com> and others.
+ * Copyright (C) Leevid Inc.
+ */
+
+
+/*
+ * eflv-fuzz: a libFuzzer target for the onMetaData parsing of
+ * ngx_http_eflv_parse.c, built by "make fuzz" with clang.
+ *
+ *     eflv-fuzz [libFuzzer options] [corpus directory ...]
+ *
+ * The input is the data of a script tag: it is copied after a tag header
+ * into a buffer of its exact size, walked the way the module reads the
+ * keyframes object, and finally tested as video and audio tag data.
+ * Script tags cut out of files written by eflv-gen make a good seed
+ * corpus.
+ */
+
+
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "ngx_http_eflv_parse.h"
+
+
+int LLVMFuzzerTestOneInput(const uint8_t *data, size_t size);
+
+static void eflv_fuzz_keyframes(u_char *p, u_char *last);
+static void eflv_fuzz_numbers(u_char *p, u_char *last);
+
+
+int
+LLVMFuzzerTestOneInput(const uint8_t *data, size_t size)
+{
+    u_char         *tag, *p, *v, *last, *name;
+    size_t          len, n;
+    ngx_flv_tag_t  *flvtag;
+
+    len = sizeof(ngx_flv_tag_t) + size;
+
+    tag = malloc(len);
+    if (tag == NULL) {
+        return 0;
+    }
+
+    memset(tag, 0, sizeof(ngx_flv_tag_t));
+    memcpy(tag + sizeof(ngx_flv_tag_t), data, size);
+
+    flvtag = (ngx_flv_tag_t *) tag;
+    flvtag->type = NGX_FLV_SCRIPTDATAOBJECT;
+    ngx_flv_put_24value(flvtag->datasize, size);
+
+    p = ngx_http_eflv_amf_metadata(tag, len, &last);
+
+    if (p != NULL) {
+        p += (*p == NGX_FLV_AMF_ECMA_ARRAY) ? 5 : 1;
+
+        for ( ;; ) {
+            v = ngx_http_eflv_amf_next_prop(p, last, &name, &n);
+            if (v == NULL) {
+                break;
+            }
+
+            if (n == 9 && memcmp(name, "keyframes", 9) == 0) {
+                eflv_fuzz_keyframes(v, last);
+            }
+
+            p = ngx_http_eflv_amf_skip(v, last, 1);
+            if (p == NULL) {
+                break;
+            }
+        }
+
+        (void) ngx_http_eflv_amf_skip_props(p ? p : last, last, 0);
+    }
+
+    /* the packet header checks read two bytes of the tag data */
+
+    if (size >= 2) {
+        flvtag->type = NGX_FLV_VIDEODATA;
+        (void) ngx_http_eflv_tag_keyframe(flvtag);
+        (void) ngx_http_eflv_tag_video_config(flvtag);
+
+        flvtag->type = NGX_FLV_AUDIODATA;
+        (void) ngx_http_eflv_tag_audio_frame(flvtag);
+    }
+
+    free(tag);
+
+    return 0;
+}
+
+
+static void
+eflv_fuzz_keyframes(u_char *p, u_char *last)
+{
+    u_char  *v, *name;
+    size_t   n;
+
+    if (*p == NGX_FLV_AMF_ECMA_ARRAY) {
+
+        if (last - p < 5) {
+            return;
+        }
+
+        p += 4;
+
+    } else if (*p != NGX_FLV_AMF_OBJECT) {
+        return;
+    }
+
+    p++;
+
+    for ( ;; ) {
+        v = ngx_http_eflv_amf_next_prop(p, last, &name, &n);
+        if (v == NULL) {
+            break;
+        }
+
+        if ((n == 5 && memcmp(name, "times", 5) == 0)
+            || (n == 13 && memcmp(name, "filepositions", 13) == 0))
+        {
+            eflv_fuzz_numbers(v, last);
+        }
+
+        p = ngx_http_eflv_amf_skip(v, last, 1);
+        if (p == NULL) {
+            break;
+        }
+    }
+}
+
+
+static void
+eflv_fuzz_numbers(u_char *p, u_char *last)
+{
+    size_t   n, i;
+    double  *values;
+
+    p = ngx_http_eflv_amf_array(p, last, &n);
+    if (p == NULL) {
+        return;
+    }
+
+    values = malloc((n ? n : 1) * sizeof(double));
+    if (values == NULL) {
+        return;
+    }
+
+    n = ngx_http_eflv_amf_numbers(p, n, values);
+
+    /* the times need not be sorted for the search to stay in bounds */
+
+    for (i = 0; i < n && i < 16; i++) {
+        (void) ngx_http_eflv_lower_bound(values, n, i, values[i]);
+    }
+
+    free(values);
+}
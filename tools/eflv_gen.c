@@ -0,0 +1,690 @@
+
+/*
+ * Copyright (C) xunen <leixunen@gmail.com> and others.
+ * Copyright (C) Leevid Inc.
+ */
+
+
+/*
+ * eflv-gen: writes a synthetic FLV file for exercising the module, with
+ * the given duration, keyframe interval, codecs, bitrates and onMetaData
+ * size.
+ *
+ *     eflv-gen [-d duration] [-g interval] [-r rate]
+ *              [-v avc|hevc|h263|none] [-a aac|mp3|none] [-b kbps]
+ *              [-B kbps] [-m kbytes] [-n] [-R count] file.flv
+ *
+ * Tags carry no real media, only valid tag and packet headers, so the
+ * files are only meant for the module and for eflv-index.  The output is
+ * the same for the same arguments.
+ */
+
+
+#define _FILE_OFFSET_BITS  64
+
+#include <sys/types.h>
+#include <errno.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+
+#define EFLV_TAG_HEADER         11
+
+#define EFLV_AUDIODATA          8
+#define EFLV_VIDEODATA          9
+#define EFLV_SCRIPTDATAOBJECT   18
+
+#define EFLV_H263VIDEOPACKET    2
+#define EFLV_AVCVIDEOPACKET     7
+#define EFLV_MP3                2
+#define EFLV_AAC                10
+
+/* enhanced FLV HEVC, the FourCC is also its videocodecid in onMetaData */
+#define EFLV_HVC1               0x68766331
+
+#define EFLV_AUDIO_RATE         44100
+
+
+typedef unsigned char  u_char;
+
+
+typedef struct {
+    double        duration;
+    double        interval;
+    double        rate;
+    int           video;
+    int           audio;
+    double        video_bps;
+    double        audio_bps;
+    size_t        padding;
+    size_t        repeats;
+    int           keyframes_object;
+
+    FILE         *out;
+    const char   *name;
+    uint64_t      pos;
+    uint32_t      seed;
+
+    /* keyframes found by the measuring pass, relative to the body */
+    double       *times;
+    uint64_t     *positions;
+    uint64_t      keyframes;
+    uint64_t      nalloc;
+} eflv_gen_t;
+
+
+static int eflv_gen(eflv_gen_t *g);
+static int eflv_body(eflv_gen_t *g);
+static int eflv_tag(eflv_gen_t *g, int type, uint32_t time, u_char *head,
+    size_t hlen, size_t len);
+static int eflv_write(eflv_gen_t *g, const void *data, size_t len);
+static size_t eflv_metadata(eflv_gen_t *g, u_char *p, uint64_t base,
+    uint64_t size);
+static u_char *eflv_put_name(u_char *p, const char *name);
+static u_char *eflv_put_number(u_char *p, double value);
+static uint32_t eflv_random(eflv_gen_t *g);
+static void eflv_usage(const char *name);
+
+
+static u_char  eflv_avc_config[] = {
+    0x17, 0x00, 0x00, 0x00, 0x00,
+    0x01, 0x64, 0x00, 0x1f, 0xff, 0xe1, 0x00, 0x04, 0x67, 0x64, 0x00, 0x1f,
+    0x01, 0x00, 0x04, 0x68, 0xee, 0x3c, 0x80
+};
+
+/* an enhanced FLV SequenceStart with an HEVCDecoderConfigurationRecord */
+
+static u_char  eflv_hevc_config[] = {
+    0x90, 'h', 'v', 'c', '1',
+    0x01, 0x01, 0x60, 0x00, 0x00, 0x00, 0x90, 0x00, 0x00, 0x00, 0x00, 0x00,
+    0x5d, 0xf0, 0x00, 0xfc, 0xfd, 0xf8, 0xf8, 0x00, 0x00, 0x0f, 0x00
+};
+
+static u_char  eflv_aac_config[] = { 0xaf, 0x00, 0x12, 0x10 };
+
+
+int
+main(int argc, char **argv)
+{
+    int         c;
+    eflv_gen_t  g;
+
+    memset(&g, 0, sizeof(eflv_gen_t));
+
+    g.duration = 60;
+    g.interval = 2;
+    g.rate = 25;
+    g.video = EFLV_AVCVIDEOPACKET;
+    g.audio = EFLV_AAC;
+    g.video_bps = 800 * 1000 / 8;
+    g.audio_bps = 128 * 1000 / 8;
+    g.keyframes_object = 1;
+    g.seed = 1;
+
+    while ((c = getopt(argc, argv, "d:g:r:v:a:b:B:m:nR:")) != -1) {
+
+        switch (c) {
+
+        case 'd':
+            g.duration = atof(optarg);
+            break;
+
+        case 'g':
+            g.interval = atof(optarg);
+            break;
+
+        case 'r':
+            g.rate = atof(optarg);
+            break;
+
+        case 'v':
+            if (strcmp(optarg, "avc") == 0) {
+                g.video = EFLV_AVCVIDEOPACKET;
+
+            } else if (strcmp(optarg, "hevc") == 0) {
+                g.video = EFLV_HVC1;
+
+            } else if (strcmp(optarg, "h263") == 0) {
+                g.video = EFLV_H263VIDEOPACKET;
+
+            } else if (strcmp(optarg, "none") == 0) {
+                g.video = 0;
+
+            } else {
+                eflv_usage(argv[0]);
+                return 2;
+            }
+
+            break;
+
+        case 'a':
+            if (strcmp(optarg, "aac") == 0) {
+                g.audio = EFLV_AAC;
+
+            } else if (strcmp(optarg, "mp3") == 0) {
+                g.audio = EFLV_MP3;
+
+            } else if (strcmp(optarg, "none") == 0) {
+                g.audio = 0;
+
+            } else {
+                eflv_usage(argv[0]);
+                return 2;
+            }
+
+            break;
+
+        case 'b':
+            g.video_bps = atof(optarg) * 1000 / 8;
+            break;
+
+        case 'B':
+            g.audio_bps = atof(optarg) * 1000 / 8;
+            break;
+
+        case 'm':
+            g.padding = (size_t) (atof(optarg) * 1024);
+            break;
+
+        case 'n':
+            g.keyframes_object = 0;
+            break;
+
+        case 'R':
+            g.repeats = (size_t) atoi(optarg);
+            break;
+
+        default:
+            eflv_usage(argv[0]);
+            return 2;
+        }
+    }
+
+    if (optind != argc - 1
+        || g.duration <= 0 || g.interval <= 0 || g.rate <= 0
+        || g.video_bps < 0 || g.audio_bps < 0
+        || (g.video == 0 && g.audio == 0))
+    {
+        eflv_usage(argv[0]);
+        return 2;
+    }
+
+    g.name = argv[optind];
+
+    return eflv_gen(&g) == 0 ? 0 : 1;
+}
+
+
+static void
+eflv_usage(const char *name)
+{
+    fprintf(stderr,
+            "usage: %s [-d duration] [-g interval] [-r rate]"
+            " [-v avc|hevc|h263|none]\n"
+            "       [-a aac|mp3|none] [-b kbps] [-B kbps] [-m kbytes] [-n]"
+            " [-R count] file.flv\n", name);
+}
+
+
+/*
+ * the keyframe positions and the size of the body do not depend on the
+ * onMetaData tag before it, so the body is laid out by a measuring pass,
+ * and then written after the metadata that describes it
+ */
+
+static int
+eflv_gen(eflv_gen_t *g)
+{
+    u_char    *meta;
+    size_t     len;
+    uint64_t   body, base;
+
+    static u_char  header[] = "FLV\x1\x5\0\0\0\x9\0\0\0\0";
+
+    if (eflv_body(g) != 0) {
+        return -1;
+    }
+
+    body = g->pos;
+
+    /* the metadata size does not depend on the values written */
+
+    meta = malloc(1024 + 2 * 9 * g->keyframes + g->padding
+                  + 3 * 11 * g->repeats);
+    if (meta == NULL) {
+        fprintf(stderr, "eflv-gen: out of memory\n");
+        return -1;
+    }
+
+    len = eflv_metadata(g, meta, 0, 0);
+
+    base = sizeof(header) - 1 + EFLV_TAG_HEADER + len + 4;
+
+    (void) eflv_metadata(g, meta, base, base + body);
+
+    header[4] = (g->audio ? 0x04 : 0) | (g->video ? 0x01 : 0);
+
+    g->out = fopen(g->name, "w");
+    if (g->out == NULL) {
+        fprintf(stderr, "eflv-gen: fopen(\"%s\") failed: %s\n",
+                g->name, strerror(errno));
+        free(meta);
+        return -1;
+    }
+
+    g->pos = 0;
+    g->seed = 1;
+    g->keyframes = 0;
+
+    if (eflv_write(g, header, sizeof(header) - 1) != 0
+        || eflv_tag(g, EFLV_SCRIPTDATAOBJECT, 0, meta, len, len) != 0
+        || eflv_body(g) != 0)
+    {
+        free(meta);
+        fclose(g->out);
+        return -1;
+    }
+
+    free(meta);
+
+    if (fclose(g->out) != 0) {
+        fprintf(stderr, "eflv-gen: fclose(\"%s\") failed: %s\n",
+                g->name, strerror(errno));
+        return -1;
+    }
+
+    printf("%s: %llu keyframes, %.3f seconds, %llu bytes\n", g->name,
+           (unsigned long long) g->keyframes, g->duration,
+           (unsigned long long) g->pos);
+
+    free(g->times);
+    free(g->positions);
+
+    return 0;
+}
+
+
+/* the sequence headers, then video frames and audio frames by time */
+
+static int
+eflv_body(eflv_gen_t *g)
+{
+    int        key;
+    u_char     head[8];
+    size_t     size, key_size, frame_size, audio_size;
+    uint32_t   time;
+    uint64_t   frame, frames, sample, samples, gop, pos;
+    double     vtime, atime, audio_frame;
+    void      *p;
+
+    frames = g->video ? (uint64_t) (g->duration * g->rate) : 0;
+
+    audio_frame = (g->audio == EFLV_AAC ? 1024.0 : 1152.0) / EFLV_AUDIO_RATE;
+    samples = g->audio ? (uint64_t) (g->duration / audio_frame) : 0;
+
+    gop = (uint64_t) (g->interval * g->rate + 0.5);
+    if (gop == 0) {
+        gop = 1;
+    }
+
+    /* a keyframe is four times as large as the other frames */
+
+    frame_size = (size_t) (g->video_bps * gop / g->rate / (gop + 3));
+    key_size = 4 * frame_size;
+    audio_size = (size_t) (g->audio_bps * audio_frame);
+
+    if (g->video == EFLV_AVCVIDEOPACKET
+        && eflv_tag(g, EFLV_VIDEODATA, 0, eflv_avc_config,
+                    sizeof(eflv_avc_config), sizeof(eflv_avc_config))
+           != 0)
+    {
+        return -1;
+    }
+
+    if (g->video == EFLV_HVC1
+        && eflv_tag(g, EFLV_VIDEODATA, 0, eflv_hevc_config,
+                    sizeof(eflv_hevc_config), sizeof(eflv_hevc_config))
+           != 0)
+    {
+        return -1;
+    }
+
+    if (g->audio == EFLV_AAC
+        && eflv_tag(g, EFLV_AUDIODATA, 0, eflv_aac_config,
+                    sizeof(eflv_aac_config), sizeof(eflv_aac_config))
+           != 0)
+    {
+        return -1;
+    }
+
+    frame = 0;
+    sample = 0;
+
+    while (frame < frames || sample < samples) {
+
+        vtime = frame < frames ? frame / g->rate : g->duration;
+        atime = sample < samples ? sample * audio_frame : g->duration;
+
+        if (frame < frames && vtime <= atime) {
+            key = (frame % gop == 0);
+            time = (uint32_t) (vtime * 1000 + 0.5);
+            pos = g->pos;
+
+            /* up to 1/8 larger or smaller than the average */
+
+            size = key ? key_size : frame_size;
+            size = size - size / 8 + eflv_random(g) % (size / 4 + 1);
+
+            if (g->video == EFLV_AVCVIDEOPACKET) {
+                head[0] = key ? 0x17 : 0x27;
+                head[1] = 0x01;
+                head[2] = 0;
+                head[3] = 0;
+                head[4] = 0;
+
+                size = size < 5 ? 5 : size;
+
+                if (eflv_tag(g, EFLV_VIDEODATA, time, head, 5, size) != 0) {
+                    return -1;
+                }
+
+            } else if (g->video == EFLV_HVC1) {
+
+                /* CodedFrames with a zero composition time offset */
+
+                head[0] = key ? 0x91 : 0xa1;
+                memcpy(&head[1], "hvc1", 4);
+                head[5] = 0;
+                head[6] = 0;
+                head[7] = 0;
+
+                size = size < 8 ? 8 : size;
+
+                if (eflv_tag(g, EFLV_VIDEODATA, time, head, 8, size) != 0) {
+                    return -1;
+                }
+
+            } else {
+                head[0] = key ? 0x12 : 0x22;
+
+                size = size < 1 ? 1 : size;
+
+                if (eflv_tag(g, EFLV_VIDEODATA, time, head, 1, size) != 0) {
+                    return -1;
+                }
+            }
+
+            if (key && g->out == NULL) {
+
+                if (g->keyframes == g->nalloc) {
+                    g->nalloc = g->nalloc ? 2 * g->nalloc : 1024;
+
+                    p = realloc(g->times, g->nalloc * sizeof(double));
+                    if (p == NULL) {
+                        fprintf(stderr, "eflv-gen: out of memory\n");
+                        return -1;
+                    }
+
+                    g->times = p;
+
+                    p = realloc(g->positions, g->nalloc * sizeof(uint64_t));
+                    if (p == NULL) {
+                        fprintf(stderr, "eflv-gen: out of memory\n");
+                        return -1;
+                    }
+
+                    g->positions = p;
+                }
+
+                g->times[g->keyframes] = time / 1000.0;
+                g->positions[g->keyframes] = pos;
+            }
+
+            if (key) {
+                g->keyframes++;
+            }
+
+            frame++;
+            continue;
+        }
+
+        time = (uint32_t) (atime * 1000 + 0.5);
+
+        if (g->audio == EFLV_AAC) {
+            head[0] = 0xaf;
+            head[1] = 0x01;
+            size = audio_size < 2 ? 2 : audio_size;
+
+            if (eflv_tag(g, EFLV_AUDIODATA, time, head, 2, size) != 0) {
+                return -1;
+            }
+
+        } else {
+            head[0] = 0x2f;
+            size = audio_size < 1 ? 1 : audio_size;
+
+            if (eflv_tag(g, EFLV_AUDIODATA, time, head, 1, size) != 0) {
+                return -1;
+            }
+        }
+
+        sample++;
+    }
+
+    return 0;
+}
+
+
+/* a tag of "len" data bytes, which start with "head" */
+
+static int
+eflv_tag(eflv_gen_t *g, int type, uint32_t time, u_char *head, size_t hlen,
+    size_t len)
+{
+    size_t  n;
+    u_char  h[EFLV_TAG_HEADER], prev[4];
+
+    static u_char  fill[65536];
+
+    if (g->out == NULL) {
+        g->pos += EFLV_TAG_HEADER + len + 4;
+        return 0;
+    }
+
+    h[0] = (u_char) type;
+    h[1] = (u_char) (len >> 16);
+    h[2] = (u_char) (len >> 8);
+    h[3] = (u_char) len;
+    h[4] = (u_char) (time >> 16);
+    h[5] = (u_char) (time >> 8);
+    h[6] = (u_char) time;
+    h[7] = (u_char) (time >> 24);
+    h[8] = 0;
+    h[9] = 0;
+    h[10] = 0;
+
+    n = EFLV_TAG_HEADER + len;
+
+    prev[0] = (u_char) (n >> 24);
+    prev[1] = (u_char) (n >> 16);
+    prev[2] = (u_char) (n >> 8);
+    prev[3] = (u_char) n;
+
+    if (eflv_write(g, h, EFLV_TAG_HEADER) != 0
+        || eflv_write(g, head, hlen) != 0)
+    {
+        return -1;
+    }
+
+    for (len -= hlen; len; len -= n) {
+        n = len < sizeof(fill) ? len : sizeof(fill);
+
+        if (eflv_write(g, fill, n) != 0) {
+            return -1;
+        }
+    }
+
+    return eflv_write(g, prev, 4);
+}
+
+
+static int
+eflv_write(eflv_gen_t *g, const void *data, size_t len)
+{
+    if (len && fwrite(data, 1, len, g->out) != len) {
+        fprintf(stderr, "eflv-gen: fwrite(\"%s\") failed: %s\n",
+                g->name, strerror(errno));
+        return -1;
+    }
+
+    g->pos += len;
+
+    return 0;
+}
+
+
+/* the onMetaData script data, keyframe positions are relative to "base" */
+
+static size_t
+eflv_metadata(eflv_gen_t *g, u_char *p, uint64_t base, uint64_t size)
+{
+    size_t     n;
+    u_char    *start;
+    uint64_t   i, count;
+
+    count = 9 + (g->keyframes_object ? 1 : 0) + (g->padding ? 1 : 0)
+            + 3 * g->repeats;
+
+    start = p;
+
+    *p++ = 0x02;
+    *p++ = 0;
+    *p++ = 10;
+    p = (u_char *) memcpy(p, "onMetaData", 10) + 10;
+
+    *p++ = 0x08;
+    *p++ = (u_char) (count >> 24);
+    *p++ = (u_char) (count >> 16);
+    *p++ = (u_char) (count >> 8);
+    *p++ = (u_char) count;
+
+    p = eflv_put_number(eflv_put_name(p, "duration"), g->duration);
+    p = eflv_put_number(eflv_put_name(p, "filesize"), (double) size);
+    p = eflv_put_number(eflv_put_name(p, "width"), g->video ? 640 : 0);
+    p = eflv_put_number(eflv_put_name(p, "height"), g->video ? 360 : 0);
+    p = eflv_put_number(eflv_put_name(p, "framerate"),
+                        g->video ? g->rate : 0);
+    p = eflv_put_number(eflv_put_name(p, "videocodecid"), g->video);
+    p = eflv_put_number(eflv_put_name(p, "audiocodecid"), g->audio);
+    p = eflv_put_number(eflv_put_name(p, "videodatarate"),
+                        g->video_bps * 8 / 1000);
+    p = eflv_put_number(eflv_put_name(p, "audiodatarate"),
+                        g->audio_bps * 8 / 1000);
+
+    /* null duplicates of the properties that are rewritten for clips */
+
+    for (n = 0; n < g->repeats; n++) {
+        p = eflv_put_name(p, "duration");
+        *p++ = 0x05;
+        p = eflv_put_name(p, "filesize");
+        *p++ = 0x05;
+        p = eflv_put_name(p, "datasize");
+        *p++ = 0x05;
+    }
+
+    if (g->keyframes_object) {
+        p = eflv_put_name(p, "keyframes");
+        *p++ = 0x03;
+
+        p = eflv_put_name(p, "times");
+        *p++ = 0x0a;
+        *p++ = (u_char) (g->keyframes >> 24);
+        *p++ = (u_char) (g->keyframes >> 16);
+        *p++ = (u_char) (g->keyframes >> 8);
+        *p++ = (u_char) g->keyframes;
+
+        for (i = 0; i < g->keyframes; i++) {
+            p = eflv_put_number(p, g->times[i]);
+        }
+
+        p = eflv_put_name(p, "filepositions");
+        *p++ = 0x0a;
+        *p++ = (u_char) (g->keyframes >> 24);
+        *p++ = (u_char) (g->keyframes >> 16);
+        *p++ = (u_char) (g->keyframes >> 8);
+        *p++ = (u_char) g->keyframes;
+
+        for (i = 0; i < g->keyframes; i++) {
+            p = eflv_put_number(p, (double) (base + g->positions[i]));
+        }
+
+        *p++ = 0;
+        *p++ = 0;
+        *p++ = 0x09;
+    }
+
+    if (g->padding) {
+        p = eflv_put_name(p, "padding");
+        *p++ = 0x0c;
+        *p++ = (u_char) (g->padding >> 24);
+        *p++ = (u_char) (g->padding >> 16);
+        *p++ = (u_char) (g->padding >> 8);
+        *p++ = (u_char) g->padding;
+
+        for (n = 0; n < g->padding; n++) {
+            *p++ = 'a' + n % 26;
+        }
+    }
+
+    *p++ = 0;
+    *p++ = 0;
+    *p++ = 0x09;
+
+    return p - start;
+}
+
+
+static u_char *
+eflv_put_name(u_char *p, const char *name)
+{
+    size_t  len;
+
+    len = strlen(name);
+
+    *p++ = (u_char) (len >> 8);
+    *p++ = (u_char) len;
+
+    memcpy(p, name, len);
+
+    return p + len;
+}
+
+
+static u_char *
+eflv_put_number(u_char *p, double value)
+{
+    int       i;
+    uint64_t  v;
+
+    memcpy(&v, &value, sizeof(double));
+
+    *p++ = 0x00;
+
+    for (i = 7; i >= 0; i--) {
+        *p++ = (u_char) (v >> (i * 8));
+    }
+
+    return p;
+}
+
+
+static uint32_t
+eflv_random(eflv_gen_t *g)
+{
+    g->seed = g->seed * 1103515245 + 12345;
+
+    return (g->seed >> 16) & 0x7fff;
+}
@@ -0,0 +1,766 @@
+
+/*
+ * Copyright (C) xunen <leixunen@gmail.com> and others.
+ * Copyright (C) Leevid Inc.
+ */
+
+
+/*
+ * eflv-index: builds the "<file>.eidx" sidecar keyframe index read by
+ * the "eflv_index_file" directive.
+ *
+ *     eflv-index [-r] [-u] [-q] [-j threads] file.flv | directory ...
+ *
+ *     -r    index the "*.flv" files in the given directories and
+ *           their subdirectories
+ *     -u    skip files with an index built for their size and
+ *           modification time
+ *     -q    only report errors
+ *     -j    the number of files indexed in parallel, the number of
+ *           online CPUs by default
+ *
+ * The keyframe index is built by walking all tags of the mapped file,
+ * so it does not depend on the onMetaData keyframes object; files without
+ * video are indexed by their audio frames, a second apart.  Files with
+ * a broken tag chain, where a PreviousTagSize does not match the size of
+ * the tag before it, are reported and not indexed; a truncated last tag
+ * is accepted.
+ */
+
+
+#define _FILE_OFFSET_BITS  64
+
+#include <sys/types.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <dirent.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "ngx_http_eflv_index_file.h"
+#include "ngx_http_eflv_parse.h"
+
+
+#define EFLV_TAG_HEADER         ((off_t) sizeof(ngx_flv_tag_t))
+#define EFLV_MAX_THREADS        256
+
+
+typedef struct {
+    u_char       *data;
+    size_t        len;
+    off_t         pos;
+} eflv_tag_t;
+
+
+typedef struct {
+    const char   *name;
+    off_t         size;
+    u_char       *map;
+
+    double       *times;
+    int64_t      *filepositions;
+    uint64_t      keyframes;
+    uint64_t      nalloc;
+
+    eflv_tag_t    metadata;
+    eflv_tag_t    video;
+    eflv_tag_t    audio;
+
+    /* a video tag has been met, audio frames are no more seek points */
+    int           has_video;
+} eflv_file_t;
+
+
+typedef struct {
+    char             **names;
+    size_t             nnames;
+    size_t             nalloc;
+
+    /* the next file to index, taken by the threads under the mutex */
+    size_t             next;
+    pthread_mutex_t    mutex;
+
+    int                update;
+    int                quiet;
+    int                failed;
+} eflv_queue_t;
+
+
+static int eflv_add(eflv_queue_t *q, const char *name, int recurse);
+static int eflv_add_dir(eflv_queue_t *q, const char *dir);
+static void *eflv_thread(void *data);
+static int eflv_index(eflv_queue_t *q, const char *name);
+static int eflv_uptodate(const char *name, struct stat *st);
+static int eflv_walk(eflv_file_t *f, off_t pos, uint32_t *last);
+static void eflv_read_tag(eflv_file_t *f, off_t pos, size_t len,
+    eflv_tag_t *tag);
+static int eflv_add_keyframe(eflv_file_t *f, double time, off_t pos);
+static uint64_t eflv_duration(eflv_tag_t *metadata, double *duration);
+static int eflv_write(eflv_file_t *f, struct stat *st, double duration,
+    uint64_t duration_offset);
+
+
+int
+main(int argc, char **argv)
+{
+    int            c, i, recurse;
+    long           n;
+    pthread_t      tid[EFLV_MAX_THREADS];
+    eflv_queue_t   q;
+
+    memset(&q, 0, sizeof(eflv_queue_t));
+
+    recurse = 0;
+
+    n = sysconf(_SC_NPROCESSORS_ONLN);
+
+    while ((c = getopt(argc, argv, "j:qru")) != -1) {
+
+        switch (c) {
+
+        case 'j':
+            n = strtol(optarg, NULL, 10);
+
+            if (n < 1 || n > EFLV_MAX_THREADS) {
+                fprintf(stderr, "eflv-index: invalid number of threads "
+                        "\"%s\"\n", optarg);
+                return 2;
+            }
+
+            break;
+
+        case 'q':
+            q.quiet = 1;
+            break;
+
+        case 'r':
+            recurse = 1;
+            break;
+
+        case 'u':
+            q.update = 1;
+            break;
+
+        default:
+            goto usage;
+        }
+    }
+
+    if (optind == argc) {
+        goto usage;
+    }
+
+    for (i = optind; i < argc; i++) {
+        if (eflv_add(&q, argv[i], recurse) != 0) {
+            q.failed = 1;
+        }
+    }
+
+    if (n < 1) {
+        n = 1;
+
+    } else if (n > EFLV_MAX_THREADS) {
+        n = EFLV_MAX_THREADS;
+    }
+
+    if ((size_t) n > q.nnames) {
+        n = q.nnames ? (long) q.nnames : 1;
+    }
+
+    pthread_mutex_init(&q.mutex, NULL);
+
+    for (i = 0; i < n; i++) {
+        if (pthread_create(&tid[i], NULL, eflv_thread, &q) != 0) {
+            fprintf(stderr, "eflv-index: pthread_create() failed\n");
+            return 1;
+        }
+    }
+
+    for (i = 0; i < n; i++) {
+        pthread_join(tid[i], NULL);
+    }
+
+    return q.failed;
+
+usage:
+
+    fprintf(stderr, "usage: %s [-r] [-u] [-q] [-j threads] "
+            "file.flv | directory ...\n", argv[0]);
+
+    return 2;
+}
+
+
+static int
+eflv_add(eflv_queue_t *q, const char *name, int recurse)
+{
+    char         **names;
+    size_t         nalloc;
+    struct stat    st;
+
+    if (recurse) {
+        if (stat(name, &st) == -1) {
+            fprintf(stderr, "eflv-index: stat(\"%s\") failed: %s\n",
+                    name, strerror(errno));
+            return -1;
+        }
+
+        if (S_ISDIR(st.st_mode)) {
+            return eflv_add_dir(q, name);
+        }
+    }
+
+    if (q->nnames == q->nalloc) {
+        nalloc = q->nalloc ? 2 * q->nalloc : 256;
+
+        names = realloc(q->names, nalloc * sizeof(char *));
+        if (names == NULL) {
+            return -1;
+        }
+
+        q->names = names;
+        q->nalloc = nalloc;
+    }
+
+    q->names[q->nnames] = strdup(name);
+    if (q->names[q->nnames] == NULL) {
+        return -1;
+    }
+
+    q->nnames++;
+
+    return 0;
+}
+
+
+static int
+eflv_add_dir(eflv_queue_t *q, const char *dir)
+{
+    int             rc;
+    DIR            *d;
+    char           *path;
+    size_t          len, dlen;
+    struct stat     st;
+    struct dirent  *de;
+
+    d = opendir(dir);
+
+    if (d == NULL) {
+        fprintf(stderr, "eflv-index: opendir(\"%s\") failed: %s\n",
+                dir, strerror(errno));
+        return -1;
+    }
+
+    rc = 0;
+    dlen = strlen(dir);
+
+    while ((de = readdir(d)) != NULL) {
+
+        if (de->d_name[0] == '.') {
+            continue;
+        }
+
+        len = dlen + 1 + strlen(de->d_name) + 1;
+
+        path = malloc(len);
+        if (path == NULL) {
+            rc = -1;
+            break;
+        }
+
+        snprintf(path, len, "%s/%s", dir, de->d_name);
+
+        if (lstat(path, &st) == -1) {
+            fprintf(stderr, "eflv-index: lstat(\"%s\") failed: %s\n",
+                    path, strerror(errno));
+            rc = -1;
+
+        } else if (S_ISDIR(st.st_mode)) {
+            if (eflv_add_dir(q, path) != 0) {
+                rc = -1;
+            }
+
+        } else if (S_ISREG(st.st_mode)
+                   && len - 1 - dlen - 1 > 4
+                   && strcmp(path + len - 5, ".flv") == 0)
+        {
+            if (eflv_add(q, path, 0) != 0) {
+                rc = -1;
+            }
+        }
+
+        free(path);
+    }
+
+    closedir(d);
+
+    return rc;
+}
+
+
+static void *
+eflv_thread(void *data)
+{
+    eflv_queue_t  *q = data;
+
+    size_t   n;
+
+    for ( ;; ) {
+        pthread_mutex_lock(&q->mutex);
+        n = q->next++;
+        pthread_mutex_unlock(&q->mutex);
+
+        if (n >= q->nnames) {
+            return NULL;
+        }
+
+        if (eflv_index(q, q->names[n]) != 0) {
+            pthread_mutex_lock(&q->mutex);
+            q->failed = 1;
+            pthread_mutex_unlock(&q->mutex);
+        }
+    }
+}
+
+
+static int
+eflv_index(eflv_queue_t *q, const char *name)
+{
+    int            fd, rc;
+    double         duration;
+    uint32_t       last;
+    uint64_t       duration_offset;
+    eflv_file_t    f;
+    struct stat    st;
+
+    memset(&f, 0, sizeof(eflv_file_t));
+
+    f.name = name;
+
+    fd = open(name, O_RDONLY);
+
+    if (fd == -1) {
+        fprintf(stderr, "eflv-index: open(\"%s\") failed: %s\n",
+                name, strerror(errno));
+        return -1;
+    }
+
+    if (fstat(fd, &st) == -1) {
+        fprintf(stderr, "eflv-index: fstat(\"%s\") failed: %s\n",
+                name, strerror(errno));
+        close(fd);
+        return -1;
+    }
+
+    if (q->update && eflv_uptodate(name, &st)) {
+        close(fd);
+        return 0;
+    }
+
+    f.size = st.st_size;
+
+    if (f.size < 9) {
+        fprintf(stderr, "eflv-index: \"%s\" is not an flv file\n", name);
+        close(fd);
+        return -1;
+    }
+
+    f.map = mmap(NULL, (size_t) f.size, PROT_READ, MAP_SHARED, fd, 0);
+
+    close(fd);
+
+    if (f.map == MAP_FAILED) {
+        fprintf(stderr, "eflv-index: mmap(\"%s\") failed: %s\n",
+                name, strerror(errno));
+        return -1;
+    }
+
+    (void) madvise(f.map, (size_t) f.size, MADV_SEQUENTIAL);
+
+    rc = -1;
+
+    if (memcmp(f.map, "FLV", 3) != 0) {
+        fprintf(stderr, "eflv-index: \"%s\" is not an flv file\n", name);
+        goto done;
+    }
+
+    last = 0;
+
+    if (eflv_walk(&f, (off_t) ngx_flv_get_32value(f.map + 5) + 4, &last)
+        != 0)
+    {
+        goto done;
+    }
+
+    duration_offset = eflv_duration(&f.metadata, &duration);
+
+    if (duration_offset == 0) {
+        duration = last / 1000.0;
+    }
+
+    rc = eflv_write(&f, &st, duration, duration_offset);
+
+    if (rc == 0 && !q->quiet) {
+        printf("%s: %llu keyframes, %.3f seconds\n", name,
+               (unsigned long long) f.keyframes, duration);
+    }
+
+done:
+
+    free(f.times);
+
+    munmap(f.map, (size_t) f.size);
+
+    return rc;
+}
+
+
+/* an index of the current version built for the size and mtime given */
+
+static int
+eflv_uptodate(const char *name, struct stat *st)
+{
+    int                          fd;
+    char                        *path;
+    size_t                       len;
+    ssize_t                      n;
+    ngx_http_eflv_index_file_t   h;
+
+    len = strlen(name) + sizeof(NGX_HTTP_EFLV_INDEX_FILE_EXT);
+
+    path = malloc(len);
+    if (path == NULL) {
+        return 0;
+    }
+
+    snprintf(path, len, "%s" NGX_HTTP_EFLV_INDEX_FILE_EXT, name);
+
+    fd = open(path, O_RDONLY);
+
+    free(path);
+
+    if (fd == -1) {
+        return 0;
+    }
+
+    n = pread(fd, &h, sizeof(h), 0);
+
+    close(fd);
+
+    return n == (ssize_t) sizeof(h)
+           && memcmp(h.magic, NGX_HTTP_EFLV_INDEX_FILE_MAGIC, 4) == 0
+           && h.version == NGX_HTTP_EFLV_INDEX_FILE_VERSION
+           && h.size == (uint64_t) st->st_size
+           && h.mtime == (int64_t) st->st_mtime;
+}
+
+
+static int
+eflv_walk(eflv_file_t *f, off_t pos, uint32_t *last)
+{
+    size_t          len;
+    u_char         *p;
+    uint32_t        timestamp, prev;
+    ngx_flv_tag_t  *tag;
+
+    while (pos + EFLV_TAG_HEADER <= f->size) {
+
+        tag = (ngx_flv_tag_t *) (f->map + pos);
+        p = (u_char *) tag + EFLV_TAG_HEADER;
+
+        len = ngx_flv_tag_size(tag);
+        timestamp = ngx_flv_tag_timestamp(tag);
+
+        /* the PreviousTagSize of a complete tag */
+
+        if (pos + (off_t) len <= f->size) {
+            prev = ngx_flv_get_32value(f->map + pos + len - 4);
+
+            if (prev != len - 4) {
+                fprintf(stderr, "eflv-index: corrupt file \"%s\": "
+                        "PreviousTagSize %u of the tag at offset %lld, "
+                        "expected %u\n", f->name, prev, (long long) pos,
+                        (unsigned) (len - 4));
+                return -1;
+            }
+        }
+
+        switch (tag->type) {
+
+        case NGX_FLV_SCRIPTDATAOBJECT:
+
+            if (f->metadata.data == NULL) {
+                eflv_read_tag(f, pos, len, &f->metadata);
+            }
+
+            break;
+
+        case NGX_FLV_AUDIODATA:
+
+            if (pos + EFLV_TAG_HEADER + 2 > f->size) {
+                break;
+            }
+
+            if ((p[0] >> 4) == NGX_FLV_AAC && p[1] == 0) {
+
+                if (f->audio.data == NULL) {
+                    eflv_read_tag(f, pos, len, &f->audio);
+                }
+
+                break;
+            }
+
+            /* audio-only files are seeked by their frames */
+
+            if (!f->has_video
+                && (f->keyframes == 0
+                    || timestamp / 1000.0 >= f->times[f->keyframes - 1]
+                                             + NGX_FLV_AUDIO_SEEK_STEP)
+                && eflv_add_keyframe(f, timestamp / 1000.0, pos) != 0)
+            {
+                return -1;
+            }
+
+            break;
+
+        case NGX_FLV_VIDEODATA:
+
+            if (!f->has_video) {
+                f->has_video = 1;
+                f->keyframes = 0;
+            }
+
+            if (pos + EFLV_TAG_HEADER + 2 > f->size) {
+                break;
+            }
+
+            if (ngx_http_eflv_tag_video_config(tag)) {
+
+                if (f->video.data == NULL) {
+                    eflv_read_tag(f, pos, len, &f->video);
+                }
+
+                break;
+            }
+
+            if (ngx_http_eflv_tag_keyframe(tag)
+                && eflv_add_keyframe(f, timestamp / 1000.0, pos) != 0)
+            {
+                return -1;
+            }
+
+            break;
+
+        default:
+            fprintf(stderr, "eflv-index: unexpected tag type %d "
+                    "at offset %lld in \"%s\"\n",
+                    tag->type, (long long) pos, f->name);
+            return -1;
+        }
+
+        if (timestamp > *last) {
+            *last = timestamp;
+        }
+
+        pos += len;
+    }
+
+    return 0;
+}
+
+
+static void
+eflv_read_tag(eflv_file_t *f, off_t pos, size_t len, eflv_tag_t *tag)
+{
+    if (pos + (off_t) len > f->size) {
+        return;
+    }
+
+    tag->data = f->map + pos;
+    tag->len = len;
+    tag->pos = pos;
+}
+
+
+static int
+eflv_add_keyframe(eflv_file_t *f, double time, off_t pos)
+{
+    uint64_t   nalloc;
+    double    *times;
+    int64_t   *filepositions;
+
+    if (f->keyframes && time <= f->times[f->keyframes - 1]) {
+        return 0;
+    }
+
+    if (f->keyframes == f->nalloc) {
+        nalloc = f->nalloc ? 2 * f->nalloc : 256;
+
+        times = malloc(nalloc * (sizeof(double) + sizeof(int64_t)));
+        if (times == NULL) {
+            return -1;
+        }
+
+        filepositions = (int64_t *) (times + nalloc);
+
+        if (f->keyframes) {
+            memcpy(times, f->times, f->keyframes * sizeof(double));
+            memcpy(filepositions, f->filepositions,
+                   f->keyframes * sizeof(int64_t));
+            free(f->times);
+        }
+
+        f->times = times;
+        f->filepositions = filepositions;
+        f->nalloc = nalloc;
+    }
+
+    f->times[f->keyframes] = time;
+    f->filepositions[f->keyframes] = pos;
+    f->keyframes++;
+
+    return 0;
+}
+
+
+/*
+ * finds the "duration" number of onMetaData; returns its offset within
+ * the tag, as patched by tflv, or 0
+ */
+
+static uint64_t
+eflv_duration(eflv_tag_t *metadata, double *duration)
+{
+    u_char  *p, *v, *last, *name;
+    size_t   len;
+
+    p = ngx_http_eflv_amf_metadata(metadata->data, metadata->len, &last);
+    if (p == NULL) {
+        return 0;
+    }
+
+    p += (*p == NGX_FLV_AMF_ECMA_ARRAY) ? 5 : 1;
+
+    for ( ;; ) {
+        v = ngx_http_eflv_amf_next_prop(p, last, &name, &len);
+
+        if (v == NULL) {
+            return 0;
+        }
+
+        if (len == 8 && memcmp(name, "duration", 8) == 0
+            && *v == NGX_FLV_AMF_NUMBER && last - v >= 9)
+        {
+            *duration = ngx_flv_get_double(v + 1);
+            return v + 1 - metadata->data;
+        }
+
+        p = ngx_http_eflv_amf_skip(v, last, 1);
+        if (p == NULL) {
+            return 0;
+        }
+    }
+}
+
+
+static int
+eflv_write(eflv_file_t *f, struct stat *st, double duration,
+    uint64_t duration_offset)
+{
+    int                          fd;
+    FILE                        *out;
+    char                        *name, *temp;
+    size_t                       len, size;
+    ngx_http_eflv_index_file_t   h;
+
+    len = strlen(f->name);
+
+    /* "file.flv.eidx" and "file.flv.eidx.XXXXXX" */
+
+    size = len + sizeof(NGX_HTTP_EFLV_INDEX_FILE_EXT);
+
+    name = malloc(2 * size + 7);
+    if (name == NULL) {
+        return -1;
+    }
+
+    temp = name + size;
+
+    snprintf(name, size, "%s" NGX_HTTP_EFLV_INDEX_FILE_EXT, f->name);
+    snprintf(temp, size + 7, "%s" NGX_HTTP_EFLV_INDEX_FILE_EXT ".XXXXXX",
+             f->name);
+
+    memset(&h, 0, sizeof(ngx_http_eflv_index_file_t));
+
+    memcpy(h.magic, NGX_HTTP_EFLV_INDEX_FILE_MAGIC, 4);
+    h.version = NGX_HTTP_EFLV_INDEX_FILE_VERSION;
+    h.size = (uint64_t) st->st_size;
+    h.mtime = (int64_t) st->st_mtime;
+    h.duration = duration;
+    h.keyframes = f->keyframes;
+    h.duration_offset = duration_offset;
+    h.metadata_len = f->metadata.len;
+    h.video_len = f->video.len;
+    h.audio_len = f->audio.len;
+    h.video_pos = (uint64_t) f->video.pos;
+    h.audio_pos = (uint64_t) f->audio.pos;
+
+    fd = mkstemp(temp);
+
+    if (fd == -1) {
+        fprintf(stderr, "eflv-index: mkstemp(\"%s\") failed: %s\n",
+                temp, strerror(errno));
+        free(name);
+        return -1;
+    }
+
+    (void) fchmod(fd, 0644);
+
+    out = fdopen(fd, "w");
+    if (out == NULL) {
+        close(fd);
+        goto failed;
+    }
+
+    if (fwrite(&h, sizeof(h), 1, out) != 1
+        || fwrite(f->times, sizeof(double), f->keyframes, out)
+           != f->keyframes
+        || fwrite(f->filepositions, sizeof(int64_t), f->keyframes, out)
+           != f->keyframes
+        || fwrite(f->metadata.data, 1, f->metadata.len, out)
+           != f->metadata.len
+        || fwrite(f->video.data, 1, f->video.len, out) != f->video.len
+        || fwrite(f->audio.data, 1, f->audio.len, out) != f->audio.len)
+    {
+        fclose(out);
+        goto failed;
+    }
+
+    if (fclose(out) != 0) {
+        goto failed;
+    }
+
+    if (rename(temp, name) == -1) {
+        goto failed;
+    }
+
+    free(name);
+
+    return 0;
+
+failed:
+
+    fprintf(stderr, "eflv-index: writing \"%s\" failed: %s\n",
+            name, strerror(errno));
+
+    unlink(temp);
+    free(name);
+
+    return -1;
+}
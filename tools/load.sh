@@ -0,0 +1,202 @@
+#!/bin/sh
+
+# Copyright (C) xunen <leixunen@gmail.com> and others.
+# Copyright (C) Leevid Inc.
+
+
+# load.sh: builds nginx with the module, serves a corpus written by
+# eflv-gen and runs wrk over random tflv time seeks and sflv byte seeks.
+# One JSON object per location is written to $BENCH_DIR/load.json.
+#
+#     NGINX_SRC=/path/to/nginx-1.x.y tools/load.sh
+#
+#     NGINX_SRC      the nginx source tree, required
+#     WRK            the wrk binary, "wrk" by default
+#     PORT           the port nginx listens on, 8089 by default
+#     DURATION       the length of each wrk run, 30s by default
+#     CONNECTIONS    the connections of wrk, 64 by default
+#     THREADS        the threads of wrk, 4 by default
+#     BENCH_DIR      the corpus and results, tools/bench by default
+#
+# nginx is built without the rewrite and gzip modules, so neither PCRE nor
+# zlib is needed, into $BENCH_DIR/load, which is also its prefix.
+
+
+set -e
+
+tools=$(cd "$(dirname "$0")" && pwd)
+module=$(dirname "$tools")
+
+: "${NGINX_SRC:?is not set to the nginx source tree}"
+
+WRK=${WRK:-wrk}
+PORT=${PORT:-8089}
+DURATION=${DURATION:-30s}
+CONNECTIONS=${CONNECTIONS:-64}
+THREADS=${THREADS:-4}
+BENCH_DIR=${BENCH_DIR:-$tools/bench}
+
+mkdir -p "$BENCH_DIR"
+bench=$(cd "$BENCH_DIR" && pwd)
+load=$bench/load
+objs=$load/objs
+
+mkdir -p "$load/conf" "$load/logs"
+
+nginx() {
+    "$objs/nginx" -p "$load/" -c conf/nginx.conf "$@"
+}
+
+
+# the corpus: eflv-gen writes the same file for the same arguments, so the
+# files shared with "make bench" are only written once
+
+[ -x "$tools/eflv-gen" ] || make -C "$tools" eflv-gen
+
+gen() {
+    file=$1
+    shift
+
+    [ -f "$bench/$file" ] || "$tools/eflv-gen" "$@" "$bench/$file" >/dev/null
+}
+
+gen 1h.flv -d 3600 -g 2 -r 25 -b 200 -B 32
+gen big.flv -d 24000 -g 2 -r 5 -b 16 -B 8 -m 400
+gen nokeyframes.flv -d 600 -n
+
+# name:duration in seconds for tflv, name:size in bytes for sflv
+
+times="1h.flv:3600 big.flv:24000 nokeyframes.flv:600"
+sizes=
+for f in 1h.flv big.flv nokeyframes.flv; do
+    sizes="$sizes $f:$(wc -c < "$bench/$f" | tr -d ' ')"
+done
+
+
+echo "load.sh: building nginx from $NGINX_SRC"
+
+(
+    cd "$NGINX_SRC"
+
+    ./configure --prefix="$load" --builddir="$objs" --with-threads \
+                --without-http_rewrite_module --without-http_gzip_module \
+                --add-module="$module" > "$load/configure.log"
+
+    make -f "$objs/Makefile" \
+         -j"$(getconf _NPROCESSORS_ONLN 2>/dev/null || echo 2)" \
+         > "$load/make.log"
+)
+
+
+cat > "$load/conf/nginx.conf" << END
+worker_processes  auto;
+pid               logs/nginx.pid;
+error_log         logs/error.log warn;
+
+events {
+    worker_connections  4096;
+}
+
+http {
+    access_log  off;
+    sendfile    on;
+    aio         threads;
+
+    eflv_index_cache_zone  flv_index:10m;
+
+    server {
+        listen  127.0.0.1:$PORT;
+
+        location /t/ {
+            alias  $bench/;
+            tflv;
+            eflv_index_cache  flv_index;
+        }
+
+        location /s/ {
+            alias  $bench/;
+            sflv;
+            eflv_index_cache  flv_index;
+        }
+    }
+}
+END
+
+
+# each wrk thread seeds its own random seeks with its number, so the runs
+# request the same URLs for comparing builds; done() prints the results
+# as the last line of the output of wrk
+
+cat > "$load/seek.lua" << 'END'
+local location = os.getenv("EFLV_LOCATION")
+local files = {}
+local threads = 0
+
+for name, limit in os.getenv("EFLV_FILES"):gmatch("(%S+):(%d+)") do
+    files[#files + 1] = { name = name, limit = tonumber(limit) }
+end
+
+function setup(thread)
+    threads = threads + 1
+    thread:set("id", threads)
+end
+
+function init(args)
+    math.randomseed(id)
+end
+
+function request()
+    local f = files[math.random(#files)]
+    local start = math.random(0, f.limit - 1)
+    local uri
+
+    if location == "tflv" then
+        uri = "/t/" .. f.name .. "?start=" .. start .. "&end=" .. start + 60
+    else
+        uri = "/s/" .. f.name .. "?start=" .. start
+    end
+
+    return wrk.format(nil, uri)
+end
+
+function done(summary, latency, requests)
+    local e = summary.errors
+    local seconds = summary.duration / 1e6
+
+    io.write(string.format('{"location":"%s","connections":%d,'
+                           .. '"requests":%d,"errors":%d,'
+                           .. '"requests_per_sec":%.1f,"mbps":%.1f,'
+                           .. '"latency_p50_ms":%.3f,'
+                           .. '"latency_p99_ms":%.3f}\n',
+                           location,
+                           tonumber(os.getenv("EFLV_CONNECTIONS")),
+                           summary.requests,
+                           e.connect + e.read + e.write + e.status
+                           + e.timeout,
+                           summary.requests / seconds,
+                           summary.bytes / seconds / 1e6,
+                           latency:percentile(50) / 1e3,
+                           latency:percentile(99) / 1e3))
+end
+END
+
+
+nginx -s stop 2>/dev/null || true
+
+nginx
+trap 'nginx -s stop' EXIT
+
+: > "$bench/load.json"
+
+run() {
+    echo "load.sh: $1 for $DURATION"
+
+    EFLV_LOCATION=$1 EFLV_FILES=$2 EFLV_CONNECTIONS=$CONNECTIONS \
+    "$WRK" -t "$THREADS" -c "$CONNECTIONS" -d "$DURATION" \
+           -s "$load/seek.lua" "http://127.0.0.1:$PORT/" > "$load/wrk.log"
+
+    tail -n 1 "$load/wrk.log" | grep '^{' | tee -a "$bench/load.json"
+}
+
+run tflv "$times"
+run sflv "$sizes"